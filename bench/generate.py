@@ -0,0 +1,116 @@
+#!/usr/bin/env python3
+#    Copyright (C) 2022 Tobias Heineken
+#
+#    This program is free software: you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, either version 3 of the License, or
+#    (at your option) any later version.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+"""Writes a synthetic naz program of configurable size to stdout.
+
+Functions 1 to --functions get random arithmetic bodies of --ops instructions each,
+function 8 calls them all in turn 100 times, function 9 repeats that --rounds times.
+The generator follows the accumulator and the variables, so the program stays within
+the limited range and never divides by zero. It runs the same in limited and -u mode.
+"""
+
+import argparse
+import random
+import sys
+
+LIMIT = 127
+# Variables of the loops in functions 8 and 9, the bodies use the others
+LOOP_VARS = (2, 4, 5, 7)
+SCRATCH_VARS = (0, 1, 3, 6, 8, 9)
+
+
+def move(acc, target, out):
+    """Appends Na and Ns tupels bringing the accumulator from acc to target, returns target"""
+    while acc != target:
+        step = max(-9, min(9, target - acc))
+        out.append("%d%s" % (abs(step), "a" if step > 0 else "s"))
+        acc += step
+    return acc
+
+
+def printable(rng):
+    return rng.choice([10] + list(range(32, 127)))
+
+
+def body(rng, ops, output_every):
+    out = ["0m"]
+    acc = 0
+    stored = {}
+    for i in range(ops):
+        kind = rng.choice("asmdpvw")
+        digit = rng.randint(1, 9)
+        if kind == "a" and acc + digit <= LIMIT:
+            out.append("%da" % digit)
+            acc += digit
+        elif kind == "s" and acc - digit >= -LIMIT:
+            out.append("%ds" % digit)
+            acc -= digit
+        elif kind == "m" and 0 <= acc * digit <= LIMIT:
+            # -u keeps the sign of a negative accumulator only for negative factors
+            out.append("%dm" % digit)
+            acc *= digit
+        elif kind == "d" and acc >= 0:
+            # Negative numbers round differently in the two modes as well
+            out.append("%dd" % digit)
+            acc //= digit
+        elif kind == "p" and acc >= 0:
+            out.append("%dp" % digit)
+            acc %= digit
+        elif kind == "w":
+            var = rng.choice(SCRATCH_VARS)
+            out.append("2x%dv" % var)
+            stored[var] = acc
+        elif kind == "v" and stored:
+            var = rng.choice(sorted(stored))
+            out.append("%dv" % var)
+            acc = stored[var]
+        else:
+            out.append("0a")
+        if output_every and (i + 1) % output_every == 0:
+            acc = move(acc, printable(rng), out)
+            out.append("1o")
+    return "".join(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--functions", type=int, default=4, choices=range(1, 8), help="functions with random bodies, 1 to 7")
+    parser.add_argument("--ops", type=int, default=50, help="instructions per body")
+    parser.add_argument("--rounds", type=int, default=10, choices=range(1, LIMIT + 1), metavar="1..127",
+                        help="times all functions get called 100 times")
+    parser.add_argument("--output-every", type=int, default=0, help="print a character every so many instructions, 0 for never")
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+    rng = random.Random(args.seed)
+
+    lines = ["# bench: modes=limited,unlimited",
+             "# Generated by generate.py --functions %d --ops %d --rounds %d --output-every %d --seed %d"
+             % (args.functions, args.ops, args.rounds, args.output_every, args.seed)]
+    for function in range(1, args.functions + 1):
+        lines.append("1x%df%s" % (function, body(rng, args.ops, args.output_every)))
+    calls = "".join("%df" % function for function in range(1, args.functions + 1))
+    lines.append("1x8f%s5v1a2x5v3x2v8l" % calls)
+    lines.append("1x9f0m2x5v8f4v1a2x4v3x7v9l")
+    setup = []
+    move(0, 100, setup)
+    rounds = []
+    move(0, args.rounds, rounds)
+    lines.append("%s2x2v 0m%s2x7v 0m2x4v 9f 0m1o" % ("".join(setup), "".join(rounds)))
+    sys.stdout.write("\n".join(lines) + "\n")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,110 @@
+/*
+    Copyright (C) 2022 Tobias Heineken
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+/*
+ * Counts the allocations of a program, for run.py. Load it with
+ * LD_PRELOAD=bench/malloc_count.so NAZ_MALLOC_COUNT=file, at exit the file gets
+ * "allocations frees bytes peak_rss_kib" in it. Relies on glibc exporting its allocator as __libc_*.
+ * The peak is VmHWM of this process, which unlike ru_maxrss does not include the memory of
+ * whoever forked us before the exec.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void __libc_free(void* ptr);
+
+static unsigned long long allocations;
+static unsigned long long frees;
+static unsigned long long bytes;
+
+static void count(size_t size) {
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&bytes, size, __ATOMIC_RELAXED);
+}
+
+void* malloc(size_t size) {
+    count(size);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size) {
+    count(n * size);
+    return __libc_calloc(n, size);
+}
+
+/* Growing a buffer counts as an allocation, as it may move */
+void* realloc(void* ptr, size_t size) {
+    if (ptr == NULL) {
+        count(size);
+    } else if (size == 0) {
+        __atomic_add_fetch(&frees, 1, __ATOMIC_RELAXED);
+    } else {
+        count(size);
+        __atomic_add_fetch(&frees, 1, __ATOMIC_RELAXED);
+    }
+    return __libc_realloc(ptr, size);
+}
+
+void free(void* ptr) {
+    if (ptr != NULL) {
+        __atomic_add_fetch(&frees, 1, __ATOMIC_RELAXED);
+    }
+    __libc_free(ptr);
+}
+
+static unsigned long peak_rss(void) {
+    char status[4096];
+    int fd = open("/proc/self/status", O_RDONLY);
+    if (fd == -1) {
+        return 0;
+    }
+    ssize_t len = read(fd, status, sizeof(status) - 1);
+    close(fd);
+    if (len <= 0) {
+        return 0;
+    }
+    status[len] = '\0';
+    const char* hwm = strstr(status, "VmHWM:");
+    return hwm ? strtoul(hwm + strlen("VmHWM:"), NULL, 10) : 0;
+}
+
+/* Written with read(2) and write(2), stdio would allocate while we report */
+__attribute__((destructor)) static void report(void) {
+    const char* path = getenv("NAZ_MALLOC_COUNT");
+    if (path == NULL) {
+        return;
+    }
+    char line[128];
+    int len = snprintf(line, sizeof(line), "%llu %llu %llu %lu\n", allocations, frees, bytes, peak_rss());
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        return;
+    }
+    if (write(fd, line, len) != len) {
+        /* Nothing left to tell it to */
+    }
+    close(fd);
+}
@@ -0,0 +1,261 @@
+/*
+    Copyright (C) 2022 Tobias Heineken
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+/*
+ * Times the struct number kernels of nazlib on their own, in limited mode and for
+ * -u numbers of 1 to 10^7 limbs. Every sample runs a kernel on a batch of fresh
+ * copies of the same operand, the copies are made outside of the timed part.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#else
+#define HAVE_RDTSC 0
+#endif
+#include "../nazlib.h"
+
+/* Limbs a sample works on at least, so that small operands are not all clock overhead */
+#define BATCH_LIMBS 100000
+#define MAX_BATCH 10000
+
+enum kind {
+    MUTATE,  /* kernel(copy), copies made before the clock starts */
+    COMPARE, /* number_compare(operand, copy), equal so that all limbs are looked at */
+    COPY,    /* number_copy(operand), destroyed after the clock stopped */
+};
+
+struct kernel {
+    const char* name;
+    enum kind kind;
+    void (*run)(struct number*);
+};
+
+/* Arguments keep limited numbers in range, 12 is the operand there */
+static void kernel_add(struct number* n) {
+    number_add(n, 9);
+}
+
+static void kernel_multiply(struct number* n) {
+    number_multiply(n, 9);
+}
+
+static void kernel_divide(struct number* n) {
+    number_divide(n, 7);
+}
+
+static void kernel_remainder(struct number* n) {
+    number_remainder(n, 7);
+}
+
+static const struct kernel kernels[] = {
+    {"add", MUTATE, kernel_add},
+    {"multiply", MUTATE, kernel_multiply},
+    {"divide", MUTATE, kernel_divide},
+    {"remainder", MUTATE, kernel_remainder},
+    {"compare", COMPARE, NULL},
+    {"copy", COPY, NULL},
+};
+#define KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+struct sample {
+    double ns;
+    double cycles;
+};
+
+static volatile int sink;
+
+/* nazlib leaves dying to whoever links it, a kernel dying here is a bug in this file */
+_Noreturn void die(const char msg[]) {
+    fprintf(stderr, "%s\n", msg);
+    exit(EXIT_FAILURE);
+}
+
+static uint64_t cycles_now(void) {
+#if HAVE_RDTSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static uint64_t ns_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Deterministic limbs with a top limb that is not 0 */
+static struct number* operand(int unlimited, size_t limbs) {
+    if (!unlimited) {
+        return number_from(12);
+    }
+    unsigned* data = malloc(sizeof(*data) * limbs);
+    uint32_t x = 2463534242u;
+    for (size_t i = 0; i < limbs; ++i) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        data[i] = x;
+    }
+    data[limbs - 1] |= 1;
+    struct number* out = number_from_limbs(data, limbs, 0);
+    free(data);
+    return out;
+}
+
+/* Per operation of the batch */
+static struct sample measure(const struct kernel* k, struct number* op, struct number** copies, size_t batch) {
+    if (k->kind != COPY) {
+        for (size_t i = 0; i < batch; ++i) {
+            copies[i] = number_copy(op);
+        }
+    }
+    uint64_t ns = ns_now();
+    uint64_t cycles = cycles_now();
+    switch (k->kind) {
+        case MUTATE:
+            for (size_t i = 0; i < batch; ++i) {
+                k->run(copies[i]);
+            }
+            break;
+        case COMPARE:
+            for (size_t i = 0; i < batch; ++i) {
+                sink += number_compare(op, copies[i]);
+            }
+            break;
+        case COPY:
+            for (size_t i = 0; i < batch; ++i) {
+                copies[i] = number_copy(op);
+            }
+            break;
+    }
+    cycles = cycles_now() - cycles;
+    ns = ns_now() - ns;
+    for (size_t i = 0; i < batch; ++i) {
+        number_destroy(copies[i]);
+    }
+    return (struct sample) {(double) ns / batch, (double) cycles / batch};
+}
+
+static int by_ns(const void* lhs, const void* rhs) {
+    const struct sample* a = lhs;
+    const struct sample* b = rhs;
+    return (a->ns > b->ns) - (a->ns < b->ns);
+}
+
+/* Nearest rank on samples sorted by time */
+static struct sample percentile(struct sample* sorted, int n, int p) {
+    int rank = (p * n + 99) / 100;
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static void usage(const char* self) {
+    fprintf(stderr, "Usage: %s [-k kernel] [-l|-u] [--max-limbs=N] [-r repetitions] [-w warmup] [--max-sample=seconds]\n"
+                    " Prints nanoseconds per operation of the nazlib number kernels add, multiply, divide, remainder, compare and copy\n"
+                    " as minimum, 50th, 90th and 99th percentile, for limited numbers (-l) and -u numbers of 1, 10, ... --max-limbs\n"
+                    " (default 10^7) limbs (-u). A size whose first sample takes longer than --max-sample (default 1 second) is not\n"
+                    " repeated, and a kernel stops growing its operand once a sample takes longer than a tenth of that.\n", self);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv) {
+    const char* only = NULL;
+    int limited = 1, unlimited = 1, repetitions = 21, warmup = 3;
+    size_t max_limbs = 10000000;
+    double max_sample = 1;
+    static const struct option long_options[] = {
+        {"max-limbs", required_argument, NULL, 'n'},
+        {"max-sample", required_argument, NULL, 's'},
+        {NULL, 0, NULL, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "k:lur:w:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'k': only = optarg; break;
+            case 'l': unlimited = 0; limited = 1; break;
+            case 'u': limited = 0; unlimited = 1; break;
+            case 'r': repetitions = atoi(optarg); break;
+            case 'w': warmup = atoi(optarg); break;
+            case 'n': max_limbs = strtoull(optarg, NULL, 10); break;
+            case 's': max_sample = atof(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind != argc || repetitions < 1 || warmup < 0 || max_limbs < 1 || max_sample <= 0) {
+        usage(argv[0]);
+    }
+
+    struct sample* samples = malloc(sizeof(*samples) * repetitions);
+    struct number** copies = malloc(sizeof(*copies) * MAX_BATCH);
+    printf("%-10s %-4s %9s %6s %12s %12s %12s %12s %12s %10s\n", "kernel", "mode", "limbs", "batch",
+           "min ns", "p50 ns", "p90 ns", "p99 ns", "p50 cycles", "ns/limb");
+    for (int mode = 0; mode < 2; ++mode) {
+        if (!(mode ? unlimited : limited)) {
+            continue;
+        }
+        struct naz_state* state = naz_state_new(mode);
+        naz_state_use(state);
+        for (size_t k = 0; k < KERNELS; ++k) {
+            if (only && strcmp(only, kernels[k].name) != 0) {
+                continue;
+            }
+            for (size_t limbs = 1; limbs <= (mode ? max_limbs : 1); limbs *= 10) {
+                size_t batch = BATCH_LIMBS / limbs;
+                batch = batch < 1 ? 1 : batch > MAX_BATCH ? MAX_BATCH : batch;
+                struct number* op = operand(mode, limbs);
+                /* A first sample already over the limit is all this size gets */
+                int n = 1;
+                samples[0] = measure(&kernels[k], op, copies, batch);
+                int slow = samples[0].ns * batch > max_sample * 1e9;
+                if (!slow) {
+                    for (int i = 1; i < warmup; ++i) {
+                        measure(&kernels[k], op, copies, batch);
+                    }
+                    for (n = 0; n < repetitions; ++n) {
+                        samples[n] = measure(&kernels[k], op, copies, batch);
+                    }
+                }
+                number_destroy(op);
+                qsort(samples, n, sizeof(*samples), by_ns);
+                struct sample p50 = percentile(samples, n, 50);
+                printf("%-10s %-4s %9zu %6zu %12.1f %12.1f %12.1f %12.1f %12.0f %10.3f%s\n", kernels[k].name,
+                       mode ? "-u" : "-", limbs, batch, samples[0].ns, p50.ns,
+                       percentile(samples, n, 90).ns, percentile(samples, n, 99).ns,
+                       HAVE_RDTSC ? p50.cycles : 0, p50.ns / limbs, slow ? "  (1 sample)" : "");
+                fflush(stdout);
+                if ((slow || p50.ns * batch * 10 > max_sample * 1e9) && limbs * 10 <= max_limbs) {
+                    printf("%-10s %-4s %9s  skipped, a sample would take more than %g seconds\n",
+                           kernels[k].name, "-u", "larger", max_sample);
+                    break;
+                }
+            }
+        }
+        naz_state_use(NULL);
+        naz_state_destroy(state);
+    }
+    free(samples);
+    free(copies);
+    return 0;
+}
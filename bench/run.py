@@ -0,0 +1,200 @@
+#!/usr/bin/env python3
+#    Copyright (C) 2022 Tobias Heineken
+#
+#    This program is free software: you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, either version 3 of the License, or
+#    (at your option) any later version.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+"""Runs every program of the corpus in every mode its header asks for and writes the results as JSON.
+
+A program starts with "# bench: modes=limited,unlimited input=N", N bytes of generated text
+become its standard input. For each run the result has the instructions executed (from -p),
+the minimum and median wall time, instructions per second, the peak resident set and, when
+the allocation counter is given, the number of allocations. Without it the peak resident set
+is only an upper bound, as it includes the size of this script. With --baseline, runs whose
+median got more than --threshold percent slower than there are reported and the exit code is 1.
+"""
+
+import argparse
+import json
+import os
+import re
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+MODES = {"limited": [], "unlimited": ["-u"]}
+HEADER = re.compile(r"#\s*bench:(.*)")
+
+
+def parse_header(path):
+    """Returns the modes and the input size from the first line of path"""
+    with open(path) as f:
+        match = HEADER.match(f.readline())
+    if not match:
+        return None
+    modes, size = ["limited"], 0
+    for field in match.group(1).split():
+        key, _, value = field.partition("=")
+        if key == "modes":
+            modes = value.split(",")
+        elif key == "input":
+            size = int(value)
+        else:
+            raise SystemExit("%s: unknown bench field %s" % (path, key))
+    for mode in modes:
+        if mode not in MODES:
+            raise SystemExit("%s: unknown mode %s" % (path, mode))
+    return modes, size
+
+
+def make_input(size, directory):
+    """Deterministic lines of text, so every run and every machine reads the same bytes"""
+    path = os.path.join(directory, "input-%d.txt" % size)
+    if not os.path.exists(path):
+        line = b"The quick brown fox jumps over the lazy dog 0123456789\n"
+        with open(path, "wb") as f:
+            f.write((line * (size // len(line) + 1))[:size])
+    return path
+
+
+def run(command, input_path, env=None):
+    """Runs command once, returns its exit code, wall time, peak RSS in KiB and stderr"""
+    with open(input_path or os.devnull, "rb") as stdin, tempfile.TemporaryFile() as stderr:
+        start = time.perf_counter()
+        child = subprocess.Popen(command, stdin=stdin, stdout=subprocess.DEVNULL, stderr=stderr, env=env)
+        _, status, usage = os.wait4(child.pid, 0)
+        wall = time.perf_counter() - start
+        child.returncode = os.waitstatus_to_exitcode(status)
+        stderr.seek(0)
+        return child.returncode, wall, usage.ru_maxrss, stderr.read().decode(errors="replace")
+
+
+def instructions(command, input_path):
+    _, _, _, err = run(command[:1] + ["-p"] + command[1:], input_path)
+    match = re.search(r"profile: (\d+) instructions", err)
+    return int(match.group(1)) if match else None
+
+
+def allocations(command, input_path, shim):
+    """Returns the allocations and the peak RSS in KiB the shim saw, or Nones"""
+    with tempfile.NamedTemporaryFile() as counts:
+        env = dict(os.environ, LD_PRELOAD=os.path.abspath(shim), NAZ_MALLOC_COUNT=counts.name)
+        run(command, input_path, env)
+        fields = counts.read().split()
+        return (int(fields[0]), int(fields[3])) if fields else (None, None)
+
+
+def measure(interpreter, program, mode, input_path, args):
+    command = [interpreter] + MODES[mode] + args.flags + [program]
+    for _ in range(args.warmup):
+        run(command, input_path)
+    walls, peak, code = [], 0, 0
+    for _ in range(args.repetitions):
+        code, wall, rss, _ = run(command, input_path)
+        walls.append(wall)
+        peak = max(peak, rss)
+    # -p does not go with every flag, and the flags should not change the work the program does
+    count = instructions([interpreter] + MODES[mode] + [program], input_path)
+    median = statistics.median(walls)
+    allocated = None
+    if args.malloc_count:
+        # ru_maxrss still has the high water mark of python from before the exec, the shim does not
+        allocated, exact_peak = allocations(command, input_path, args.malloc_count)
+        peak = exact_peak or peak
+    return {
+        "program": os.path.basename(program),
+        "mode": mode,
+        "exit": code,
+        "instructions": count,
+        "wall_s": {"min": min(walls), "median": median},
+        "instructions_per_s": count / median if count and median else None,
+        "peak_rss_kib": peak,
+        "allocations": allocated,
+    }
+
+
+def regressions(results, baseline_path, threshold):
+    with open(baseline_path) as f:
+        baseline = {(r["program"], r["mode"]): r for r in json.load(f)["results"]}
+    found = []
+    for r in results:
+        old = baseline.get((r["program"], r["mode"]))
+        if old is None:
+            continue
+        change = (r["wall_s"]["median"] / old["wall_s"]["median"] - 1) * 100
+        if change > threshold:
+            found.append("%s (%s): %.3fs -> %.3fs, %+.1f%%" % (r["program"], r["mode"], old["wall_s"]["median"],
+                                                               r["wall_s"]["median"], change))
+    return found
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("interpreter")
+    parser.add_argument("programs", nargs="*", help="defaults to bench/corpus/*.naz")
+    parser.add_argument("-o", "--output", help="JSON file, defaults to stdout")
+    parser.add_argument("-r", "--repetitions", type=int, default=5)
+    parser.add_argument("-w", "--warmup", type=int, default=1)
+    parser.add_argument("--flags", default="", help="extra interpreter flags, e.g. --flags=\"-j -L\"")
+    parser.add_argument("--malloc-count", help="the shim built from malloc_count.c")
+    parser.add_argument("--baseline", help="earlier JSON output to compare against")
+    parser.add_argument("--threshold", type=float, default=10, help="percent the median may grow, default 10")
+    args = parser.parse_args()
+    args.flags = args.flags.split()
+
+    here = os.path.dirname(os.path.abspath(__file__))
+    programs = args.programs
+    if not programs:
+        corpus = os.path.join(here, "corpus")
+        programs = sorted(os.path.join(corpus, name) for name in os.listdir(corpus) if name.endswith(".naz"))
+
+    results = []
+    with tempfile.TemporaryDirectory() as inputs:
+        for program in programs:
+            header = parse_header(program)
+            if header is None:
+                print("%s: no bench header, skipped" % program, file=sys.stderr)
+                continue
+            modes, size = header
+            input_path = make_input(size, inputs) if size else None
+            for mode in modes:
+                r = measure(args.interpreter, program, mode, input_path, args)
+                results.append(r)
+                print("%-16s %-9s %8.3fs %14s instr/s %8d KiB%s" % (
+                    r["program"], mode, r["wall_s"]["median"],
+                    "%.0f" % r["instructions_per_s"] if r["instructions_per_s"] else "-", r["peak_rss_kib"],
+                    "" if r["exit"] == 0 else "  exit %d" % r["exit"]), file=sys.stderr)
+
+    document = {"interpreter": args.interpreter, "flags": args.flags, "repetitions": args.repetitions,
+                "results": results}
+    if args.output:
+        with open(args.output, "w") as f:
+            json.dump(document, f, indent=2)
+            f.write("\n")
+    else:
+        json.dump(document, sys.stdout, indent=2)
+        sys.stdout.write("\n")
+
+    failed = [r for r in results if r["exit"] != 0]
+    for r in failed:
+        print("%s (%s) exited with %d" % (r["program"], r["mode"], r["exit"]), file=sys.stderr)
+    found = regressions(results, args.baseline, args.threshold) if args.baseline else []
+    for line in found:
+        print("regression: " + line, file=sys.stderr)
+    return 1 if failed or found else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
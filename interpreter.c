@@ -1,58 +1,100 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <sys/time.h>
 #include "nazlib.h"
 
 static void usage(const char* self) {
-    fprintf(stderr, "Usage: %s [-u] <file>\n File needs to be the .naz file to execute.\n Use -u to enable unlimited numbers.\n All other flags are currently not supported\n", self);
+    fprintf(stderr, "Usage: %s [-u]", self);
+    fputs(" [-j]", stderr);
+    fputs(" [-T]", stderr);
+    fputs(" [-P[limit]]", stderr);
+    fputs(" [-L]", stderr);
+    fputs(" [-s]", stderr);
+    fputs(" [-M[MiB]] [--memo-stats]", stderr);
+    fputs(" [-p [--profile-json=file] [--profile-folded=file] [--profile-counters]]", stderr);
+    fputs(" [--emit-c]", stderr);
+    fputs(" [--checkpoint=file [--checkpoint-every=seconds]] [--restore=file]", stderr);
+    fputs(" [--max-steps=N] [--max-memory=MiB] [--max-time=seconds]", stderr);
+    fputs(" [--no-cycle-check]", stderr);
+    fputs(" [--stats=file] [--metrics=file [--metrics-every=seconds]]", stderr);
+    fputs(" [--record=file | --replay=file [--real-time]]", stderr);
+    fputs(" [-t file [--trace-function=N|top]... [--trace-offsets=A[-B]] [--trace-ops=letters]]", stderr);
+    fputs(" <file>\n", stderr);
+    fprintf(stderr, "       %s [options] -b [--threads=N] <file> <inputs> <outputs>\n", self);
+    fprintf(stderr, "       %s [options] -m [--threads=N] <file>\n", self);
+    fprintf(stderr, "       %s [options] --serve <socket> [--prefork=N] [--concurrency=N] <file>\n", self);
+    fputs(" File needs to be the .naz file to execute.\n", stderr);
+    fputs(" Use -u to enable unlimited numbers.\n", stderr);
+    /* Speed */
+    fputs(" Use -j to compile to machine code before running (limited numbers on x86-64 only).\n", stderr);
+    fputs(" Use -T to replace pure functions by lookup tables (limited numbers only).\n", stderr);
+    fputs(" Use -P to precompute everything before the first input in at most limit steps.\n", stderr);
+    fputs(" Use -L to skip ahead in loops counting towards a variable"
+          " and to copy the input in bulk in loops printing it.\n", stderr);
+    fputs(" Use -s to print stretches of output that only depend on values known ahead of time as one string.\n",
+          stderr);
+    fputs(" Use -M to cache results of pure functions in at most MiB of memory,"
+          " --memo-stats prints how well that worked.\n", stderr);
+    /* Profiling */
+    fputs(" Use -p to print how often every opcode, function, call and branch ran to stderr at the end, without -j."
+          " --profile-json and --profile-folded also write it as JSON and as folded stacks for flamegraphs,"
+          " --profile-counters adds cycles, instructions, IPC, branch and cache misses per function.\n", stderr);
+    /* Checkpoints */
+    fputs(" Use --checkpoint to write the state to file on SIGUSR2 and every so many seconds, without -j and -M."
+          " --restore continues from there.\n", stderr);
+    /* Budgets and endless loops */
+    fputs(" Use --max-steps, --max-memory and --max-time to stop the program after N instructions,"
+          " MiB of -u numbers or that long, with exit code 3 and the dump. Steps and time turn off -j.\n", stderr);
+    fputs(" Without -u, a program entering a function in the same state twice without input or output in between"
+          " loops forever and stops with exit code 4, --no-cycle-check lets it run.\n", stderr);
+    /* Live statistics */
+    fputs(" SIGUSR1 prints how far the program got to stderr or appends it to the --stats file, without -j."
+          " --metrics rewrites file in the Prometheus text format every 10 or so many seconds"
+          " and turns off -j.\n", stderr);
+    /* Recording and tracing */
+    fputs(" Use --record to log every chunk of input with its timing to file,"
+          " --replay runs on such a log instead of stdin,"
+          " as fast as possible or with --real-time as it arrived back then.\n", stderr);
+    fputs(" Use -t to write every instruction that runs to file in binary, without -j, for tools/tracedump to print."
+          " Only instructions in the given functions, at offsets from A to B"
+          " and with the given opcodes are written.\n", stderr);
+    /* Translating to C */
+    fputs(" Use --emit-c to print a C translation linking against nazlib.c instead of running.\n", stderr);
+    /* Batches, maps and servers */
+    fputs(" Use -b to run the program on every file in inputs on N threads,"
+          " writing each output to the file of the same name in outputs.\n", stderr);
+    fputs(" Use -m to run the program once per line of stdin on N threads,"
+          " writing the outputs in the order of the lines.\n", stderr);
+    fputs(" Use --serve to run the program once per connection to the UNIX socket,"
+          " with N processes waiting ahead of time and at most N connections at once.\n", stderr);
+    fputs(" All other flags are currently not supported\n", stderr);
     exit(EXIT_FAILURE);
 }
 
-static struct callstack* cs;
+#define PREFIX_DEFAULT_LIMIT 10000000
+#define MEMO_DEFAULT_MIB 64
+/* Lines in flight for -m, per thread */
+#define MAP_WINDOW_PER_THREAD 4
+#define SERVE_DEFAULT_CONCURRENCY 64
+#define METRICS_DEFAULT_SECONDS 10
 
-static void vis_ip(struct instruction_pointer* arg) {
-    if (instruction_pointer_is_in_function(arg)) {
-        printf("%d:%d\n", instruction_pointer_function_number(arg), instruction_pointer_offset(arg));
-    } else {
-        printf("Toplevel:%d\n", instruction_pointer_offset(arg));
+static char *read_file(struct naz_vm* vm, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        vm_dump(vm);
+        exit(EXIT_FAILURE);
     }
-}
 
-void debug() {
-    for(int i=0; i < 10; ++i){
-        printf("Function %d: %s\n", i, function_get(i));
+    if (fseek(f, 0, SEEK_END) == -1) {
+        perror("fseek");
+        vm_dump(vm);
+        exit(EXIT_FAILURE);
     }
-    for(int i=0; i< 10; ++i){
-        printf("Var %d:", i);
-        struct number* tmp = variable_get(i);
-        number_print_dbg(tmp);
-        number_destroy(tmp);
-        printf("\n");
-    }
-    debug_io_state();
-
-    printf("Acc: ");
-    struct number* tmp = accumulator_get();
-    number_print_dbg(tmp);
-    number_destroy(tmp);
-    printf("\nCallstack:\n");
-    callstack_iterate(cs,vis_ip);
-}
-
-_Noreturn void die(const char msg[]) {
-    perror(msg);
-    debug();
-    exit(EXIT_FAILURE);
-}
-
-
-static char *read_file(const char *path) {
-    FILE *f = fopen(path, "r");
-    if (!f)
-        die(path);
-
-    if (fseek(f, 0, SEEK_END) == -1)
-        die("fseek");
 
     size_t size = ftell(f);
     fseek(f, 0, SEEK_SET);
@@ -65,304 +107,379 @@ static char *read_file(const char *path) {
     return buf;
 }
 
-static void work_tupel(char* pos) {
-}
-
-static char* program_code;
-
-static void opcodes(const char* pos) {
-    int extra_offset;
-    switch(*pos) {
-        case '0': {
-                      extra_offset = 2;
-                      goto offset_manipulation;
-                  }
-        case '1': {
-                      if (pos[3] != 'f') {
-                          die("Using 1x without following it with Xf");
-                      }
-                      int idx = pos[2] - '0';
+/* The machine SIGUSR2 and the checkpoint timer ask for a checkpoint, SIGUSR1 for statistics */
+static struct naz_vm* signalled;
 
-                      if (idx < 0 || idx > 9) {
-                          die("invalid number of 1xXf");
-                      }
-                      function_set(idx, pos + 4);
-                      for(extra_offset = 4; pos[extra_offset] != '\n' && pos[extra_offset] != '\0'; extra_offset += 2) {
-                          if (pos[extra_offset] == ' ') {
-                              extra_offset--;
-                              continue;
-                          }
-                          if (pos[extra_offset] == '0' && pos[extra_offset + 1] == 'x') {
-                              extra_offset += 2;
-                              break;
-                          }
-                      }
-                      goto offset_manipulation;
-                  }
-        case '2': {
-                      if (pos[3] != 'v') {
-                          die("Using 2x without following it with Xv");
-                      }
-                      int idx = pos[2] - '0';
-                      if (idx < 0 || idx > 9) {
-                          die("invalid number of 2xXv");
-                      }
-                      variable_set(idx, accumulator_get());
-                      extra_offset = 4;
-                      goto offset_manipulation;
-                  }
-        case '3': {
-                      if (pos[3] != 'v') {
-                          die("Using 3x without following it with Xv");
-                      }
-                      if (pos[5] != 'l' && pos[5] != 'e' && pos[5] != 'g') {
-                          die("Using 3x without following it with Xl, Xg or Xe after Yv");
-                      }
-                      int var = pos[2] - '0';
-                      int fun = pos[4] - '0';
-
-                      struct number* acc = accumulator_get();
-                      struct number* var_n = variable_get(var);
-
-                      int cmp = number_compare(acc, var_n);
+static void request_checkpoint(int sig) {
+    (void) sig;
+    vm_request_checkpoint(signalled);
+}
 
-                      int jmp = 0;
-                      if (cmp == 0 && pos[5] == 'e') {
-                          jmp = 1;
-                      } else if (cmp < 0 && pos[5] == 'l') {
-                          jmp = 1;
-                      } else if (cmp > 0 && pos[5] == 'g') {
-                          jmp = 1;
-                      }
+static void request_stats(int sig) {
+    (void) sig;
+    vm_request_stats(signalled);
+}
 
-                      number_destroy(acc);
-                      number_destroy(var_n);
+/* Post-mortem for crashes, then dies of the signal as it would have without the handler */
+static void crashed(int sig) {
+    vm_dump_flight(signalled, STDERR_FILENO);
+    raise(sig);
+}
 
-                      if (jmp) {
-                          struct instruction_pointer* cur = callstack_pop(cs);
-                          if (!instruction_pointer_is_in_function(cur)) {
-                              /* Conditionals only terminate the function, not script-level thingies */
-                              /* So we need to place the old position back on the stack */
-                              callstack_push(cs, instruction_pointer_with_offset(cur, instruction_pointer_offset(cur) + 6));
-                          }
-                          struct instruction_pointer* target = instruction_pointer_from_function(fun, 0);
-                          instruction_pointer_delete(cur);
-                          callstack_push(cs, target);
-                          return;
-                      }
-                      extra_offset = 6;
-                      goto offset_manipulation;
-                  }
-        default: die("unknown opcode");
+static void handle_crashes() {
+    /* A stack overflow leaves no room for the handler on the stack itself */
+    stack_t stack = {.ss_sp = malloc(SIGSTKSZ), .ss_size = SIGSTKSZ};
+    sigaltstack(&stack, NULL);
+    struct sigaction action = {.sa_handler = crashed, .sa_flags = SA_ONSTACK | SA_RESETHAND};
+    sigemptyset(&action.sa_mask);
+    const int fatal[] = {SIGSEGV, SIGBUS, SIGILL, SIGABRT};
+    for (size_t i = 0; i < sizeof(fatal) / sizeof(fatal[0]); ++i) {
+        sigaction(fatal[i], &action, NULL);
     }
+}
 
-offset_manipulation:
-;
-    struct instruction_pointer* ip = callstack_pop(cs);
-    callstack_push(cs, instruction_pointer_with_offset(ip, instruction_pointer_offset(ip) + extra_offset));
-    instruction_pointer_delete(ip);
+static void write_profile(struct naz_vm* vm, const char* path, void (*write)(struct profile*, FILE*)) {
+    FILE* f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        return;
+    }
+    write(vm_profile(vm), f);
+    fclose(f);
 }
 
-static void execute() {
-    struct instruction_pointer *cur;
-    cur = callstack_pop(cs);
-    while(cur) {
-        const char* next_code;
-        if (instruction_pointer_is_in_function(cur)) {
-            next_code = function_get(instruction_pointer_function_number(cur));
-            if (!next_code) {
-                die("Using an undefined function");
-            }
-        } else {
-            next_code = program_code;
-        }
-        for(int offset = instruction_pointer_offset(cur); next_code[offset] != '\0'; ++offset) {
-            if (next_code[offset] == '\n' || next_code[offset] == ' ') {
-                continue;
-            }
-            if(/*DEBUG*/ 0) {
-                debug();
-                printf("execute: %.6s\n", next_code + offset);
-            }
-            switch(next_code[offset+1]) {
-                case 'x': {
-                              // opcodes takes an unknown number of characters and might or might not return to here at all.
-                              // In order to do that, we push our current state on callstack,
-                              // opcodes will take that from there, put the current next one on it,
-                              // and we need to pull that.
-                              callstack_push(cs, instruction_pointer_with_offset(cur, offset));
-                              opcodes(next_code+offset);
-                              goto cleanup_forloop;
-                          }
-                case 'a': {
-                              struct number* acc = accumulator_get();
-                              number_add(acc, next_code[offset] - '0');
-                              accumulator_set(acc);
-                              break;
-                          }
-                case 's': {
-                              struct number* acc = accumulator_get();
-                              number_add(acc, -(next_code[offset] - '0'));
-                              accumulator_set(acc);
-                              break;
-                          }
-                case 'm': {
-                              struct number* acc = accumulator_get();
-                              number_multiply(acc, next_code[offset] - '0');
-                              accumulator_set(acc);
-                              break;
-                          }
-                case 'd': {
-                              struct number* acc = accumulator_get();
-                              number_divide(acc, next_code[offset] - '0');
-                              accumulator_set(acc);
-                              break;
-                          }
-                case 'p': {
-                              struct number* acc = accumulator_get();
-                              number_remainder(acc, next_code[offset] - '0');
-                              accumulator_set(acc);
-                              break;
-                          }
-                case 'f': {
-                              int functon = next_code[offset] - '0';
-                              if (next_code[offset+2] != '\0') {
-                                  struct instruction_pointer *after = instruction_pointer_with_offset(cur, offset+2);
-                                  callstack_push(cs, after);
-                              }
-                              callstack_push(cs, instruction_pointer_from_function(functon, 0));
-                              goto cleanup_forloop;
-                          }
-                case 'r': {
-                              int position = next_code[offset] - '0';
-                              int res = read_by_offset(position);
-                              struct number *acc = number_from(res);
-                              accumulator_set(acc);
-                              break;
-                          }
-                case 'h': {
-                              die("Halt for debugging");
-                          }
-                case 'o': {
-                              struct number *acc = accumulator_get();
-                              for (int i=next_code[offset] - '1'; i >= 0; i--) {
-                                    number_print(acc);
-                              }
-                              number_destroy(acc);
-                              break;
-                          }
-                case 'v': {
-                              int number = next_code[offset] - '0';
-                              struct number *var = variable_get(number);
-                              accumulator_set(var);
-                              break;
-                          }
-                case 'n': {
-                              int number = next_code[offset] - '0';
-                              struct number *var = variable_get(number);
-                              number_multiply(var, -1);
-                              variable_set(number, var);
-                              break;
-                          }
-                default: die("unknown char for interpreter loop");
-            }
-            offset++;
-        }
-cleanup_forloop:
-        instruction_pointer_delete(cur);
-        cur = callstack_pop(cs);
+static void print_profile(struct naz_vm* vm, const char* json, const char* folded) {
+    if (!vm_profile(vm)) {
+        return;
     }
+    profile_report(vm_profile(vm), stderr);
+    if (json) {
+        write_profile(vm, json, profile_write_json);
+    }
+    if (folded) {
+        write_profile(vm, folded, profile_write_folded);
+    }
+}
+
+static void unexpected_char(char c) {
+    printf("Unexcepted char: %c\n", c);
 }
 
 int main(int argc, char** argv) {
 
     int c;
+    int unlimited = 0;
+    int use_jit = 0;
+    int use_summaries = 0;
+    int use_loops = 0;
+    int use_folds = 0;
+    int emit_c = 0;
+    long long prefix_limit = -1;
+    long long memo_mib = -1;
+    int memo_stats = 0;
+    int batch = 0;
+    int map = 0;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    const char* serve = NULL;
+    long prefork = threads;
+    long concurrency = SERVE_DEFAULT_CONCURRENCY;
+    const char* checkpoint = NULL;
+    long checkpoint_every = 0;
+    const char* restore = NULL;
+    long long max_steps = 0;
+    long long max_memory = 0;
+    double max_seconds = 0;
+    int no_cycle_check = 0;
+    int profile = 0;
+    const char* profile_json = NULL;
+    const char* profile_folded = NULL;
+    int profile_counters = 0;
+    const char* stats_file = NULL;
+    const char* metrics = NULL;
+    double metrics_every = 0;
+    const char* record = NULL;
+    const char* replay = NULL;
+    int real_time = 0;
+    const char* trace_file = NULL;
+    struct trace_filter trace_filter = {.to = -1};
     const char* self_name = argv[0];
-    while ((c = getopt(argc, argv, "u")) != -1) {
+    static const struct option long_options[] = {
+        {"emit-c", no_argument, NULL, 'C'},
+        {"memo-stats", no_argument, NULL, 'S'},
+        {"threads", required_argument, NULL, 'N'},
+        {"serve", required_argument, NULL, 'R'},
+        {"prefork", required_argument, NULL, 'F'},
+        {"concurrency", required_argument, NULL, 'K'},
+        {"checkpoint", required_argument, NULL, 'W'},
+        {"checkpoint-every", required_argument, NULL, 'E'},
+        {"restore", required_argument, NULL, 'Q'},
+        {"max-steps", required_argument, NULL, 'I'},
+        {"max-memory", required_argument, NULL, 'Y'},
+        {"max-time", required_argument, NULL, 'D'},
+        {"no-cycle-check", no_argument, NULL, 'O'},
+        {"profile-json", required_argument, NULL, 'J'},
+        {"profile-folded", required_argument, NULL, 'G'},
+        {"profile-counters", no_argument, NULL, 'H'},
+        {"stats", required_argument, NULL, 'A'},
+        {"metrics", required_argument, NULL, 'X'},
+        {"metrics-every", required_argument, NULL, 'V'},
+        {"record", required_argument, NULL, 'U'},
+        {"replay", required_argument, NULL, 'B'},
+        {"real-time", no_argument, NULL, 'Z'},
+        {"trace-function", required_argument, NULL, 'f'},
+        {"trace-offsets", required_argument, NULL, 'o'},
+        {"trace-ops", required_argument, NULL, 'c'},
+        {0, 0, 0, 0},
+    };
+    while ((c = getopt_long(argc, argv, "ujTP::LsM::bmpt:", long_options, NULL)) != -1) {
         switch(c) {
-            case 'u': naz_set_unlimited(1);
+            case 'u': unlimited = 1;
+                      break;
+            case 'j': use_jit = 1;
+                      break;
+            case 'T': use_summaries = 1;
+                      break;
+            case 'L': use_loops = 1;
+                      break;
+            case 's': use_folds = 1;
+                      break;
+            case 'C': emit_c = 1;
+                      break;
+            case 'P': prefix_limit = optarg ? atoll(optarg) : PREFIX_DEFAULT_LIMIT;
+                      if (prefix_limit < 0) {
+                          usage(self_name);
+                      }
+                      break;
+            case 'M': memo_mib = optarg ? atoll(optarg) : MEMO_DEFAULT_MIB;
+                      if (memo_mib <= 0) {
+                          usage(self_name);
+                      }
+                      break;
+            case 'S': memo_stats = 1;
+                      break;
+            case 'b': batch = 1;
+                      break;
+            case 'm': map = 1;
+                      break;
+            case 'N': threads = atol(optarg);
+                      if (threads <= 0) {
+                          usage(self_name);
+                      }
+                      break;
+            case 'R': serve = optarg;
+                      break;
+            case 'F': prefork = atol(optarg);
+                      if (prefork <= 0) {
+                          usage(self_name);
+                      }
+                      break;
+            case 'K': concurrency = atol(optarg);
+                      if (concurrency <= 0) {
+                          usage(self_name);
+                      }
+                      break;
+            case 'W': checkpoint = optarg;
+                      break;
+            case 'E': checkpoint_every = atol(optarg);
+                      if (checkpoint_every <= 0) {
+                          usage(self_name);
+                      }
+                      break;
+            case 'Q': restore = optarg;
+                      break;
+            case 'I': max_steps = atoll(optarg);
+                      if (max_steps <= 0) {
+                          usage(self_name);
+                      }
+                      break;
+            case 'Y': max_memory = atoll(optarg);
+                      if (max_memory <= 0) {
+                          usage(self_name);
+                      }
+                      break;
+            case 'D': max_seconds = atof(optarg);
+                      if (max_seconds <= 0) {
+                          usage(self_name);
+                      }
+                      break;
+            case 'O': no_cycle_check = 1;
+                      break;
+            case 'p': profile = 1;
+                      break;
+            case 'J': profile_json = optarg;
+                      break;
+            case 'G': profile_folded = optarg;
+                      break;
+            case 'H': profile_counters = 1;
+                      break;
+            case 'A': stats_file = optarg;
+                      break;
+            case 'X': metrics = optarg;
+                      break;
+            case 'V': metrics_every = atof(optarg);
+                      if (metrics_every <= 0) {
+                          usage(self_name);
+                      }
+                      break;
+            case 'U': record = optarg;
+                      break;
+            case 'B': replay = optarg;
+                      break;
+            case 'Z': real_time = 1;
+                      break;
+            case 't': trace_file = optarg;
+                      break;
+            case 'f': if (strcmp(optarg, "top") == 0) {
+                          trace_filter.functions |= 1;
+                      } else if (optarg[0] >= '0' && optarg[0] <= '9' && optarg[1] == '\0') {
+                          trace_filter.functions |= 1u << (optarg[0] - '0' + 1);
+                      } else {
+                          usage(self_name);
+                      }
+                      break;
+            case 'o': {
+                          int n = sscanf(optarg, "%d-%d", &trace_filter.from, &trace_filter.to);
+                          if (n < 1 || trace_filter.from < 0 || (n == 2 && trace_filter.to < trace_filter.from)) {
+                              usage(self_name);
+                          }
+                          break;
+                      }
+            case 'c': trace_filter.ops = optarg;
                       break;
             default: usage(self_name);
         }
     }
     argc -= optind;
     argv += optind;
-    if (argc != 1) {
+    if (argc != (batch ? 3 : 1) || batch + map + emit_c + !!serve > 1
+            || (checkpoint_every && !checkpoint) || ((profile_json || profile_folded || profile_counters) && !profile) || (metrics_every && !metrics)
+            || ((checkpoint || restore || stats_file || metrics || record || replay) && (batch || map || emit_c || serve))
+            || (record && replay) || (real_time && !replay) || (replay && restore)
+            || ((trace_filter.functions || trace_filter.from || trace_filter.to != -1 || trace_filter.ops) && !trace_file)
+            || (trace_file && (batch || map || emit_c || serve))) {
         usage(self_name);
     }
 
-    variable_init();
-
-    char* program = read_file(argv[0]);
-
-    int is_comment = 0;
-    for(int offset = 0; program[offset] != '\0'; ) {
-        if (is_comment && program[offset] != '\n') {
-            /* Keep the comment flag, clear the content */
-            program[offset] = ' ';
-            offset++;
-            continue;
-        } else if (is_comment) {
-            offset++;
-            is_comment = 0;
-            continue;
+    struct trace* trace = NULL;
+    if (trace_file) {
+        trace = trace_open(trace_file, &trace_filter);
+        if (!trace) {
+            perror(trace_file);
+            exit(EXIT_FAILURE);
         }
-        if (program[offset] == '#') {
-            is_comment = 1;
-            program[offset] = ' ';
-            offset++;
-            continue;
+    }
+    struct naz_vm_options options = {
+        .unlimited = unlimited,
+        .jit = use_jit,
+        .tables = use_summaries,
+        .loops = use_loops,
+        .folds = use_folds,
+        .prefix_limit = prefix_limit,
+        .memo_bytes = memo_mib > 0 ? memo_mib << 20 : 0,
+        .checkpoint = checkpoint,
+        .max_steps = max_steps,
+        .max_memory = max_memory << 20,
+        .max_seconds = max_seconds,
+        .no_cycle_check = no_cycle_check,
+        .profile = profile,
+        .profile_counters = profile_counters,
+        .stats = !(batch || map || emit_c || serve),
+        .stats_file = stats_file,
+        .metrics = metrics,
+        .metrics_every = metrics_every ? metrics_every : METRICS_DEFAULT_SECONDS,
+        .trace = trace,
+    };
+    struct naz_vm* vm = vm_new(&options);
+
+    char* program = read_file(vm, argv[0]);
+    /* Only for the warnings, vm_load() does the same on its own copy */
+    program_prepare(program, unexpected_char);
+
+    enum naz_vm_status status = vm_load(vm, program);
+    if (status == NAZ_VM_OK && emit_c) {
+        struct naz_program* decoded = program_decode(program);
+        if (program_emit_c(decoded, stdout, unlimited) == -1) {
+            fprintf(stderr, "Functions defined inside of functions cannot be translated to C\n");
+            exit(EXIT_FAILURE);
         }
-        if (program[offset] >= '0' && program[offset] <= '9') {
-            switch(program[offset+1]) {
-                case 'a':
-                case 'd':
-                case 'e':
-                case 'f':
-                case 'g':
-                case 'h':
-                case 'l':
-                case 'm':
-                case 'n':
-                case 'o':
-                case 'p':
-                case 'r':
-                case 's':
-                case 'v':
-                case 'x':
-                    break;
-                default:
-                    die("unexpected tupel");
-            }
-            work_tupel(program+offset);
-            offset += 2;
-            continue;
+        program_destroy(decoded);
+        vm_destroy(vm);
+        free(program);
+        return EXIT_SUCCESS;
+    }
+    if (status == NAZ_VM_OK && batch) {
+        int failed = batch_run(vm, argv[1], argv[2], threads, stdout);
+        vm_destroy(vm);
+        free(program);
+        return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    if (status == NAZ_VM_OK && map) {
+        int failed = map_run(vm, stdin, stdout, threads, threads * MAP_WINDOW_PER_THREAD, stderr);
+        vm_destroy(vm);
+        free(program);
+        return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    if (status == NAZ_VM_OK && serve) {
+        int failed = serve_run(vm, serve, prefork < concurrency ? prefork : concurrency, concurrency, stderr) == -1;
+        vm_destroy(vm);
+        free(program);
+        return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    if (status == NAZ_VM_OK && restore && vm_restore(vm, restore) == -1) {
+        fprintf(stderr, "%s\n", vm_error(vm));
+        exit(EXIT_FAILURE);
+    }
+    signalled = vm;
+    if (status == NAZ_VM_OK) {
+        struct sigaction action = {.sa_handler = request_stats, .sa_flags = SA_RESTART};
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGUSR1, &action, NULL);
+        handle_crashes();
+    }
+    if (status == NAZ_VM_OK && checkpoint) {
+        struct sigaction action = {.sa_handler = request_checkpoint, .sa_flags = SA_RESTART};
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGUSR2, &action, NULL);
+        if (checkpoint_every) {
+            sigaction(SIGALRM, &action, NULL);
+            struct itimerval every = {{checkpoint_every, 0}, {checkpoint_every, 0}};
+            setitimer(ITIMER_REAL, &every, NULL);
         }
-        if (program[offset] == '\n') {
-            offset++;
-            continue;
+    }
+    struct recording* recording = NULL;
+    if (status == NAZ_VM_OK && record) {
+        recording = record_open(record, STDIN_FILENO);
+        if (!recording) {
+            perror(record);
+            exit(EXIT_FAILURE);
         }
-        if (program[offset] == ' ') {
-            /* Do nothing */
-            offset++;
-            continue;
+    }
+    if (status == NAZ_VM_OK && replay) {
+        const char* error;
+        recording = replay_open(replay, real_time, &error);
+        if (!recording) {
+            fprintf(stderr, "%s: %s\n", replay, error);
+            exit(EXIT_FAILURE);
         }
-        printf("Unexcepted char: %c\n", program[offset]);
-        offset++;
+    }
+    if (status == NAZ_VM_OK) {
+        status = vm_run(vm, recording ? recording_read : NULL, NULL, recording);
+    }
+    /* Before vm_report(), which does not return for some of the ways to die */
+    if (recording && recording_close(recording) == -1) {
+        perror(record ? record : replay);
+    }
+    if (trace && trace_close(trace) == -1) {
+        perror(trace_file);
+    }
+    print_profile(vm, profile_json, profile_folded);
+    if (status != NAZ_VM_OK) {
+        exit(vm_report(vm, status));
     }
 
-
-    //printf("%s", program);
-
-    program_code = program;
-    cs = callstack_new_empty();
-    callstack_push(cs, instruction_pointer_from_file(0));
-
-    execute();
-
+    if (memo_stats)
+        vm_print_stats(vm, stderr);
+    vm_destroy(vm);
     free(program);
-    callstack_destroy(cs);
-    variable_cleanup();
-    function_cleanup();
     return EXIT_SUCCESS;
 }
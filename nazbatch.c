@@ -0,0 +1,192 @@
+/*
+    Copyright (C) 2022 Tobias Heineken
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "nazlib.h"
+
+struct batch {
+    /* One per worker, all sharing the decoded program */
+    struct naz_vm** vms;
+    const char* inputs;
+    const char* outputs;
+};
+
+struct job {
+    struct batch* batch;
+    char* name;
+    /* What the interpreter would have exited with */
+    int exit_code;
+    char message[256];
+    size_t bytes_in;
+    size_t bytes_out;
+};
+
+struct files {
+    FILE* in;
+    FILE* out;
+    struct job* job;
+};
+
+static size_t files_read(void* user, char* buf, size_t len) {
+    struct files* files = user;
+    size_t n = fread(buf, 1, len, files->in);
+    files->job->bytes_in += n;
+    return n;
+}
+
+static size_t files_write(void* user, const char* buf, size_t len) {
+    struct files* files = user;
+    size_t n = fwrite(buf, 1, len, files->out);
+    files->job->bytes_out += n;
+    return n;
+}
+
+static char* path_join(const char* dir, const char* name) {
+    char* out = malloc(strlen(dir) + strlen(name) + 2);
+    sprintf(out, "%s/%s", dir, name);
+    return out;
+}
+
+static void batch_job(void* arg, int worker) {
+    struct job* job = arg;
+    struct batch* batch = job->batch;
+    char* in_path = path_join(batch->inputs, job->name);
+    char* out_path = path_join(batch->outputs, job->name);
+    struct files files = {fopen(in_path, "r"), fopen(out_path, "w"), job};
+    if (!files.in || !files.out) {
+        job->exit_code = EXIT_FAILURE;
+        snprintf(job->message, sizeof(job->message), "%s: %s", files.in ? out_path : in_path, strerror(errno));
+    } else {
+        struct naz_vm* vm = batch->vms[worker];
+        enum naz_vm_status status = vm_run(vm, files_read, files_write, &files);
+        switch (status) {
+            case NAZ_VM_OK:
+                job->exit_code = EXIT_SUCCESS;
+                break;
+            case NAZ_VM_DIVIDED_BY_ZERO:
+                job->exit_code = 128 + SIGFPE;
+                break;
+            case NAZ_VM_OVER_BUDGET:
+                job->exit_code = NAZ_EXIT_OVER_BUDGET;
+                break;
+            case NAZ_VM_LOOPING:
+                job->exit_code = NAZ_EXIT_LOOPING;
+                break;
+            default:
+                job->exit_code = EXIT_FAILURE;
+        }
+        if (status != NAZ_VM_OK) {
+            snprintf(job->message, sizeof(job->message), "%s", vm_error(vm));
+        }
+    }
+    if (files.in)
+        fclose(files.in);
+    if (files.out)
+        fclose(files.out);
+    free(in_path);
+    free(out_path);
+}
+
+static int name_compare(const void* lhs, const void* rhs) {
+    return strcmp(*(char* const*) lhs, *(char* const*) rhs);
+}
+
+/* Regular files in the directory, sorted by name. Returns -1 if it cannot be read */
+static int list_inputs(const char* dir, char*** out) {
+    DIR* d = opendir(dir);
+    if (!d) {
+        return -1;
+    }
+    int len = 0, cap = 0;
+    char** names = NULL;
+    struct dirent* entry;
+    while ((entry = readdir(d))) {
+        char* path = path_join(dir, entry->d_name);
+        struct stat st;
+        int regular = stat(path, &st) == 0 && S_ISREG(st.st_mode);
+        free(path);
+        if (!regular) {
+            continue;
+        }
+        if (len == cap) {
+            cap = cap ? cap * 2 : 64;
+            names = realloc(names, sizeof(*names) * cap);
+        }
+        names[len++] = strdup(entry->d_name);
+    }
+    closedir(d);
+    qsort(names, len, sizeof(*names), name_compare);
+    *out = names;
+    return len;
+}
+
+int batch_run(struct naz_vm* vm, const char* inputs, const char* outputs, int threads, FILE* report) {
+    char** names;
+    int count = list_inputs(inputs, &names);
+    if (count == -1) {
+        fprintf(report, "%s: %s\n", inputs, strerror(errno));
+        return 1;
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    struct batch batch = {calloc(threads, sizeof(*batch.vms)), inputs, outputs};
+    for (int i = 0; i < threads; ++i) {
+        batch.vms[i] = vm_clone(vm);
+    }
+    struct job* jobs = calloc(count, sizeof(*jobs));
+    struct pool* pool = pool_new(threads);
+    for (int i = 0; i < count; ++i) {
+        jobs[i].batch = &batch;
+        jobs[i].name = names[i];
+        pool_submit(pool, batch_job, &jobs[i]);
+    }
+    pool_destroy(pool);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    int failed = 0;
+    size_t bytes = 0;
+    for (int i = 0; i < count; ++i) {
+        if (jobs[i].exit_code != EXIT_SUCCESS) {
+            failed++;
+            fprintf(report, "%s: exit %d: %s\n", jobs[i].name, jobs[i].exit_code, jobs[i].message);
+        } else {
+            fprintf(report, "%s: exit 0\n", jobs[i].name);
+        }
+        bytes += jobs[i].bytes_in;
+        free(names[i]);
+    }
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(report, "%d inputs, %d failed, %.3fs on %d threads: %.1f inputs/s, %.2f MiB/s read\n",
+            count, failed, seconds, threads, count / seconds, bytes / seconds / (1 << 20));
+
+    for (int i = 0; i < threads; ++i) {
+        vm_destroy(batch.vms[i]);
+    }
+    free(batch.vms);
+    free(jobs);
+    free(names);
+    return failed;
+}
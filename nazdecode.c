@@ -0,0 +1,425 @@
+/*
+    Copyright (C) 2022 Tobias Heineken
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "nazlib.h"
+
+/* execute() and opcodes() happily look a few chars past the end of a block,
+ * we treat everything there as the terminating '\0' instead.
+ */
+static char char_at(const char* code, int len, int offset) {
+    if (offset >= len) {
+        return '\0';
+    }
+    return code[offset];
+}
+
+static void block_append(struct naz_block* block, int* cap, struct naz_op* op) {
+    if (block->len == *cap) {
+        *cap = *cap ? *cap * 2 : 16;
+        block->ops = realloc(block->ops, sizeof(*block->ops) * *cap);
+    }
+    block->ops[block->len++] = *op;
+}
+
+static void op_die(struct naz_op* op, const char* msg, int pushed) {
+    op->code = NAZ_OP_DIE;
+    op->msg = msg;
+    op->pushed = pushed;
+}
+
+/* Mirrors opcodes() */
+static void decode_special(const char* code, int len, struct naz_op* op) {
+    int offset = op->offset;
+#define AT(X) char_at(code, len, offset + (X))
+    switch (AT(0)) {
+        case '1': {
+                      if (AT(3) != 'f') {
+                          op_die(op, "Using 1x without following it with Xf", 1);
+                          return;
+                      }
+                      int idx = AT(2) - '0';
+                      if (idx < 0 || idx > 9) {
+                          op_die(op, "invalid number of 1xXf", 1);
+                          return;
+                      }
+                      int extra_offset;
+                      for(extra_offset = 4; AT(extra_offset) != '\n' && AT(extra_offset) != '\0'; extra_offset += 2) {
+                          if (AT(extra_offset) == ' ') {
+                              extra_offset--;
+                              continue;
+                          }
+                          if (AT(extra_offset) == '0' && AT(extra_offset + 1) == 'x') {
+                              extra_offset += 2;
+                              break;
+                          }
+                      }
+                      op->code = NAZ_OP_DEFINE;
+                      op->arg = idx;
+                      op->next = offset + extra_offset;
+                      return;
+                  }
+        case '2': {
+                      if (AT(3) != 'v') {
+                          op_die(op, "Using 2x without following it with Xv", 1);
+                          return;
+                      }
+                      int idx = AT(2) - '0';
+                      if (idx < 0 || idx > 9) {
+                          op_die(op, "invalid number of 2xXv", 1);
+                          return;
+                      }
+                      op->code = NAZ_OP_STORE;
+                      op->arg = idx;
+                      op->next = offset + 4;
+                      return;
+                  }
+        case '3': {
+                      if (AT(3) != 'v') {
+                          op_die(op, "Using 3x without following it with Xv", 1);
+                          return;
+                      }
+                      if (AT(5) != 'l' && AT(5) != 'e' && AT(5) != 'g') {
+                          op_die(op, "Using 3x without following it with Xl, Xg or Xe after Yv", 1);
+                          return;
+                      }
+                      op->arg = AT(2) - '0';
+                      op->target = AT(4) - '0';
+                      if (op->arg < 0 || op->arg > 9 || op->target < 0 || op->target > 9) {
+                          op_die(op, "invalid number of 3xXvYZ", 1);
+                          return;
+                      }
+                      op->code = NAZ_OP_BRANCH;
+                      op->cond = AT(5);
+                      op->next = offset + 6;
+                      return;
+                  }
+        default: op_die(op, "unknown opcode", 1);
+    }
+#undef AT
+}
+
+static void decode_function(struct naz_program* prog, int number, const char* definition);
+
+/* Mirrors execute() */
+static void decode_block(struct naz_program* prog, struct naz_block* block, int in_function) {
+    const char* code = block->code;
+    int len = strlen(code);
+    int cap = 0;
+    for (int offset = 0; offset < len; ) {
+        if (code[offset] == '\n' || code[offset] == ' ') {
+            offset++;
+            continue;
+        }
+        if (code[offset] == '0' && char_at(code, len, offset + 1) == 'x') {
+            /* 0x only terminates function definitions */
+            offset += 2;
+            continue;
+        }
+        struct naz_op op = {.offset = offset, .next = offset + 2, .arg = code[offset] - '0'};
+        switch(char_at(code, len, offset + 1)) {
+            case 'x': decode_special(code, len, &op);
+                      break;
+            case 'a': op.code = NAZ_OP_ADD;
+                      break;
+            case 's': op.code = NAZ_OP_ADD;
+                      op.arg = -op.arg;
+                      break;
+            case 'm': op.code = NAZ_OP_MULTIPLY;
+                      break;
+            case 'd': op.code = NAZ_OP_DIVIDE;
+                      break;
+            case 'p': op.code = NAZ_OP_REMAINDER;
+                      break;
+            case 'f': op.code = NAZ_OP_CALL;
+                      op.tail = char_at(code, len, offset + 2) == '\0';
+                      break;
+            case 'r': op.code = NAZ_OP_READ;
+                      break;
+            case 'h': op_die(&op, naz_halt_message, 0);
+                      break;
+            case 'o': op.code = NAZ_OP_OUTPUT;
+                      break;
+            case 'v': op.code = NAZ_OP_LOAD;
+                      break;
+            case 'n': op.code = NAZ_OP_NEGATE;
+                      break;
+            default: op_die(&op, "unknown char for interpreter loop", 0);
+        }
+        if ((op.code == NAZ_OP_LOAD || op.code == NAZ_OP_NEGATE) && (op.arg < 0 || op.arg > 9)) {
+            op_die(&op, "invalid variable number", 0);
+        }
+        if (op.code == NAZ_OP_DEFINE) {
+            if (in_function) {
+                prog->dynamic = 1;
+            } else {
+                decode_function(prog, op.arg, code + offset + 4);
+            }
+        }
+        block_append(block, &cap, &op);
+        if (op.code == NAZ_OP_DIE) {
+            return;
+        }
+        offset = op.next;
+    }
+}
+
+static void decode_function(struct naz_program* prog, int number, const char* definition) {
+    struct naz_block* block = &prog->functions[number];
+    if (block->code) {
+        /* Redefinitions abort at runtime, the first definition is the only one that counts */
+        return;
+    }
+    block->code = function_body(definition);
+    decode_block(prog, block, 1);
+}
+
+struct naz_program* program_decode(const char* code) {
+    struct naz_program* out = calloc(1, sizeof(*out));
+    out->toplevel.code = code;
+    decode_block(out, &out->toplevel, 0);
+    return out;
+}
+
+static int function_known(struct naz_program* prog, int function) {
+    return function >= 0 && function <= 9 && prog->functions[function].code;
+}
+
+static int analyse(struct naz_program* prog, int function, int* reachable, int* reads, int* writes) {
+    if (!function_known(prog, function)) {
+        return 0;
+    }
+    if (*reachable & (1 << function)) {
+        return 1;
+    }
+    *reachable |= 1 << function;
+    struct naz_block* block = &prog->functions[function];
+    for (int i = 0; i < block->len; ++i) {
+        struct naz_op* op = &block->ops[i];
+        switch (op->code) {
+            case NAZ_OP_READ:
+            case NAZ_OP_OUTPUT:
+            case NAZ_OP_DEFINE:
+                return 0;
+            case NAZ_OP_LOAD:
+                *reads |= 1 << op->arg;
+                break;
+            case NAZ_OP_STORE:
+                *writes |= 1 << op->arg;
+                break;
+            case NAZ_OP_NEGATE:
+                *reads |= 1 << op->arg;
+                *writes |= 1 << op->arg;
+                break;
+            case NAZ_OP_BRANCH:
+                *reads |= 1 << op->arg;
+                if (!analyse(prog, op->target, reachable, reads, writes)) {
+                    return 0;
+                }
+                break;
+            case NAZ_OP_CALL:
+                if (!analyse(prog, op->arg, reachable, reads, writes)) {
+                    return 0;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    return 1;
+}
+
+int program_function_effects(struct naz_program* prog, int function, int* reachable, int* reads, int* writes) {
+    *reachable = *reads = *writes = 0;
+    return analyse(prog, function, reachable, reads, writes);
+}
+
+/* Everything a function can jump to or call, including itself */
+static int reachable_functions(struct naz_program* prog, int function, int reachable) {
+    if (reachable & (1 << function)) {
+        return reachable;
+    }
+    reachable |= 1 << function;
+    struct naz_block* block = &prog->functions[function];
+    for (int i = 0; i < block->len; ++i) {
+        if (block->ops[i].code == NAZ_OP_CALL) {
+            reachable = reachable_functions(prog, block->ops[i].arg, reachable);
+        } else if (block->ops[i].code == NAZ_OP_BRANCH) {
+            reachable = reachable_functions(prog, block->ops[i].target, reachable);
+        }
+    }
+    return reachable;
+}
+
+#define ASSIGNED_UNKNOWN (-1)
+#define ASSIGNED_IN_PROGRESS (-2)
+#define ASSIGNED_FAILED (-3)
+
+/* Variables assigned after calling a function with the given ones assigned, intersected over all paths.
+ * Results are cached per function and entry state, recursion assumes nothing new gets assigned.
+ */
+static int assigned_after_call(struct naz_program* prog, int (*cache)[1024], int function, int assigned) {
+    int* result = &cache[function][assigned];
+    if (*result == ASSIGNED_IN_PROGRESS) {
+        return assigned;
+    }
+    if (*result != ASSIGNED_UNKNOWN) {
+        return *result;
+    }
+    *result = ASSIGNED_IN_PROGRESS;
+    struct naz_block* block = &prog->functions[function];
+    int out = 0x3ff;
+    int i;
+    for (i = 0; i < block->len; ++i) {
+        struct naz_op* op = &block->ops[i];
+        int callee = -1;
+        switch (op->code) {
+            case NAZ_OP_LOAD:
+            case NAZ_OP_NEGATE:
+                if (!(assigned & (1 << op->arg))) {
+                    return *result = ASSIGNED_FAILED;
+                }
+                break;
+            case NAZ_OP_STORE:
+                assigned |= 1 << op->arg;
+                break;
+            case NAZ_OP_CALL:
+                callee = op->arg;
+                break;
+            case NAZ_OP_BRANCH: {
+                if (!(assigned & (1 << op->arg))) {
+                    return *result = ASSIGNED_FAILED;
+                }
+                /* Inside of functions, a taken jump ends this one */
+                int taken = assigned_after_call(prog, cache, op->target, assigned);
+                if (taken == ASSIGNED_FAILED) {
+                    return *result = ASSIGNED_FAILED;
+                }
+                out &= taken;
+                break;
+            }
+            case NAZ_OP_DIE:
+                /* Nothing continues after it */
+                return *result = out;
+            default:
+                break;
+        }
+        if (callee >= 0) {
+            assigned = assigned_after_call(prog, cache, callee, assigned);
+            if (assigned == ASSIGNED_FAILED) {
+                return *result = ASSIGNED_FAILED;
+            }
+            if (op->tail) {
+                return *result = out & assigned;
+            }
+        }
+    }
+    return *result = out & assigned;
+}
+
+int program_verify(struct naz_program* prog) {
+    if (prog->dynamic) {
+        return 0;
+    }
+    int verified = NAZ_VERIFIED_SYNTAX | NAZ_VERIFIED_CALLS | NAZ_VERIFIED_VARIABLES;
+    struct naz_block* blocks[11] = {&prog->toplevel};
+    for (int i = 0; i < 10; ++i) {
+        blocks[i + 1] = &prog->functions[i];
+    }
+    for (int i = 0; i < 11; ++i) {
+        for (int j = 0; j < blocks[i]->len; ++j) {
+            struct naz_op* op = &blocks[i]->ops[j];
+            if (op->code == NAZ_OP_DIE && blocks[i]->code[op->offset + 1] != 'h') {
+                /* Everything but Nh dies because of malformed code */
+                verified &= ~NAZ_VERIFIED_SYNTAX;
+            }
+        }
+    }
+
+    int (*cache)[1024] = malloc(sizeof(*cache) * 10);
+    for (int i = 0; i < 10; ++i) {
+        for (int j = 0; j < 1024; ++j) {
+            cache[i][j] = ASSIGNED_UNKNOWN;
+        }
+    }
+    /* The toplevel runs exactly once from start to end */
+    int defined = 0;
+    int assigned = 0;
+    struct naz_block* block = &prog->toplevel;
+    for (int i = 0; i < block->len; ++i) {
+        struct naz_op* op = &block->ops[i];
+        int callee = -1;
+        switch (op->code) {
+            case NAZ_OP_DEFINE:
+                if (defined & (1 << op->arg)) {
+                    /* Redefinitions abort */
+                    verified &= ~NAZ_VERIFIED_CALLS;
+                }
+                defined |= 1 << op->arg;
+                break;
+            case NAZ_OP_LOAD:
+            case NAZ_OP_NEGATE:
+                if (!(assigned & (1 << op->arg))) {
+                    verified &= ~NAZ_VERIFIED_VARIABLES;
+                }
+                break;
+            case NAZ_OP_STORE:
+                assigned |= 1 << op->arg;
+                break;
+            case NAZ_OP_CALL:
+                callee = op->arg;
+                break;
+            case NAZ_OP_BRANCH:
+                if (!(assigned & (1 << op->arg))) {
+                    verified &= ~NAZ_VERIFIED_VARIABLES;
+                }
+                callee = op->target;
+                break;
+            default:
+                break;
+        }
+        if (callee < 0) {
+            continue;
+        }
+        if (!(defined & (1 << callee)) || (reachable_functions(prog, callee, 0) & ~defined)) {
+            verified &= ~NAZ_VERIFIED_CALLS;
+            /* Without the bodies there is nothing to follow */
+            verified &= ~NAZ_VERIFIED_VARIABLES;
+            continue;
+        }
+        int after = assigned_after_call(prog, cache, callee, assigned);
+        if (after == ASSIGNED_FAILED) {
+            verified &= ~NAZ_VERIFIED_VARIABLES;
+        } else if (op->code == NAZ_OP_CALL) {
+            /* A jump that is not taken assigns nothing */
+            assigned = after;
+        }
+    }
+    free(cache);
+    return verified;
+}
+
+void program_destroy(struct naz_program* prog) {
+    free(prog->toplevel.ops);
+    for (int i = 0; i < 10; ++i) {
+        free((char*) prog->functions[i].code);
+        free(prog->functions[i].ops);
+    }
+    free(prog);
+}
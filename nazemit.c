@@ -0,0 +1,389 @@
+/*
+    Copyright (C) 2022 Tobias Heineken
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "nazlib.h"
+
+/* The generated file keeps its own state and only synchronises with nazlib when dying,
+ * so its die() prints the same dump as the interpreter.
+ */
+static const char prelude_common[] =
+"#include <stdio.h>\n"
+"#include <stdlib.h>\n"
+"#include <signal.h>\n"
+"#include \"nazlib.h\"\n"
+"\n"
+"struct naz_frame {\n"
+"    int function;\n"
+"    int offset;\n"
+"    int resume;\n"
+"};\n"
+"static struct naz_frame* naz_frames;\n"
+"static size_t naz_frames_len;\n"
+"static size_t naz_frames_cap;\n"
+"static int naz_defined[10];\n"
+"\n"
+"static inline void naz_push(int function, int offset, int resume) {\n"
+"    if (naz_frames_len == naz_frames_cap) {\n"
+"        naz_frames_cap = naz_frames_cap ? naz_frames_cap * 2 : 64;\n"
+"        naz_frames = realloc(naz_frames, sizeof(*naz_frames) * naz_frames_cap);\n"
+"    }\n"
+"    naz_frames[naz_frames_len].function = function;\n"
+"    naz_frames[naz_frames_len].offset = offset;\n"
+"    naz_frames[naz_frames_len].resume = resume;\n"
+"    naz_frames_len++;\n"
+"}\n"
+"\n"
+"static inline void naz_define(int function, const char* body) {\n"
+"    if (function_set(function, body) == -1) {\n"
+"        fprintf(stderr, \"Redefining function %d, aborting\\n\", function);\n"
+"        exit(EXIT_FAILURE);\n"
+"    }\n"
+"    naz_defined[function] = 1;\n"
+"}\n"
+"\n"
+"static void naz_print_acc(void);\n"
+"static void naz_print_var(int);\n"
+"\n"
+"_Noreturn void die(const char msg[]) {\n"
+"    perror(msg);\n"
+"    for(int i=0; i < 10; ++i){\n"
+"        printf(\"Function %d: %s\\n\", i, function_get(i));\n"
+"    }\n"
+"    for(int i=0; i< 10; ++i){\n"
+"        printf(\"Var %d:\", i);\n"
+"        naz_print_var(i);\n"
+"        printf(\"\\n\");\n"
+"    }\n"
+"    debug_io_state();\n"
+"\n"
+"    printf(\"Acc: \");\n"
+"    naz_print_acc();\n"
+"    printf(\"\\nCallstack:\\n\");\n"
+"    for (size_t i = naz_frames_len; i > 0; i--) {\n"
+"        if (naz_frames[i-1].function >= 0) {\n"
+"            printf(\"%d:%d\\n\", naz_frames[i-1].function, naz_frames[i-1].offset);\n"
+"        } else {\n"
+"            printf(\"Toplevel:%d\\n\", naz_frames[i-1].offset);\n"
+"        }\n"
+"    }\n"
+"    exit(EXIT_FAILURE);\n"
+"}\n"
+"\n"
+"static inline _Noreturn void naz_die_at(const char msg[], int function, int offset) {\n"
+"    naz_push(function, offset, 0);\n"
+"    die(msg);\n"
+"}\n"
+"\n";
+
+/* Limited numbers are plain integers, checked the same way as lnumber does it */
+static const char prelude_limited[] =
+"static long long naz_acc;\n"
+"static long long naz_var[10] = {-128, -128, -128, -128, -128, -128, -128, -128, -128, -128};\n"
+"\n"
+"static void naz_print_acc(void) {\n"
+"    printf(\"%lld\", naz_acc);\n"
+"}\n"
+"\n"
+"static void naz_print_var(int i) {\n"
+"    printf(\"%lld\", naz_var[i]);\n"
+"}\n"
+"\n"
+"static inline long long naz_checked(long long val) {\n"
+"    if (val < -127 || val > 127) {\n"
+"        die(\"invalid result\");\n"
+"    }\n"
+"    return val;\n"
+"}\n"
+"\n"
+"static inline long long naz_divide(long long val, int rhs) {\n"
+"    if ((val < 0) == (rhs < 0)) {\n"
+"        return val / rhs;\n"
+"    }\n"
+"    int res = val / rhs;\n"
+"    int rem = val % rhs;\n"
+"    if (rem == 0) return res;\n"
+"    return res - 1;\n"
+"}\n"
+"\n"
+"static inline void naz_output(int count) {\n"
+"    struct number* acc = number_from(naz_acc);\n"
+"    for (int i = count - 1; i >= 0; i--) {\n"
+"        number_print(acc);\n"
+"    }\n"
+"    number_destroy(acc);\n"
+"}\n"
+"\n"
+"static void naz_init(void) {\n"
+"    variable_init();\n"
+"}\n"
+"\n";
+
+/* Unlimited numbers use nazlib. Like in the interpreter, every number a program can see
+ * is a copy, so even undefined variables start out as copies of number_invalid()
+ */
+static const char prelude_unlimited[] =
+"static struct number* naz_acc;\n"
+"static struct number* naz_var[10];\n"
+"\n"
+"static void naz_print_acc(void) {\n"
+"    struct number* tmp = number_copy(naz_acc);\n"
+"    number_print_dbg(tmp);\n"
+"    number_destroy(tmp);\n"
+"}\n"
+"\n"
+"static void naz_print_var(int i) {\n"
+"    struct number* tmp = number_copy(naz_var[i]);\n"
+"    number_print_dbg(tmp);\n"
+"    number_destroy(tmp);\n"
+"}\n"
+"\n"
+"static inline void naz_set_acc(struct number* val) {\n"
+"    number_destroy(naz_acc);\n"
+"    naz_acc = val;\n"
+"}\n"
+"\n"
+"static inline void naz_set_var(int i, struct number* val) {\n"
+"    number_destroy(naz_var[i]);\n"
+"    naz_var[i] = val;\n"
+"}\n"
+"\n"
+"static inline int naz_compare(int i) {\n"
+"    struct number* acc = number_copy(naz_acc);\n"
+"    struct number* var = number_copy(naz_var[i]);\n"
+"    int res = number_compare(acc, var);\n"
+"    number_destroy(acc);\n"
+"    number_destroy(var);\n"
+"    return res;\n"
+"}\n"
+"\n"
+"static inline void naz_output(int count) {\n"
+"    for (int i = count - 1; i >= 0; i--) {\n"
+"        number_print(naz_acc);\n"
+"    }\n"
+"}\n"
+"\n"
+"static void naz_init(void) {\n"
+"    naz_set_unlimited(1);\n"
+"    variable_init();\n"
+"    naz_acc = number_from(0);\n"
+"    for (int i = 0; i < 10; ++i) {\n"
+"        naz_var[i] = variable_get(i);\n"
+"    }\n"
+"}\n"
+"\n";
+
+static void emit_string(FILE* out, const char* str) {
+    fputc('"', out);
+    for (; *str; ++str) {
+        if (*str == '"' || *str == '\\') {
+            fprintf(out, "\\%c", *str);
+        } else if (*str < 32 || *str > 126) {
+            fprintf(out, "\\%03o", (unsigned char) *str);
+        } else {
+            fputc(*str, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static void emit_source_comment(FILE* out, const char* code, struct naz_op* op) {
+    int len = 2;
+    if (op->code == NAZ_OP_STORE || op->code == NAZ_OP_DEFINE) {
+        len = 4;
+    } else if (op->code == NAZ_OP_BRANCH) {
+        len = 6;
+    }
+    fprintf(out, "    /* ");
+    for (int i = 0; i < len && code[op->offset + i]; ++i) {
+        char c = code[op->offset + i];
+        fputc((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ? c : '?', out);
+    }
+    fprintf(out, " */\n");
+}
+
+/* Calls push the frame to return to and jump, so the depth is only limited by memory as in the interpreter.
+ * resumes counts the places to return to, the frame holds the number of its place
+ */
+static void emit_call(FILE* out, struct naz_program* prog, int self, int function, int tail, int return_offset, const char* indent,
+                      int* resumes) {
+    if (function < 0 || function > 9 || !prog->functions[function].code) {
+        if (!tail) {
+            fprintf(out, "%snaz_push(%d, %d, 0);\n", indent, self, return_offset);
+        }
+        fprintf(out, "%sdie(\"Using an undefined function\");\n", indent);
+        return;
+    }
+    if (tail) {
+        fprintf(out, "%sgoto naz_f%d;\n", indent, function);
+        return;
+    }
+    int resume = ++*resumes;
+    fprintf(out, "%snaz_push(%d, %d, %d);\n", indent, self, return_offset, resume);
+    fprintf(out, "%sgoto naz_f%d;\n", indent, function);
+    fprintf(out, "naz_resume%d:;\n", resume);
+}
+
+static void emit_condition(FILE* out, struct naz_op* op, int unlimited) {
+    const char* cmp = op->cond == 'e' ? "==" : op->cond == 'l' ? "<" : ">";
+    if (unlimited) {
+        fprintf(out, "naz_compare(%d) %s 0", op->arg, cmp);
+    } else {
+        fprintf(out, "naz_acc %s naz_var[%d]", cmp, op->arg);
+    }
+}
+
+static void emit_op(FILE* out, struct naz_program* prog, struct naz_block* block, int self, struct naz_op* op, int unlimited,
+                    int* resumes) {
+    emit_source_comment(out, block->code, op);
+    switch (op->code) {
+        case NAZ_OP_ADD:
+            if (unlimited)
+                fprintf(out, "    number_add(naz_acc, %d);\n", op->arg);
+            else
+                fprintf(out, "    naz_acc = naz_checked(naz_acc + %d);\n", op->arg);
+            break;
+        case NAZ_OP_MULTIPLY:
+            if (unlimited)
+                fprintf(out, "    number_multiply(naz_acc, %d);\n", op->arg);
+            else
+                fprintf(out, "    naz_acc = naz_checked(naz_acc * %d);\n", op->arg);
+            break;
+        case NAZ_OP_DIVIDE:
+            if (unlimited)
+                fprintf(out, "    number_divide(naz_acc, %d);\n", op->arg);
+            else if (op->arg == 0)
+                fprintf(out, "    raise(SIGFPE);\n");
+            else
+                fprintf(out, "    naz_acc = naz_divide(naz_acc, %d);\n", op->arg);
+            break;
+        case NAZ_OP_REMAINDER:
+            if (unlimited)
+                fprintf(out, "    number_remainder(naz_acc, %d);\n", op->arg);
+            else if (op->arg == 0)
+                fprintf(out, "    raise(SIGFPE);\n");
+            else
+                fprintf(out, "    naz_acc = naz_acc %% %d;\n", op->arg);
+            break;
+        case NAZ_OP_LOAD:
+            if (unlimited)
+                fprintf(out, "    naz_set_acc(number_copy(naz_var[%d]));\n", op->arg);
+            else
+                fprintf(out, "    naz_acc = naz_var[%d];\n", op->arg);
+            break;
+        case NAZ_OP_STORE:
+            if (unlimited)
+                fprintf(out, "    naz_set_var(%d, number_copy(naz_acc));\n", op->arg);
+            else
+                fprintf(out, "    naz_var[%d] = naz_acc;\n", op->arg);
+            break;
+        case NAZ_OP_NEGATE:
+            if (unlimited)
+                fprintf(out, "    number_multiply(naz_var[%d], -1);\n", op->arg);
+            else
+                fprintf(out, "    naz_var[%d] = naz_checked(-naz_var[%d]);\n", op->arg, op->arg);
+            break;
+        case NAZ_OP_READ:
+            if (unlimited)
+                fprintf(out, "    naz_set_acc(number_from(read_by_offset(%d)));\n", op->arg);
+            else
+                fprintf(out, "    naz_acc = read_by_offset(%d);\n", op->arg);
+            break;
+        case NAZ_OP_OUTPUT:
+            if (op->arg > 0)
+                fprintf(out, "    naz_output(%d);\n", op->arg);
+            break;
+        case NAZ_OP_DEFINE:
+            fprintf(out, "    naz_define(%d, ", op->arg);
+            emit_string(out, prog->functions[op->arg].code);
+            fprintf(out, ");\n");
+            break;
+        case NAZ_OP_CALL:
+            emit_call(out, prog, self, op->arg, op->tail, op->next, "    ", resumes);
+            break;
+        case NAZ_OP_BRANCH:
+            fprintf(out, "    if (");
+            emit_condition(out, op, unlimited);
+            fprintf(out, ") {\n");
+            /* On the toplevel a jump is a call, inside of functions it replaces the current one */
+            emit_call(out, prog, self, op->target, self >= 0, op->next, "        ", resumes);
+            fprintf(out, "    }\n");
+            break;
+        case NAZ_OP_DIE:
+            fputs("    ", out);
+            fprintf(out, op->pushed ? "naz_die_at(" : "die(");
+            emit_string(out, op->msg);
+            if (op->pushed)
+                fprintf(out, ", %d, %d", self, op->offset);
+            fprintf(out, ");\n");
+            break;
+    }
+}
+
+int program_emit_c(struct naz_program* prog, FILE* out, int unlimited) {
+    if (prog->dynamic) {
+        return -1;
+    }
+    fprintf(out, "/* Generated by cnaz, compile with\n"
+                 " * cc -std=gnu99 -O2 -o program program.c nazlib.c\n"
+                 " */\n");
+    fputs(prelude_common, out);
+    fputs(unlimited ? prelude_unlimited : prelude_limited, out);
+
+    /* One function with a label per naz function, returning pops a frame and jumps to its place */
+    int resumes = 0;
+    fprintf(out, "int main(void) {\n"
+                 "    naz_init();\n");
+    for (int j = 0; j < prog->toplevel.len; ++j) {
+        emit_op(out, prog, &prog->toplevel, -1, &prog->toplevel.ops[j], unlimited, &resumes);
+    }
+    fprintf(out, "    return EXIT_SUCCESS;\n");
+
+    int functions = 0;
+    for (int i = 0; i < 10; ++i) {
+        struct naz_block* block = &prog->functions[i];
+        if (!block->code)
+            continue;
+        functions++;
+        fprintf(out, "\nnaz_f%d:\n"
+                     "    if (!naz_defined[%d]) {\n"
+                     "        die(\"Using an undefined function\");\n"
+                     "    }\n", i, i);
+        for (int j = 0; j < block->len; ++j) {
+            emit_op(out, prog, block, i, &block->ops[j], unlimited, &resumes);
+        }
+        struct naz_op* last = block->len ? &block->ops[block->len - 1] : NULL;
+        if (!last || !(last->code == NAZ_OP_CALL && last->tail)) {
+            fprintf(out, "    goto naz_return;\n");
+        }
+    }
+    if (functions) {
+        fprintf(out, "\nnaz_return:\n"
+                     "    if (!naz_frames_len) {\n"
+                     "        return EXIT_SUCCESS;\n"
+                     "    }\n"
+                     "    switch (naz_frames[--naz_frames_len].resume) {\n");
+        for (int r = 1; r <= resumes; ++r) {
+            fprintf(out, "        case %d: goto naz_resume%d;\n", r, r);
+        }
+        fprintf(out, "    }\n");
+    }
+    fprintf(out, "    return EXIT_SUCCESS;\n}\n");
+    return 0;
+}
@@ -0,0 +1,466 @@
+/*
+    Copyright (C) 2022 Tobias Heineken
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "nazlib.h"
+
+/* -u values further out than this are not followed, so that number_from_limbs() and long long suffice */
+#define FOLD_LIMIT 100000000
+
+enum value_kind {
+    VALUE_UNKNOWN = 0,
+    VALUE_KNOWN,
+    /* Function summaries only: whatever the slot held when the function got entered */
+    VALUE_PASS,
+};
+
+/* -u numbers carry their own sign, so 0 and -0 are two different known values there */
+struct value {
+    enum value_kind kind;
+    int negative;
+    long long val;
+};
+
+/* Slots 0 to 9 are the variables, ACC the accumulator */
+#define ACC 10
+struct abstract {
+    /* 0 if no run gets here */
+    int reached;
+    struct value slots[11];
+};
+
+struct fold {
+    /* op to continue with */
+    int end;
+    char* bytes;
+    size_t len;
+    /* Everything the folded ops wrote, the accumulator always */
+    int stores;
+    struct value slots[11];
+};
+
+struct folds {
+    int unlimited;
+    struct abstract summaries[10];
+    /* Per block and op, NULL where nothing gets folded. The toplevel is block 0 */
+    struct fold** at[11];
+    int len[11];
+};
+
+static int value_same(const struct value* a, const struct value* b) {
+    if (a->kind != b->kind) {
+        return 0;
+    }
+    return a->kind != VALUE_KNOWN || (a->val == b->val && a->negative == b->negative);
+}
+
+static void abstract_join(struct abstract* into, const struct abstract* from) {
+    if (!from->reached) {
+        return;
+    }
+    if (!into->reached) {
+        *into = *from;
+        return;
+    }
+    for (int i = 0; i < 11; ++i) {
+        if (!value_same(&into->slots[i], &from->slots[i])) {
+            into->slots[i].kind = VALUE_UNKNOWN;
+        }
+    }
+}
+
+static int abstract_same(const struct abstract* a, const struct abstract* b) {
+    if (a->reached != b->reached) {
+        return 0;
+    }
+    for (int i = 0; a->reached && i < 11; ++i) {
+        if (!value_same(&a->slots[i], &b->slots[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* The state after calling a function with the given summary */
+static void abstract_call(struct abstract* state, const struct abstract* summary) {
+    if (!summary->reached) {
+        /* Never returns */
+        state->reached = 0;
+        return;
+    }
+    for (int i = 0; i < 11; ++i) {
+        if (summary->slots[i].kind != VALUE_PASS) {
+            state->slots[i] = summary->slots[i];
+        }
+    }
+}
+
+static struct value known(int negative, long long val) {
+    return (struct value) {VALUE_KNOWN, negative, val};
+}
+
+/* What op does to a known accumulator, mirroring number_*() of the mode.
+ * Returns 0 if it dies or leaves the values followed here.
+ */
+static int fold_arith(int unlimited, const struct naz_op* op, struct value* acc) {
+    long long val = acc->val;
+    if (!unlimited) {
+        switch (op->code) {
+            case NAZ_OP_ADD: val += op->arg; break;
+            case NAZ_OP_MULTIPLY: val *= op->arg; break;
+            case NAZ_OP_DIVIDE:
+                if (op->arg == 0) {
+                    return 0;
+                }
+                /* Rounds down, like number_divide() */
+                val = val / op->arg - ((val < 0) != (op->arg < 0) && val % op->arg != 0);
+                break;
+            case NAZ_OP_REMAINDER:
+                if (op->arg == 0) {
+                    return 0;
+                }
+                val %= op->arg;
+                break;
+            default: return 0;
+        }
+        if (val < -127 || val > 127) {
+            return 0;
+        }
+        *acc = known(val < 0, val);
+        return 1;
+    }
+    /* Sign and magnitude, as the limbs keep them */
+    int negative = acc->negative;
+    long long mag = val < 0 ? -val : val;
+    switch (op->code) {
+        case NAZ_OP_ADD: {
+            long long i = op->arg < 0 ? -op->arg : op->arg;
+            if (op->arg == 0) {
+                break;
+            } else if ((op->arg < 0) == negative) {
+                mag += i;
+            } else if (mag >= i) {
+                mag -= i;
+            } else {
+                mag = i - mag;
+                negative = !negative;
+            }
+            break;
+        }
+        case NAZ_OP_MULTIPLY:
+            /* Positive factors drop the sign */
+            mag *= op->arg;
+            negative = 0;
+            break;
+        case NAZ_OP_DIVIDE: {
+            if (op->arg == 0) {
+                return 0;
+            }
+            long long rem = mag % op->arg;
+            mag /= op->arg;
+            if (negative && rem != 0) {
+                mag++;
+            }
+            break;
+        }
+        case NAZ_OP_REMAINDER:
+            if (op->arg <= 0) {
+                return 0;
+            }
+            mag %= op->arg;
+            break;
+        default: return 0;
+    }
+    if (mag > FOLD_LIMIT) {
+        return 0;
+    }
+    *acc = known(negative, negative ? -mag : mag);
+    return 1;
+}
+
+/* The bytes No prints for a known accumulator, -1 if it dies or writes anything longer */
+static int fold_byte(int unlimited, const struct value* acc) {
+    long long val = acc->val;
+    if (unlimited && acc->negative) {
+        return -1;
+    }
+    if (val >= 0 && val < 10) {
+        return '0' + val;
+    }
+    if (val == 10 || (val >= 32 && val <= 126)) {
+        return val;
+    }
+    /* -u prints nothing for the other control characters */
+    return unlimited && val > 0 && val < 32 ? 0 : -1;
+}
+
+/* Applies op to state, for everything that neither calls nor jumps */
+static void abstract_step(int unlimited, struct abstract* state, const struct naz_op* op) {
+    struct value* acc = &state->slots[ACC];
+    switch (op->code) {
+        case NAZ_OP_ADD:
+        case NAZ_OP_MULTIPLY:
+        case NAZ_OP_DIVIDE:
+        case NAZ_OP_REMAINDER:
+            if (op->code == NAZ_OP_MULTIPLY && op->arg == 0) {
+                /* 0m is how programs start over, it dies on nothing and leaves a positive 0 in both modes */
+                *acc = known(0, 0);
+            } else if (acc->kind != VALUE_KNOWN || !fold_arith(unlimited, op, acc)) {
+                acc->kind = VALUE_UNKNOWN;
+            }
+            break;
+        case NAZ_OP_READ:
+            acc->kind = VALUE_UNKNOWN;
+            break;
+        case NAZ_OP_LOAD:
+            *acc = state->slots[op->arg];
+            if (acc->kind == VALUE_PASS) {
+                /* The variable as it was, not the accumulator */
+                acc->kind = VALUE_UNKNOWN;
+            }
+            break;
+        case NAZ_OP_STORE:
+            state->slots[op->arg] = *acc;
+            if (acc->kind == VALUE_PASS) {
+                state->slots[op->arg].kind = VALUE_UNKNOWN;
+            }
+            break;
+        case NAZ_OP_NEGATE: {
+            struct value* var = &state->slots[op->arg];
+            if (var->kind == VALUE_KNOWN) {
+                *var = known(unlimited ? !var->negative : -var->val < 0, -var->val);
+            } else {
+                var->kind = VALUE_UNKNOWN;
+            }
+            break;
+        }
+        case NAZ_OP_DIE:
+            state->reached = 0;
+            break;
+        default:
+            break;
+    }
+}
+
+/* Folds the ops from the No at start on that only work on known values, up to the last No among them.
+ * Stops before anything that would die, so that it still dies in the interpreter. Returns the op after the stretch.
+ */
+static int fold_stretch(struct folds* folds, struct naz_block* block, int start, struct abstract* state, struct fold** at) {
+    struct abstract cur = *state;
+    char* bytes = NULL;
+    size_t len = 0, cap = 0, folded_len = 0;
+    int stores = 0, folded_stores = 0;
+    int end = start;
+    for (int i = start; i < block->len; ++i) {
+        struct naz_op* op = &block->ops[i];
+        struct value* acc = &cur.slots[ACC];
+        int ok;
+        switch (op->code) {
+            case NAZ_OP_OUTPUT: {
+                int byte = fold_byte(folds->unlimited, acc);
+                ok = byte != -1;
+                for (int n = op->arg; ok && byte && n > 0; n--) {
+                    if (len == cap) {
+                        cap = cap ? cap * 2 : 64;
+                        bytes = realloc(bytes, cap);
+                    }
+                    bytes[len++] = byte;
+                }
+                break;
+            }
+            case NAZ_OP_LOAD:
+            case NAZ_OP_NEGATE:
+                ok = cur.slots[op->arg].kind == VALUE_KNOWN;
+                break;
+            case NAZ_OP_STORE:
+                ok = 1;
+                break;
+            case NAZ_OP_ADD:
+            case NAZ_OP_MULTIPLY:
+            case NAZ_OP_DIVIDE:
+            case NAZ_OP_REMAINDER: {
+                struct value res = *acc;
+                ok = fold_arith(folds->unlimited, op, &res);
+                break;
+            }
+            default:
+                ok = 0;
+        }
+        if (!ok) {
+            break;
+        }
+        if (op->code == NAZ_OP_STORE || op->code == NAZ_OP_NEGATE) {
+            stores |= 1 << op->arg;
+        }
+        abstract_step(folds->unlimited, &cur, op);
+        if (op->code == NAZ_OP_OUTPUT) {
+            end = i + 1;
+            *state = cur;
+            folded_len = len;
+            folded_stores = stores;
+        }
+    }
+    if (end - start < 2) {
+        /* A single No is as fast as it gets already */
+        free(bytes);
+        return start + 1;
+    }
+    struct fold* fold = malloc(sizeof(*fold));
+    fold->end = end;
+    fold->bytes = bytes;
+    fold->len = folded_len;
+    fold->stores = folded_stores;
+    memcpy(fold->slots, state->slots, sizeof(fold->slots));
+    at[start] = fold;
+    return end;
+}
+
+/* Follows the block from entry, joining every way out of a function into exits.
+ * With at set, the stretches of known output are folded on the way.
+ */
+static void fold_walk(struct folds* folds, struct naz_program* prog, int function, struct abstract state,
+                      struct abstract* exits, struct fold** at) {
+    struct naz_block* block = function >= 0 ? &prog->functions[function] : &prog->toplevel;
+    for (int i = 0; i < block->len && state.reached; ++i) {
+        struct naz_op* op = &block->ops[i];
+        switch (op->code) {
+            case NAZ_OP_CALL:
+                if (op->tail && function >= 0) {
+                    abstract_call(&state, &folds->summaries[op->arg]);
+                    abstract_join(exits, &state);
+                    return;
+                }
+                abstract_call(&state, &folds->summaries[op->arg]);
+                break;
+            case NAZ_OP_BRANCH: {
+                struct abstract taken = state;
+                abstract_call(&taken, &folds->summaries[op->target]);
+                if (function >= 0) {
+                    abstract_join(exits, &taken);
+                } else {
+                    /* Toplevel jumps return to the next op */
+                    abstract_join(&state, &taken);
+                }
+                break;
+            }
+            case NAZ_OP_OUTPUT:
+                if (at && state.slots[ACC].kind == VALUE_KNOWN) {
+                    i = fold_stretch(folds, block, i, &state, at) - 1;
+                    continue;
+                }
+                break;
+            default:
+                abstract_step(folds->unlimited, &state, op);
+        }
+    }
+    if (function >= 0) {
+        abstract_join(exits, &state);
+    }
+}
+
+struct folds* folds_new(struct naz_program* prog, int unlimited) {
+    struct folds* out = calloc(1, sizeof(*out));
+    out->unlimited = unlimited;
+    if (prog->dynamic) {
+        /* Function bodies are not known ahead of time */
+        return out;
+    }
+    struct abstract entry = {.reached = 1};
+    for (int i = 0; i < 11; ++i) {
+        entry.slots[i].kind = VALUE_PASS;
+    }
+    /* What every function leaves behind, grown until nothing changes. Undefined functions die */
+    for (int changed = 1; changed; ) {
+        changed = 0;
+        for (int f = 0; f < 10; ++f) {
+            if (!prog->functions[f].code) {
+                continue;
+            }
+            struct abstract exits = out->summaries[f];
+            fold_walk(out, prog, f, entry, &exits, NULL);
+            if (!abstract_same(&exits, &out->summaries[f])) {
+                out->summaries[f] = exits;
+                changed = 1;
+            }
+        }
+    }
+
+    struct abstract unknown = {.reached = 1};
+    struct abstract start = unknown;
+    start.slots[ACC] = known(0, 0);
+    struct abstract exits;
+    out->len[0] = prog->toplevel.len;
+    out->at[0] = calloc(prog->toplevel.len + 1, sizeof(*out->at[0]));
+    fold_walk(out, prog, -1, start, &exits, out->at[0]);
+    for (int f = 0; f < 10; ++f) {
+        if (prog->functions[f].code) {
+            out->len[f + 1] = prog->functions[f].len;
+            out->at[f + 1] = calloc(prog->functions[f].len + 1, sizeof(*out->at[f + 1]));
+            fold_walk(out, prog, f, unknown, &exits, out->at[f + 1]);
+        }
+    }
+    return out;
+}
+
+static struct number* value_number(const struct value* val) {
+    unsigned mag = val->val < 0 ? -val->val : val->val;
+    return number_from_limbs(&mag, 1, val->negative);
+}
+
+int folds_apply(struct folds* folds, int function, int op) {
+    struct fold** at = folds->at[function + 1];
+    struct fold* fold = at ? at[op] : NULL;
+    if (!fold) {
+        return op;
+    }
+    if (fold->len) {
+        output_write(fold->bytes, fold->len);
+    }
+    for (int i = 0; i < 11; ++i) {
+        if (i != ACC && !(fold->stores & (1 << i))) {
+            continue;
+        }
+        if (folds->unlimited) {
+            struct number* val = value_number(&fold->slots[i]);
+            if (i == ACC) {
+                accumulator_set(val);
+            } else {
+                variable_set(i, val);
+            }
+        } else if (i == ACC) {
+            accumulator_set_value(fold->slots[i].val);
+        } else {
+            variable_set_value(i, fold->slots[i].val);
+        }
+    }
+    return fold->end;
+}
+
+void folds_destroy(struct folds* folds) {
+    for (int b = 0; b < 11; ++b) {
+        for (int i = 0; folds->at[b] && i < folds->len[b]; ++i) {
+            if (folds->at[b][i]) {
+                free(folds->at[b][i]->bytes);
+                free(folds->at[b][i]);
+            }
+        }
+        free(folds->at[b]);
+    }
+    free(folds);
+}
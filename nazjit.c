@@ -0,0 +1,585 @@
+/*
+    Copyright (C) 2022 Tobias Heineken
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include "nazlib.h"
+
+#if defined(__x86_64__)
+
+#include <sys/mman.h>
+
+/* Register usage of the generated code:
+ * rbx: accumulator
+ * r12: struct naz_jit*
+ * r13: top of the shadow callstack, one entry per return address the interpreter would push
+ *
+ * Every naz function is a native function. Its prologue aligns the stack,
+ * so helpers can be called anywhere in the body without further ado.
+ * Tail calls and jumps from 3x inside of functions become a jmp, so loops don't grow any stack.
+ */
+
+/* Calls deeper than this die instead of running into the end of a stack */
+#define JIT_MAX_DEPTH (1ul << 22)
+/* Both stacks are reserved lazily. Every call takes 16 bytes of machine stack, helpers get the rest */
+#define JIT_STACK_SIZE (JIT_MAX_DEPTH * 16 + (8ul << 20))
+#define JIT_SHADOW_SIZE (JIT_MAX_DEPTH * 8)
+/* PROT_NONE at the end each stack grows towards, so running over it faults instead of hitting other memory */
+#define JIT_GUARD_SIZE 4096
+
+struct naz_jit {
+    long long variables[10];
+    long long accumulator;
+    unsigned long long* shadow;
+    unsigned char defined[10];
+
+    /* Position opcodes() would have pushed before dying, if any */
+    int pushed;
+    int pushed_function;
+    int pushed_offset;
+
+    unsigned long long* shadow_base;
+    /* One past the deepest entry the shadow callstack may get */
+    unsigned long long* shadow_limit;
+    char* stack;
+    unsigned char* code;
+    size_t code_size;
+    void (*entry)(struct naz_jit*, void* stack_top);
+    /* Returns from entry() to jit_run() right away, from wherever on the stack of the code */
+    void (*leave)(struct naz_jit*);
+    /* The stack entry() got called on, NULL while no code runs */
+    void* native_stack;
+    struct naz_program* prog;
+};
+
+static unsigned long long shadow_entry(int function, int offset) {
+    return ((unsigned long long)(unsigned) function << 32) | (unsigned) offset;
+}
+
+/* HELPERS, called from generated code */
+
+static void jit_helper_die(struct naz_jit* jit, const char* msg, int pushed, int function, int offset) {
+    jit->pushed = pushed;
+    jit->pushed_function = function;
+    jit->pushed_offset = offset;
+    die(msg);
+}
+
+static void jit_helper_output(struct naz_jit* jit, int count) {
+    struct number* acc = number_from(jit->accumulator);
+    for (int i = count - 1; i >= 0; i--) {
+        number_print(acc);
+    }
+    number_destroy(acc);
+}
+
+static void jit_helper_define(struct naz_jit* jit, int function, const char* definition) {
+    if (function_set(function, definition) == -1) {
+        die_redefined(function);
+    }
+    jit->defined[function] = 1;
+}
+
+/* Division and remainder by anything but 1..9 */
+static long long jit_helper_divide(struct naz_jit* jit, int rhs) {
+    if (rhs == 0) {
+        die_divided_by_zero();
+    }
+    long long val = jit->accumulator;
+    if ((val < 0) == (rhs < 0)) {
+        return val / rhs;
+    }
+    int res = val / rhs;
+    int rem = val % rhs;
+    if (rem == 0) return res;
+    return res - 1;
+}
+
+static long long jit_helper_remainder(struct naz_jit* jit, int rhs) {
+    if (rhs == 0) {
+        die_divided_by_zero();
+    }
+    return jit->accumulator % rhs;
+}
+
+/* EMITTER */
+
+struct emitter {
+    unsigned char* buf;
+    size_t len;
+    size_t cap;
+
+    /* rel32 fields that point to a label which might not be emitted yet */
+    struct fixup {
+        size_t pos;
+        int label;
+    } *fixups;
+    int fixups_len;
+    int fixups_cap;
+};
+
+enum {
+    LABEL_FUNCTION = 0, /* 0..9 */
+    LABEL_TOPLEVEL = 10,
+    LABEL_UNDEFINED,
+    LABEL_DIE_INVALID,
+    LABEL_DIE_UNDEFINED,
+    LABEL_DIE_DEPTH,
+    LABEL_COUNT,
+};
+
+static void emit_byte(struct emitter* e, unsigned char b) {
+    if (e->len == e->cap) {
+        e->cap = e->cap ? e->cap * 2 : 4096;
+        e->buf = realloc(e->buf, e->cap);
+    }
+    e->buf[e->len++] = b;
+}
+
+static void emit_bytes(struct emitter* e, const char* bytes, int n) {
+    for (int i = 0; i < n; ++i) {
+        emit_byte(e, bytes[i]);
+    }
+}
+
+static void emit_u32(struct emitter* e, unsigned v) {
+    for (int i = 0; i < 4; ++i) {
+        emit_byte(e, (v >> (8 * i)) & 0xff);
+    }
+}
+
+static void emit_u64(struct emitter* e, unsigned long long v) {
+    emit_u32(e, v & 0xffffffff);
+    emit_u32(e, v >> 32);
+}
+
+static void patch_rel32(struct emitter* e, size_t pos, size_t target) {
+    unsigned rel = (unsigned)(target - (pos + 4));
+    for (int i = 0; i < 4; ++i) {
+        e->buf[pos + i] = (rel >> (8 * i)) & 0xff;
+    }
+}
+
+static void emit_rel32_to_label(struct emitter* e, int label) {
+    if (e->fixups_len == e->fixups_cap) {
+        e->fixups_cap = e->fixups_cap ? e->fixups_cap * 2 : 64;
+        e->fixups = realloc(e->fixups, sizeof(*e->fixups) * e->fixups_cap);
+    }
+    e->fixups[e->fixups_len].pos = e->len;
+    e->fixups[e->fixups_len].label = label;
+    e->fixups_len++;
+    emit_u32(e, 0);
+}
+
+/* op [r12 + disp32] with reg in the ModRM reg field, rex without the B bit */
+static void emit_r12_mem(struct emitter* e, unsigned char rex, unsigned char opcode, int reg, size_t disp) {
+    emit_byte(e, rex | 0x01);
+    emit_byte(e, opcode);
+    emit_byte(e, 0x84 | ((reg & 7) << 3));
+    emit_byte(e, 0x24);
+    emit_u32(e, disp);
+}
+
+static void emit_call_label(struct emitter* e, int label) {
+    emit_byte(e, 0xe8);
+    emit_rel32_to_label(e, label);
+}
+
+static void emit_jmp_label(struct emitter* e, int label) {
+    emit_byte(e, 0xe9);
+    emit_rel32_to_label(e, label);
+}
+
+/* jcc with a 0x0f 0x8X opcode */
+static void emit_jcc_label(struct emitter* e, unsigned char cc, int label) {
+    emit_byte(e, 0x0f);
+    emit_byte(e, cc);
+    emit_rel32_to_label(e, label);
+}
+
+static size_t emit_jcc_forward(struct emitter* e, unsigned char cc) {
+    emit_byte(e, 0x0f);
+    emit_byte(e, cc);
+    size_t pos = e->len;
+    emit_u32(e, 0);
+    return pos;
+}
+
+#define JCC_JE  0x84
+#define JCC_JNE 0x85
+#define JCC_JAE 0x83
+#define JCC_JA  0x87
+#define JCC_JGE 0x8d
+#define JCC_JLE 0x8e
+
+/* Everything a helper might need to die with the right state */
+static void emit_save_state(struct emitter* e) {
+    /* mov [r12 + accumulator], rbx */
+    emit_r12_mem(e, 0x48, 0x89, 3, offsetof(struct naz_jit, accumulator));
+    /* mov [r12 + shadow], r13 */
+    emit_r12_mem(e, 0x4c, 0x89, 5, offsetof(struct naz_jit, shadow));
+}
+
+/* Calls fn(jit, rsi, rdx, ecx, r8d) */
+static void emit_helper_call(struct emitter* e, void* fn, unsigned long long rsi, unsigned long long rdx, int ecx, int r8d) {
+    emit_save_state(e);
+    /* mov rdi, r12 */
+    emit_bytes(e, "\x4c\x89\xe7", 3);
+    emit_bytes(e, "\x48\xbe", 2);
+    emit_u64(e, rsi);
+    emit_bytes(e, "\x48\xba", 2);
+    emit_u64(e, rdx);
+    emit_byte(e, 0xb9);
+    emit_u32(e, ecx);
+    emit_bytes(e, "\x41\xb8", 2);
+    emit_u32(e, r8d);
+    /* mov rax, fn; call rax */
+    emit_bytes(e, "\x48\xb8", 2);
+    emit_u64(e, (unsigned long long) fn);
+    emit_bytes(e, "\xff\xd0", 2);
+}
+
+/* Calls fn(edi) for functions of nazlib that do not need the machine */
+static void emit_plain_call(struct emitter* e, void* fn, int edi) {
+    emit_save_state(e);
+    emit_byte(e, 0xbf);
+    emit_u32(e, edi);
+    /* mov rax, fn; call rax */
+    emit_bytes(e, "\x48\xb8", 2);
+    emit_u64(e, (unsigned long long) fn);
+    emit_bytes(e, "\xff\xd0", 2);
+}
+
+/* rax has to be within -127..127, otherwise die("invalid result") */
+static void emit_range_check(struct emitter* e) {
+    /* lea rcx, [rax + 127]; cmp rcx, 254; ja die_invalid */
+    emit_bytes(e, "\x48\x8d\x48\x7f", 4);
+    emit_bytes(e, "\x48\x81\xf9\xfe\x00\x00\x00", 7);
+    emit_jcc_label(e, JCC_JA, LABEL_DIE_INVALID);
+}
+
+static void emit_shadow_push(struct emitter* e, int function, int offset) {
+    /* cmp r13, [r12 + shadow_limit]; jae die_depth */
+    emit_r12_mem(e, 0x4c, 0x3b, 5, offsetof(struct naz_jit, shadow_limit));
+    emit_jcc_label(e, JCC_JAE, LABEL_DIE_DEPTH);
+    /* mov rax, imm64; mov [r13], rax; add r13, 8 */
+    emit_bytes(e, "\x48\xb8", 2);
+    emit_u64(e, shadow_entry(function, offset));
+    emit_bytes(e, "\x49\x89\x45\x00", 4);
+    emit_bytes(e, "\x49\x83\xc5\x08", 4);
+}
+
+static void emit_shadow_pop(struct emitter* e) {
+    /* sub r13, 8 */
+    emit_bytes(e, "\x49\x83\xed\x08", 4);
+}
+
+static void emit_prologue(struct emitter* e) {
+    /* sub rsp, 8 */
+    emit_bytes(e, "\x48\x83\xec\x08", 4);
+}
+
+static void emit_epilogue(struct emitter* e) {
+    /* add rsp, 8 */
+    emit_bytes(e, "\x48\x83\xc4\x08", 4);
+}
+
+static int function_label(struct naz_program* prog, int function) {
+    if (function < 0 || function > 9 || !prog->functions[function].code) {
+        return LABEL_UNDEFINED;
+    }
+    return LABEL_FUNCTION + function;
+}
+
+static void emit_call(struct emitter* e, struct naz_program* prog, int self, int function, int tail, int return_offset) {
+    if (tail) {
+        emit_epilogue(e);
+        emit_jmp_label(e, function_label(prog, function));
+        return;
+    }
+    emit_shadow_push(e, self, return_offset);
+    emit_call_label(e, function_label(prog, function));
+    emit_shadow_pop(e);
+}
+
+static void emit_op(struct emitter* e, struct naz_program* prog, struct naz_block* block, int self, struct naz_op* op) {
+    size_t skip;
+    switch(op->code) {
+        case NAZ_OP_ADD:
+            /* lea rax, [rbx + arg] */
+            emit_bytes(e, "\x48\x8d\x83", 3);
+            emit_u32(e, op->arg);
+            emit_range_check(e);
+            /* mov rbx, rax */
+            emit_bytes(e, "\x48\x89\xc3", 3);
+            break;
+        case NAZ_OP_MULTIPLY:
+            /* imul rax, rbx, arg */
+            emit_bytes(e, "\x48\x69\xc3", 3);
+            emit_u32(e, op->arg);
+            emit_range_check(e);
+            emit_bytes(e, "\x48\x89\xc3", 3);
+            break;
+        case NAZ_OP_DIVIDE:
+        case NAZ_OP_REMAINDER:
+            if (op->arg < 1 || op->arg > 9) {
+                emit_helper_call(e, op->code == NAZ_OP_DIVIDE ? (void*) jit_helper_divide : (void*) jit_helper_remainder, (long long) op->arg, 0, 0, 0);
+                /* mov rbx, rax */
+                emit_bytes(e, "\x48\x89\xc3", 3);
+                break;
+            }
+            /* mov rax, rbx; cqo; mov ecx, arg; idiv rcx */
+            emit_bytes(e, "\x48\x89\xd8\x48\x99", 5);
+            emit_byte(e, 0xb9);
+            emit_u32(e, op->arg);
+            emit_bytes(e, "\x48\xf7\xf9", 3);
+            if (op->code == NAZ_OP_REMAINDER) {
+                /* mov rbx, rdx */
+                emit_bytes(e, "\x48\x89\xd3", 3);
+                break;
+            }
+            /* Round towards negative infinity: test rdx, rdx; jns +3; dec rax; mov rbx, rax */
+            emit_bytes(e, "\x48\x85\xd2\x79\x03\x48\xff\xc8", 8);
+            emit_bytes(e, "\x48\x89\xc3", 3);
+            break;
+        case NAZ_OP_LOAD:
+            /* mov rbx, [r12 + variables + 8 * arg] */
+            emit_r12_mem(e, 0x48, 0x8b, 3, offsetof(struct naz_jit, variables) + 8 * op->arg);
+            break;
+        case NAZ_OP_STORE:
+            emit_r12_mem(e, 0x48, 0x89, 3, offsetof(struct naz_jit, variables) + 8 * op->arg);
+            break;
+        case NAZ_OP_NEGATE:
+            /* mov rax, [var]; neg rax; check; mov [var], rax */
+            emit_r12_mem(e, 0x48, 0x8b, 0, offsetof(struct naz_jit, variables) + 8 * op->arg);
+            emit_bytes(e, "\x48\xf7\xd8", 3);
+            emit_range_check(e);
+            emit_r12_mem(e, 0x48, 0x89, 0, offsetof(struct naz_jit, variables) + 8 * op->arg);
+            break;
+        case NAZ_OP_READ:
+            emit_plain_call(e, read_by_offset, op->arg);
+            /* movsxd rbx, eax, it returns an int */
+            emit_bytes(e, "\x48\x63\xd8", 3);
+            break;
+        case NAZ_OP_OUTPUT:
+            if (op->arg > 0) {
+                emit_helper_call(e, jit_helper_output, (long long) op->arg, 0, 0, 0);
+            }
+            break;
+        case NAZ_OP_DEFINE:
+            emit_helper_call(e, jit_helper_define, (long long) op->arg, (unsigned long long) (block->code + op->offset + 4), 0, 0);
+            break;
+        case NAZ_OP_CALL:
+            emit_call(e, prog, self, op->arg, op->tail, op->next);
+            break;
+        case NAZ_OP_BRANCH:
+            /* cmp rbx, [var] */
+            emit_r12_mem(e, 0x48, 0x3b, 3, offsetof(struct naz_jit, variables) + 8 * op->arg);
+            skip = emit_jcc_forward(e, op->cond == 'e' ? JCC_JNE : op->cond == 'l' ? JCC_JGE : JCC_JLE);
+            /* On the toplevel a jump is a call, inside of functions it replaces the current one */
+            emit_call(e, prog, self, op->target, self >= 0, op->next);
+            patch_rel32(e, skip, e->len);
+            break;
+        case NAZ_OP_DIE:
+            emit_helper_call(e, jit_helper_die, (unsigned long long) op->msg, op->pushed, self, op->offset);
+            break;
+    }
+}
+
+static void emit_block(struct emitter* e, struct naz_program* prog, struct naz_block* block, int self, size_t labels[]) {
+    labels[self < 0 ? LABEL_TOPLEVEL : LABEL_FUNCTION + self] = e->len;
+    emit_prologue(e);
+    if (self >= 0) {
+        /* cmp byte [r12 + defined + self], 0; je die_undefined */
+        emit_r12_mem(e, 0x40, 0x80, 7, offsetof(struct naz_jit, defined) + self);
+        emit_byte(e, 0x00);
+        emit_jcc_label(e, JCC_JE, LABEL_DIE_UNDEFINED);
+    }
+    for (int i = 0; i < block->len; ++i) {
+        emit_op(e, prog, block, self, &block->ops[i]);
+    }
+    emit_epilogue(e);
+    /* ret */
+    emit_byte(e, 0xc3);
+}
+
+static void emit_die_stub(struct emitter* e, int label, size_t labels[], const char* msg) {
+    labels[label] = e->len;
+    emit_helper_call(e, jit_helper_die, (unsigned long long) msg, 0, 0, 0);
+}
+
+static void emit_trampoline(struct emitter* e) {
+    /* push rbp, rbx, r12, r13, r14, r15 */
+    emit_bytes(e, "\x55\x53\x41\x54\x41\x55\x41\x56\x41\x57", 10);
+    /* mov r12, rdi; mov rbp, rsp; mov rsp, rsi */
+    emit_bytes(e, "\x49\x89\xfc\x48\x89\xe5\x48\x89\xf4", 9);
+    /* mov [r12 + native_stack], rbp */
+    emit_r12_mem(e, 0x48, 0x89, 5, offsetof(struct naz_jit, native_stack));
+    emit_r12_mem(e, 0x48, 0x8b, 3, offsetof(struct naz_jit, accumulator));
+    emit_r12_mem(e, 0x4c, 0x8b, 5, offsetof(struct naz_jit, shadow));
+    emit_call_label(e, LABEL_TOPLEVEL);
+    /* mov rsp, rbp */
+    emit_bytes(e, "\x48\x89\xec", 3);
+    emit_save_state(e);
+    /* pop r15, r14, r13, r12, rbx, rbp; ret */
+    emit_bytes(e, "\x41\x5f\x41\x5e\x41\x5d\x41\x5c\x5b\x5d\xc3", 11);
+}
+
+/* leave(jit) */
+static void emit_leave(struct emitter* e) {
+    /* mov rsp, [rdi + native_stack] */
+    emit_bytes(e, "\x48\x8b\xa7", 3);
+    emit_u32(e, offsetof(struct naz_jit, native_stack));
+    /* pop r15, r14, r13, r12, rbx, rbp; ret */
+    emit_bytes(e, "\x41\x5f\x41\x5e\x41\x5d\x41\x5c\x5b\x5d\xc3", 11);
+}
+
+struct naz_jit* jit_compile(struct naz_program* prog) {
+    if (prog->dynamic) {
+        return NULL;
+    }
+    int saved_errno = errno;
+
+    struct emitter e = {0};
+    size_t labels[LABEL_COUNT];
+    emit_trampoline(&e);
+    size_t leave = e.len;
+    emit_leave(&e);
+    emit_die_stub(&e, LABEL_DIE_INVALID, labels, "invalid result");
+    emit_die_stub(&e, LABEL_DIE_UNDEFINED, labels, "Using an undefined function");
+    emit_die_stub(&e, LABEL_DIE_DEPTH, labels, "Calls nested too deep for -j, run without it");
+    labels[LABEL_UNDEFINED] = e.len;
+    emit_prologue(&e);
+    emit_jmp_label(&e, LABEL_DIE_UNDEFINED);
+
+    emit_block(&e, prog, &prog->toplevel, -1, labels);
+    for (int i = 0; i < 10; ++i) {
+        if (prog->functions[i].code) {
+            emit_block(&e, prog, &prog->functions[i], i, labels);
+        }
+    }
+    for (int i = 0; i < e.fixups_len; ++i) {
+        patch_rel32(&e, e.fixups[i].pos, labels[e.fixups[i].label]);
+    }
+    free(e.fixups);
+
+    struct naz_jit* out = calloc(1, sizeof(*out));
+    out->prog = prog;
+    out->code_size = e.len;
+    out->code = mmap(NULL, e.len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    out->stack = mmap(NULL, JIT_GUARD_SIZE + JIT_STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    out->shadow_base = mmap(NULL, JIT_SHADOW_SIZE + JIT_GUARD_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (out->code == MAP_FAILED || out->stack == MAP_FAILED || out->shadow_base == MAP_FAILED) {
+        out->code = (out->code == MAP_FAILED) ? NULL : out->code;
+        out->stack = (out->stack == MAP_FAILED) ? NULL : out->stack;
+        out->shadow_base = (out->shadow_base == MAP_FAILED) ? NULL : out->shadow_base;
+        jit_destroy(out);
+        free(e.buf);
+        errno = saved_errno;
+        return NULL;
+    }
+    memcpy(out->code, e.buf, e.len);
+    free(e.buf);
+    /* The machine stack grows down towards its guard, the shadow callstack up */
+    out->shadow_limit = out->shadow_base + JIT_MAX_DEPTH;
+    if (mprotect(out->code, e.len, PROT_READ | PROT_EXEC) == -1
+            || mprotect(out->stack, JIT_GUARD_SIZE, PROT_NONE) == -1
+            || mprotect(out->shadow_limit, JIT_GUARD_SIZE, PROT_NONE) == -1) {
+        jit_destroy(out);
+        errno = saved_errno;
+        return NULL;
+    }
+    out->entry = (void (*)(struct naz_jit*, void*)) out->code;
+    out->leave = (void (*)(struct naz_jit*)) (out->code + leave);
+
+    jit_reset(out);
+    errno = saved_errno;
+    return out;
+}
+
+void jit_run(struct naz_jit* jit) {
+    jit->entry(jit, jit->stack + JIT_GUARD_SIZE + JIT_STACK_SIZE);
+    jit->native_stack = NULL;
+}
+
+void jit_leave(struct naz_jit* jit) {
+    if (jit->native_stack) {
+        jit->leave(jit);
+    }
+}
+
+void jit_reset(struct naz_jit* jit) {
+    for (int i = 0; i < 10; ++i) {
+        jit->variables[i] = -128;
+        jit->defined[i] = 0;
+    }
+    jit->accumulator = 0;
+    jit->shadow = jit->shadow_base;
+    jit->pushed = 0;
+}
+
+void jit_sync(struct naz_jit* jit, struct callstack* cs) {
+    for (int i = 0; i < 10; ++i) {
+        variable_set(i, number_from(jit->variables[i]));
+    }
+    accumulator_set(number_from(jit->accumulator));
+    for (unsigned long long* cur = jit->shadow_base; cur < jit->shadow; ++cur) {
+        callstack_push(cs, instruction_pointer_from_function((int)(*cur >> 32), (int)(*cur & 0xffffffff)));
+    }
+    jit->shadow = jit->shadow_base;
+    if (jit->pushed) {
+        callstack_push(cs, instruction_pointer_from_function(jit->pushed_function, jit->pushed_offset));
+        jit->pushed = 0;
+    }
+}
+
+void jit_destroy(struct naz_jit* jit) {
+    if (jit->code)
+        munmap(jit->code, jit->code_size);
+    if (jit->stack)
+        munmap(jit->stack, JIT_GUARD_SIZE + JIT_STACK_SIZE);
+    if (jit->shadow_base)
+        munmap(jit->shadow_base, JIT_SHADOW_SIZE + JIT_GUARD_SIZE);
+    free(jit);
+}
+
+#else
+
+/* No code generator for this architecture, the caller interprets instead */
+struct naz_jit* jit_compile(struct naz_program* prog) {
+    return NULL;
+}
+
+void jit_run(struct naz_jit* jit) {
+}
+
+void jit_leave(struct naz_jit* jit) {
+}
+
+void jit_reset(struct naz_jit* jit) {
+}
+
+void jit_sync(struct naz_jit* jit, struct callstack* cs) {
+}
+
+void jit_destroy(struct naz_jit* jit) {
+}
+
+#endif
@@ -29,8 +29,52 @@ struct instruction_pointer {
 };
 
 
-static int unlimited_numbers = 0;
-static int debug = 0;
+struct in_state {
+    int data[10];
+    int start;
+    int end;
+    int size;
+};
+
+/* Everything a running program changes, so that every thread can work on its own */
+struct naz_state {
+    int unlimited_numbers;
+    int debug;
+    /* NULL means stdout */
+    FILE* output;
+    /* NULL means read(2) on stdin */
+    naz_read_fn input;
+    void* input_user;
+    struct number* variables[10];
+    struct number* accumulator;
+    unsigned long variable_writes[10];
+    char* functions[10];
+    struct in_state io;
+    /* Bytes taken from the input stream, where a restored checkpoint continues reading */
+    unsigned long long input_read;
+    /* Taken from the input stream but not yet by the program, which only then counts them as read.
+     * One more for the 0 after them that input_copy() stops at.
+     */
+    char ahead[4096 + 1];
+    size_t ahead_start;
+    size_t ahead_len;
+    int input_ended;
+    unsigned long long output_written;
+    /* Limbs of all -u numbers alive, the most there were, and how many there may be, 0 for no limit */
+    size_t limbs;
+    size_t limbs_peak;
+    size_t limbs_limit;
+};
+
+static const struct in_state io_initial = {.start = 0, .end = 0, .size = 0, .data[5] = 1};
+
+/* Used by every thread that did not pick a state of its own */
+static struct naz_state default_state = {.io = {.start = 0, .end = 0, .size = 0, .data[5] = 1}};
+static __thread struct naz_state* state = &default_state;
+
+static FILE* output_stream() {
+    return state->output ? state->output : stdout;
+}
 
 struct instruction_pointer* instruction_pointer_from_function(int function, int offset) {
     struct instruction_pointer *out = malloc(sizeof(*out));
@@ -48,6 +92,14 @@ struct instruction_pointer* instruction_pointer_with_offset(struct instruction_p
     return instruction_pointer_from_function(arg->function, offset);
 }
 
+struct instruction_pointer* instruction_pointer_marker() {
+    return instruction_pointer_from_function(-2, 0);
+}
+
+int instruction_pointer_is_marker(struct instruction_pointer *arg) {
+    return arg->function == -2;
+}
+
 int instruction_pointer_is_in_function(struct instruction_pointer *arg) {
     return arg->function > -1;
 }
@@ -67,23 +119,28 @@ void instruction_pointer_delete(struct instruction_pointer *arg) {
 
 struct callstack {
     struct instruction_pointer *top;
+    int depth;
 };
 
 struct callstack* callstack_new_empty() {
     struct callstack *out = malloc(sizeof(*out));
     out->top = NULL;
+    out->depth = 0;
     return out;
 }
 
 void callstack_push(struct callstack *cs, struct instruction_pointer *ip) {
     ip->next = cs->top;
     cs->top = ip;
+    cs->depth++;
 }
 
 struct instruction_pointer* callstack_pop(struct callstack *cs) {
     struct instruction_pointer *out = cs->top;
-    if (out)
+    if (out) {
         cs->top = out->next;
+        cs->depth--;
+    }
     return out;
 }
 
@@ -96,29 +153,53 @@ void callstack_iterate(struct callstack *cs, void(*callback)(struct instruction_
     }
 }
 
+int callstack_depth(struct callstack *cs) {
+    return cs->depth;
+}
+
+int callstack_top(struct callstack *cs, struct instruction_pointer **out, int n) {
+    int i = 0;
+    for (struct instruction_pointer* cur = cs->top; cur && i < n; cur = cur->next) {
+        out[i++] = cur;
+    }
+    return i;
+}
+
+struct callstack* callstack_copy(struct callstack *cs) {
+    struct callstack *out = callstack_new_empty();
+    struct instruction_pointer **tail = &out->top;
+    for (struct instruction_pointer* cur = cs->top; cur; cur = cur->next) {
+        *tail = instruction_pointer_with_offset(cur, cur->offset);
+        tail = &(*tail)->next;
+    }
+    out->depth = cs->depth;
+    return out;
+}
+
 void callstack_destroy(struct callstack *cs) {
     callstack_iterate(cs, instruction_pointer_delete);
     free(cs);
 }
 
-struct lnumber {
-    long long val;
-};
-struct unumber {
-    size_t len;
-    size_t cap;
-    unsigned int* data;
-    int negative;
-};
+/* Where undefined -u numbers point, so that every number has a limb to read */
+static unsigned int undefined_limb[1];
 
-struct number {
-    union {
-        struct lnumber* lptr;
-        struct unumber* uptr;
-    };
-};
 static void unumber_destroy(struct unumber* in);
 
+const char naz_memory_budget_message[] = "Memory budget exceeded";
+
+/* Called before limbs get allocated and after they got freed */
+static void limbs_count(long long change) {
+    state->limbs += change;
+    if (change > 0 && state->limbs_limit && state->limbs > state->limbs_limit) {
+        state->limbs -= change;
+        die(naz_memory_budget_message);
+    }
+    if (state->limbs > state->limbs_peak) {
+        state->limbs_peak = state->limbs;
+    }
+}
+
 static struct lnumber* lnumber_from(int i) {
     struct lnumber* out = malloc(sizeof(*out));
     out->val = i;
@@ -126,6 +207,7 @@ static struct lnumber* lnumber_from(int i) {
 }
 
 static struct unumber* unumber_from(int i) {
+    limbs_count(2);
     struct unumber* out = malloc(sizeof(*out));
     out->cap = 2;/* We need at least 2 so that *1.5 actually increases stuff */
     out->data = malloc(sizeof(int) * out->cap);
@@ -143,7 +225,7 @@ static struct unumber* unumber_from(int i) {
 
 struct number* number_from(int i) {
     struct number* out = malloc(sizeof(*out));
-    if (unlimited_numbers) {
+    if (state->unlimited_numbers) {
         out->uptr = unumber_from(i);
     } else {
         out->lptr = lnumber_from(i);
@@ -151,19 +233,34 @@ struct number* number_from(int i) {
     return out;
 }
 
+struct number* number_from_limbs(const unsigned* limbs, size_t len, int negative) {
+    if (!state->unlimited_numbers || len == 0) {
+        die("number_from_limbs needs -u and at least one limb");
+    }
+    struct number* out = malloc(sizeof(*out));
+    out->uptr = malloc(sizeof(*out->uptr));
+    out->uptr->len = len;
+    out->uptr->cap = len < 2 ? 2 : len; /* As in unumber_from() */
+    limbs_count(out->uptr->cap);
+    out->uptr->data = malloc(sizeof(int) * out->uptr->cap);
+    out->uptr->negative = negative;
+    memcpy(out->uptr->data, limbs, sizeof(int) * len);
+    return out;
+}
+
 
 static void unumber_check (struct unumber* check) {
-    if (check->data == NULL) {
+    if (check->data == undefined_limb) {
         die("using an undef number");
     }
 }
 
 struct number* number_invalid() {
-    if (unlimited_numbers) {
+    if (state->unlimited_numbers) {
         struct number* n_out = malloc(sizeof(*n_out));
         struct unumber* u_out = malloc(sizeof(*u_out));
         n_out->uptr = u_out;
-        u_out->data = NULL;
+        u_out->data = undefined_limb;
         u_out->len = 0;
         u_out->cap = 0;
         u_out->negative = 0;
@@ -179,10 +276,12 @@ static struct lnumber* lnumber_copy(struct lnumber* in) {
 }
 
 static struct unumber* unumber_copy(struct unumber* in) {
+    limbs_count(in->len);
     struct unumber* out = malloc(sizeof(*out));
     out->len = in->len;
     out->cap = in->len;
-    out->data = malloc(sizeof(int) * out->cap);
+    /* Copies of undefined numbers still get a limb to read */
+    out->data = malloc(sizeof(int) * (in->len ? in->len : 1));
     out->negative = in->negative;
     memcpy(out->data, in->data, in->len * sizeof(int));
     return out;
@@ -190,7 +289,7 @@ static struct unumber* unumber_copy(struct unumber* in) {
 
 struct number* number_copy(struct number* in) {
     struct number* out = malloc(sizeof(*out));
-    if (unlimited_numbers) {
+    if (state->unlimited_numbers) {
         out->uptr = unumber_copy(in->uptr);
     } else {
         out->lptr = lnumber_copy(in->lptr);
@@ -215,12 +314,15 @@ static size_t unumber_new_size(struct unumber* in) {
 }
 
 static void unumber_enlarge(struct unumber* in, size_t new_size) {
+    limbs_count((long long) new_size - (long long) in->cap);
     unsigned int* old_data = in->data;
     in->data = malloc(sizeof(unsigned int) * new_size);
     size_t min_size = (in->cap < new_size)? in->cap : new_size;
     in->cap = new_size;
     memcpy(in->data, old_data, min_size * sizeof(unsigned int));
-    free(old_data);
+    if (old_data != undefined_limb) {
+        free(old_data);
+    }
 }
 
 static void unumber_fit_len(struct unumber* in) {
@@ -297,7 +399,7 @@ static void unumber_add_sub(struct unumber* in, int i) {
 }
 
 void number_add(struct number* in, int i) {
-    if (unlimited_numbers) {
+    if (state->unlimited_numbers) {
         unumber_add_sub(in->uptr, i);
     } else {
         lnumber_add(in->lptr, i);
@@ -330,7 +432,7 @@ static struct unumber* unumber_multiply(struct unumber* in, int i) {
         unsigned low_end = full_mul & 0xffffffff;
         old_overflow = full_mul >> 32;
         unumber_add(out, low_end, offset);
-        if (debug) {
+        if (state->debug) {
             printf("This is in debug mode\n");
         }
     }
@@ -342,7 +444,7 @@ static struct unumber* unumber_multiply(struct unumber* in, int i) {
 }
 
 void number_multiply(struct number* in, int i) {
-    if (unlimited_numbers) {
+    if (state->unlimited_numbers) {
         struct unumber* res = unumber_multiply(in->uptr, i);
         unumber_destroy(in->uptr);
         in->uptr = res;
@@ -431,7 +533,7 @@ static void unumber_divide(struct number* in, int i) {
 }
 
 void number_divide(struct number* in, int i) {
-    if (unlimited_numbers) {
+    if (state->unlimited_numbers) {
         unumber_divide(in, i);
     } else {
         lnumber_divide(in->lptr, i);
@@ -453,7 +555,7 @@ static void unumber_remainder(struct unumber* in, int i) {
 }
 
 void number_remainder(struct number* in, int i) {
-    if (unlimited_numbers) {
+    if (state->unlimited_numbers) {
         unumber_remainder(in->uptr, i);
     } else {
         lnumber_remainder(in->lptr, i);
@@ -465,12 +567,15 @@ static void lnumber_destroy(struct lnumber* in) {
 }
 
 static void unumber_destroy(struct unumber* in) {
-    free(in->data);
+    limbs_count(-(long long) in->cap);
+    if (in->data != undefined_limb) {
+        free(in->data);
+    }
     free(in);
 }
 
 void number_destroy(struct number* in) {
-    if (unlimited_numbers) {
+    if (state->unlimited_numbers) {
         unumber_destroy(in->uptr);
     } else {
         lnumber_destroy(in->lptr);
@@ -485,32 +590,35 @@ static void unumber_print(struct unumber* in) {
             die("Printing negative numbers is not implemented"); /* TODO */
         }
         if (in->data[0] < 10) {
-            printf("%u", in->data[0]);
+            state->output_written += fprintf(output_stream(), "%u", in->data[0]);
             return;
         }
         if (in->data[0] != 10 && in->data[0] < 32) {
             return;
         }
     }
-    if(printf("%lc", in->data[0] & 0xffff) < 0) {
+    int written = fprintf(output_stream(), "%lc", in->data[0] & 0xffff);
+    if(written < 0) {
         perror("Foo");
+    } else {
+        state->output_written += written;
     }
 }
 
 static void lnumber_print(struct lnumber* in) {
     if (in->val >= 0 && in-> val < 10) {
-        printf("%lld", in->val);
+        state->output_written += fprintf(output_stream(), "%lld", in->val);
         return;
     }
     if (in->val == 10 || (in->val >= 32 && in->val <= 126)) {
-        printf("%c", (char)in->val);
+        state->output_written += fprintf(output_stream(), "%c", (char)in->val);
         return;
     }
     die("trying to print unknown number");
 }
 
 void number_print(struct number* in) {
-    if(unlimited_numbers) {
+    if(state->unlimited_numbers) {
         unumber_print(in->uptr);
     } else {
         lnumber_print(in->lptr);
@@ -532,7 +640,7 @@ static void unumber_print_dbg(struct unumber* in) {
 }
 
 void number_print_dbg(struct number* in) {
-    if (unlimited_numbers) {
+    if (state->unlimited_numbers) {
         unumber_print_dbg(in->uptr);
     } else {
         lnumber_print_dbg(in->lptr);
@@ -594,52 +702,291 @@ static int unumber_compare(struct unumber* lhs, struct unumber* rhs) {
 }
 
 int number_compare(struct number* lhs, struct number* rhs) {
-    if (unlimited_numbers) {
+    if (state->unlimited_numbers) {
         return unumber_compare(lhs->uptr, rhs->uptr);
     } else {
         return lnumber_compare(lhs->lptr, rhs->lptr);
     }
 }
 
+/* Length without leading zeros, unlike unumber_fit_len() without touching the number */
+static size_t unumber_trimmed_len(struct unumber* in) {
+    size_t len = in->len;
+    while (len > 1 && in->data[len - 1] == 0) len--;
+    return len;
+}
 
+static int unumber_magnitude_compare(unsigned* lhs, size_t lhs_len, unsigned* rhs, size_t rhs_len) {
+    if (lhs_len != rhs_len) {
+        return lhs_len < rhs_len ? -1 : 1;
+    }
+    for (size_t i = lhs_len; i > 0; --i) {
+        if (lhs[i - 1] != rhs[i - 1]) {
+            return lhs[i - 1] < rhs[i - 1] ? -1 : 1;
+        }
+    }
+    return 0;
+}
 
-/* VARIABLES */
+static struct unumber* unumber_difference(struct unumber* lhs, struct unumber* rhs) {
+    unumber_check(lhs);
+    unumber_check(rhs);
+    size_t lhs_len = unumber_trimmed_len(lhs);
+    size_t rhs_len = unumber_trimmed_len(rhs);
+    int rhs_negative = !rhs->negative;
 
-static struct number* variables[10];
-static struct number* accumucator;
+    limbs_count((lhs_len > rhs_len ? lhs_len : rhs_len) + 1);
+    struct unumber* out = malloc(sizeof(*out));
+    out->cap = (lhs_len > rhs_len ? lhs_len : rhs_len) + 1;
+    out->data = calloc(out->cap, sizeof(int));
+    out->len = out->cap;
+    if (lhs->negative == rhs_negative) {
+        /* Same sign, add the magnitudes */
+        unsigned long long carry = 0;
+        for (size_t i = 0; i < out->cap; ++i) {
+            carry += (i < lhs_len ? lhs->data[i] : 0ULL) + (i < rhs_len ? rhs->data[i] : 0ULL);
+            out->data[i] = carry & 0xffffffff;
+            carry >>= 32;
+        }
+        out->negative = lhs->negative;
+    } else {
+        /* Subtract the smaller magnitude from the larger one, which decides the sign */
+        unsigned* big = lhs->data;
+        size_t big_len = lhs_len;
+        unsigned* small = rhs->data;
+        size_t small_len = rhs_len;
+        out->negative = lhs->negative;
+        if (unumber_magnitude_compare(lhs->data, lhs_len, rhs->data, rhs_len) < 0) {
+            big = rhs->data;
+            big_len = rhs_len;
+            small = lhs->data;
+            small_len = lhs_len;
+            out->negative = rhs_negative;
+        }
+        long long borrow = 0;
+        for (size_t i = 0; i < big_len; ++i) {
+            long long temp = (long long) big[i] - (i < small_len ? small[i] : 0) - borrow;
+            borrow = temp < 0;
+            out->data[i] = temp + (borrow << 32);
+        }
+    }
+    unumber_fit_len(out);
+    if (out->len == 1 && out->data[0] == 0) {
+        out->negative = 0;
+    }
+    return out;
+}
+
+struct number* number_difference(struct number* lhs, struct number* rhs) {
+    struct number* out = malloc(sizeof(*out));
+    if (state->unlimited_numbers) {
+        out->uptr = unumber_difference(lhs->uptr, rhs->uptr);
+    } else {
+        out->lptr = lnumber_from(0);
+        out->lptr->val = lhs->lptr->val - rhs->lptr->val;
+    }
+    return out;
+}
+
+int number_to_int(struct number* in, int* out) {
+    long long val;
+    if (state->unlimited_numbers) {
+        struct unumber* u = in->uptr;
+        if (u->data == undefined_limb || u->len == 0 || unumber_trimmed_len(u) != 1) {
+            return 0;
+        }
+        val = u->negative ? -(long long) u->data[0] : (long long) u->data[0];
+    } else {
+        val = in->lptr->val;
+    }
+    if (val < INT_MIN || val > INT_MAX) {
+        return 0;
+    }
+    *out = val;
+    return 1;
+}
+
+int number_is_trimmed(struct number* in) {
+    if (state->unlimited_numbers) {
+        struct unumber* u = in->uptr;
+        return u->len > 0 && u->len == unumber_trimmed_len(u);
+    }
+    return 1;
+}
+
+static int unumber_identical(struct unumber* lhs, struct unumber* rhs) {
+    return lhs->negative == rhs->negative && lhs->len == rhs->len
+        && memcmp(lhs->data, rhs->data, lhs->len * sizeof(int)) == 0;
+}
+
+int number_identical(struct number* lhs, struct number* rhs) {
+    if (state->unlimited_numbers) {
+        return unumber_identical(lhs->uptr, rhs->uptr);
+    } else {
+        return lhs->lptr->val == rhs->lptr->val;
+    }
+}
+
+/* FNV-1a */
+static unsigned long hash_bytes(unsigned long hash, const void* data, size_t len) {
+    const unsigned char* bytes = data;
+    for (size_t i = 0; i < len; ++i) {
+        hash = (hash ^ bytes[i]) * 1099511628211UL;
+    }
+    return hash;
+}
+
+unsigned long number_hash(struct number* in) {
+    unsigned long hash = 14695981039346656037UL;
+    if (state->unlimited_numbers) {
+        hash = hash_bytes(hash, &in->uptr->negative, sizeof(in->uptr->negative));
+        hash = hash_bytes(hash, &in->uptr->len, sizeof(in->uptr->len));
+        return hash_bytes(hash, in->uptr->data, in->uptr->len * sizeof(int));
+    }
+    return hash_bytes(hash, &in->lptr->val, sizeof(in->lptr->val));
+}
+
+size_t number_size(struct number* in) {
+    if (state->unlimited_numbers) {
+        return sizeof(*in) + sizeof(*in->uptr) + in->uptr->cap * sizeof(int);
+    }
+    return sizeof(*in) + sizeof(*in->lptr);
+}
+
+
+
+/* VARIABLES */
 
 struct number* variable_get(int number) {
-    return number_copy(variables[number]);
+    return number_copy(state->variables[number]);
 }
 
 struct number* accumulator_get() {
-    return number_copy(accumucator);
+    return number_copy(state->accumulator);
+}
+
+long long variable_value(int number) {
+    return state->variables[number]->lptr->val;
+}
+
+long long accumulator_value() {
+    return state->accumulator->lptr->val;
+}
+
+size_t accumulator_limbs() {
+    return state->unlimited_numbers ? state->accumulator->uptr->len : 1;
+}
+
+struct number* const* accumulator_slot() {
+    return &state->accumulator;
+}
+
+int accumulator_fingerprint() {
+    return number_fingerprint(state->accumulator, state->unlimited_numbers);
+}
+
+size_t variable_limbs(int number) {
+    return state->unlimited_numbers ? state->variables[number]->uptr->len : 1;
 }
 
 void variable_set(int number, struct number* val) {
-    number_destroy(variables[number]);
-    variables[number] = val;
+    number_destroy(state->variables[number]);
+    state->variables[number] = val;
+    state->variable_writes[number]++;
+}
+
+unsigned long variable_changes(int number) {
+    return state->variable_writes[number];
 }
 
 void accumulator_set(struct number *val) {
-    number_destroy(accumucator);
-    accumucator = val;
+    number_destroy(state->accumulator);
+    state->accumulator = val;
+}
+
+void accumulator_set_value(long long val) {
+    state->accumulator->lptr->val = val;
+}
+
+void variable_set_value(int number, long long val) {
+    state->variables[number]->lptr->val = val;
+    state->variable_writes[number]++;
+}
+
+void accumulator_print() {
+    number_print(state->accumulator);
+}
+
+void accumulator_add(int i) {
+    unumber_add_sub(state->accumulator->uptr, i);
+}
+
+void accumulator_multiply(int i) {
+    struct unumber* res = unumber_multiply(state->accumulator->uptr, i);
+    unumber_destroy(state->accumulator->uptr);
+    state->accumulator->uptr = res;
+}
+
+void accumulator_divide(int i) {
+    unumber_divide(state->accumulator, i);
+}
+
+void accumulator_remainder(int i) {
+    unumber_remainder(state->accumulator->uptr, i);
+}
+
+/* Copies the value over, reusing the memory of the destination */
+static void unumber_assign(struct unumber* dst, struct unumber* src) {
+    if (dst->data == undefined_limb || dst->cap < src->len) {
+        limbs_count((long long) src->len - (long long) dst->cap);
+        if (dst->data != undefined_limb) {
+            free(dst->data);
+        }
+        dst->cap = src->len ? src->len : 1;
+        dst->data = malloc(sizeof(int) * dst->cap);
+    }
+    memcpy(dst->data, src->data, src->len * sizeof(int));
+    dst->len = src->len;
+    dst->negative = src->negative;
+}
+
+void accumulator_load(int number) {
+    unumber_assign(state->accumulator->uptr, state->variables[number]->uptr);
+}
+
+void variable_store(int number) {
+    unumber_assign(state->variables[number]->uptr, state->accumulator->uptr);
+    state->variable_writes[number]++;
+}
+
+void variable_negate(int number) {
+    struct unumber* res = unumber_multiply(state->variables[number]->uptr, -1);
+    unumber_destroy(state->variables[number]->uptr);
+    state->variables[number]->uptr = res;
+    state->variable_writes[number]++;
+}
+
+int accumulator_compare(int number) {
+    /* unumber_compare() trims its arguments, which must not happen to the originals */
+    struct unumber lhs = *state->accumulator->uptr;
+    struct unumber rhs = *state->variables[number]->uptr;
+    return unumber_compare(&lhs, &rhs);
 }
 
 void variable_init() {
-    for(int i=0; i < sizeof(variables) / sizeof(variables[0]); ++i)
+    for(int i=0; i < 10; ++i)
     {
-        variables[i] = number_invalid();
+        state->variables[i] = number_invalid();
     }
-    accumucator = number_from(0);
+    state->accumulator = number_from(0);
 }
 
 void variable_cleanup() {
-    for(int i=0; i < sizeof(variables) / sizeof(variables[0]); ++i)
+    for(int i=0; i < 10; ++i)
     {
-        number_destroy(variables[i]);
+        number_destroy(state->variables[i]);
     }
-    number_destroy(accumucator);
+    number_destroy(state->accumulator);
 }
 
 
@@ -648,17 +995,10 @@ void variable_cleanup() {
 #include <stdio.h>
 #include <string.h>
 
-static char* functions[10] = {0};
-
 const char* function_get(int number) {
-    return functions[number];
+    return state->functions[number];
 }
-/* Does NOT take ownership of the string */
-void function_set(int number, const char* string) {
-    if (functions[number]) {
-        fprintf(stderr, "Redefining function %d, aborting\n", number);
-        exit(EXIT_FAILURE);
-    }
+char* function_body(const char* string) {
     char* temp_str = strdup(string);
     for (char* c = temp_str ; *c != '\0'; ++c) {
         if (*c == '\n') {
@@ -674,37 +1014,371 @@ void function_set(int number, const char* string) {
             break;
         }
     }
-    functions[number] = strdup(temp_str);
+    char* out = strdup(temp_str);
     free(temp_str);
+    return out;
+}
+
+/* Does NOT take ownership of the string */
+int function_set(int number, const char* string) {
+    if (state->functions[number]) {
+        return -1;
+    }
+    state->functions[number] = function_body(string);
+    return 0;
 }
 
 void function_cleanup() {
-    for(int i=0; i < sizeof(functions) / sizeof(functions[0]); ++i){
-        free(functions[i]);
-        functions[i] = NULL;
+    for(int i=0; i < 10; ++i){
+        free(state->functions[i]);
+        state->functions[i] = NULL;
     }
 }
 
 void naz_set_unlimited(int in) {
-    unlimited_numbers = in;
+    state->unlimited_numbers = in;
 }
 
 void naz_set_debug(int in) {
-    debug = in;
+    state->debug = in;
+}
+
+void naz_set_output(FILE* out) {
+    state->output = out;
+}
+
+void output_write(const char* bytes, size_t len) {
+    state->output_written += fwrite(bytes, 1, len, output_stream());
+}
+
+void naz_set_input(naz_read_fn read, void* user) {
+    state->input = read;
+    state->input_user = user;
+    state->ahead_start = state->ahead_len = 0;
+    state->input_ended = 0;
+}
+
+void naz_set_memory_limit(size_t bytes) {
+    state->limbs_limit = bytes / sizeof(int);
+}
+
+size_t naz_memory_used() {
+    return state->limbs * sizeof(int);
+}
+
+size_t naz_memory_peak() {
+    return state->limbs_peak * sizeof(int);
+}
+
+unsigned long long naz_bytes_read() {
+    return state->input_read;
+}
+
+unsigned long long naz_bytes_written() {
+    return state->output_written;
+}
+
+
+/* STATES */
+
+struct naz_state* naz_state_new(int unlimited) {
+    struct naz_state* out = calloc(1, sizeof(*out));
+    out->unlimited_numbers = unlimited;
+    out->io = io_initial;
+    struct naz_state* prev = naz_state_use(out);
+    variable_init();
+    naz_state_use(prev);
+    return out;
+}
+
+struct naz_state* naz_state_use(struct naz_state* in) {
+    struct naz_state* prev = state;
+    state = in ? in : &default_state;
+    return prev;
+}
+
+void naz_state_reset(struct naz_state* in) {
+    struct naz_state* prev = naz_state_use(in);
+    variable_cleanup();
+    function_cleanup();
+    variable_init();
+    in->io = io_initial;
+    in->input_read = 0;
+    in->ahead_start = in->ahead_len = 0;
+    in->input_ended = 0;
+    in->output_written = 0;
+    in->limbs_peak = in->limbs;
+    naz_state_use(prev);
+}
+
+void naz_state_destroy(struct naz_state* in) {
+    struct naz_state* prev = naz_state_use(in);
+    variable_cleanup();
+    function_cleanup();
+    naz_state_use(prev == in ? NULL : prev);
+    free(in);
+}
+
+
+/* SNAPSHOTS */
+
+struct snapshot {
+    struct number* variables[10];
+    struct number* accumulator;
+    char* functions[10];
+    struct callstack* cs;
+    char* output;
+    size_t output_len;
+};
+
+struct snapshot* snapshot_take(struct callstack* cs, char* output, size_t output_len) {
+    struct snapshot* out = malloc(sizeof(*out));
+    for (int i = 0; i < 10; ++i) {
+        out->variables[i] = variable_get(i);
+        out->functions[i] = state->functions[i] ? strdup(state->functions[i]) : NULL;
+    }
+    out->accumulator = accumulator_get();
+    out->cs = callstack_copy(cs);
+    out->output = output;
+    out->output_len = output_len;
+    /* The output only counts as written once snapshot_restore() wrote it */
+    state->output_written -= output_len;
+    return out;
+}
+
+struct callstack* snapshot_restore(struct snapshot* snap) {
+    function_cleanup();
+    for (int i = 0; i < 10; ++i) {
+        variable_set(i, number_copy(snap->variables[i]));
+        if (snap->functions[i]) {
+            state->functions[i] = strdup(snap->functions[i]);
+        }
+    }
+    accumulator_set(number_copy(snap->accumulator));
+    state->output_written += fwrite(snap->output, 1, snap->output_len, output_stream());
+    return callstack_copy(snap->cs);
+}
+
+void snapshot_destroy(struct snapshot* snap) {
+    for (int i = 0; i < 10; ++i) {
+        number_destroy(snap->variables[i]);
+        free(snap->functions[i]);
+    }
+    number_destroy(snap->accumulator);
+    callstack_destroy(snap->cs);
+    free(snap->output);
+    free(snap);
+}
+
+
+/* CHECKPOINTS */
+
+#include <stdint.h>
+
+static const char checkpoint_magic[8] = "NAZCKPT1";
+
+static unsigned long checkpoint_program(const char* code) {
+    return hash_bytes(14695981039346656037UL, code, strlen(code));
+}
+
+/* Every put and get stops doing anything after the first failure */
+struct checkpoint_io {
+    FILE* f;
+    int failed;
+};
+
+static void checkpoint_put(struct checkpoint_io* io, const void* data, size_t len) {
+    if (!io->failed && len > 0 && fwrite(data, len, 1, io->f) != 1) {
+        io->failed = 1;
+    }
+}
+
+static void checkpoint_get(struct checkpoint_io* io, void* data, size_t len) {
+    if (io->failed || (len > 0 && fread(data, len, 1, io->f) != 1)) {
+        io->failed = 1;
+        memset(data, 0, len);
+    }
+}
+
+static void checkpoint_put_u64(struct checkpoint_io* io, uint64_t val) {
+    checkpoint_put(io, &val, sizeof(val));
+}
+
+static uint64_t checkpoint_get_u64(struct checkpoint_io* io) {
+    uint64_t val;
+    checkpoint_get(io, &val, sizeof(val));
+    return val;
+}
+
+/* The limbs go out as they are, an undefined -u number has no limbs and is not defined */
+static void checkpoint_put_number(struct checkpoint_io* io, struct number* in) {
+    if (!state->unlimited_numbers) {
+        checkpoint_put_u64(io, (uint64_t) in->lptr->val);
+        return;
+    }
+    checkpoint_put_u64(io, in->uptr->data != undefined_limb);
+    checkpoint_put_u64(io, in->uptr->negative);
+    checkpoint_put_u64(io, in->uptr->len);
+    checkpoint_put(io, in->uptr->data, in->uptr->len * sizeof(int));
+}
+
+static struct number* checkpoint_get_number(struct checkpoint_io* io) {
+    if (!state->unlimited_numbers) {
+        struct number* out = number_from(0);
+        out->lptr->val = (long long) checkpoint_get_u64(io);
+        return out;
+    }
+    int defined = checkpoint_get_u64(io);
+    int negative = checkpoint_get_u64(io);
+    uint64_t len = checkpoint_get_u64(io);
+    if (!defined || io->failed) {
+        return number_invalid();
+    }
+    struct number* out = number_from(0);
+    /* Cut short files must not turn into huge allocations */
+    if (len == 0 || len > SIZE_MAX / sizeof(int)) {
+        io->failed = 1;
+        return out;
+    }
+    limbs_count((long long) len - (long long) out->uptr->cap);
+    out->uptr->data = realloc(out->uptr->data, len * sizeof(int));
+    out->uptr->len = out->uptr->cap = len;
+    out->uptr->negative = negative;
+    checkpoint_get(io, out->uptr->data, len * sizeof(int));
+    return out;
+}
+
+static void checkpoint_put_ip(struct checkpoint_io* io, struct instruction_pointer* ip) {
+    checkpoint_put_u64(io, (uint64_t) (int64_t) ip->function);
+    checkpoint_put_u64(io, (uint64_t) (int64_t) ip->offset);
+}
+
+int checkpoint_write(FILE* out, struct callstack* cs, const char* code) {
+    struct checkpoint_io io = {out, 0};
+    checkpoint_put(&io, checkpoint_magic, sizeof(checkpoint_magic));
+    checkpoint_put_u64(&io, sizeof(int));
+    checkpoint_put_u64(&io, checkpoint_program(code));
+    checkpoint_put_u64(&io, state->unlimited_numbers);
+    checkpoint_put_u64(&io, state->input_read);
+    checkpoint_put(&io, &state->io, sizeof(state->io));
+    checkpoint_put_number(&io, state->accumulator);
+    for (int i = 0; i < 10; ++i) {
+        checkpoint_put_number(&io, state->variables[i]);
+        checkpoint_put_u64(&io, state->variable_writes[i]);
+    }
+    for (int i = 0; i < 10; ++i) {
+        uint64_t len = state->functions[i] ? strlen(state->functions[i]) + 1 : 0;
+        checkpoint_put_u64(&io, len);
+        checkpoint_put(&io, state->functions[i], len);
+    }
+    uint64_t depth = 0;
+    for (struct instruction_pointer* ip = cs->top; ip; ip = ip->next) {
+        depth++;
+    }
+    checkpoint_put_u64(&io, depth);
+    /* Top first */
+    for (struct instruction_pointer* ip = cs->top; ip; ip = ip->next) {
+        checkpoint_put_ip(&io, ip);
+    }
+    return io.failed ? -1 : 0;
+}
+
+struct callstack* checkpoint_read(FILE* in, const char* code, const char** error) {
+    struct checkpoint_io io = {in, 0};
+    char magic[sizeof(checkpoint_magic)];
+    checkpoint_get(&io, magic, sizeof(magic));
+    if (io.failed || memcmp(magic, checkpoint_magic, sizeof(magic)) != 0 || checkpoint_get_u64(&io) != sizeof(int)) {
+        *error = "not a checkpoint of this interpreter";
+        return NULL;
+    }
+    if (checkpoint_get_u64(&io) != checkpoint_program(code)) {
+        *error = "checkpoint of a different program";
+        return NULL;
+    }
+    if (checkpoint_get_u64(&io) != (uint64_t) state->unlimited_numbers) {
+        *error = state->unlimited_numbers ? "checkpoint without -u" : "checkpoint with -u";
+        return NULL;
+    }
+
+    /* Everything is read into a fresh state first, so a broken file changes nothing */
+    struct naz_state* restored = naz_state_new(state->unlimited_numbers);
+    struct naz_state* prev = naz_state_use(restored);
+    restored->input_read = checkpoint_get_u64(&io);
+    checkpoint_get(&io, &restored->io, sizeof(restored->io));
+    if (restored->io.size < 0 || restored->io.size > 10) {
+        io.failed = 1;
+    }
+    accumulator_set(checkpoint_get_number(&io));
+    for (int i = 0; i < 10; ++i) {
+        variable_set(i, checkpoint_get_number(&io));
+        restored->variable_writes[i] = checkpoint_get_u64(&io);
+    }
+    for (int i = 0; i < 10 && !io.failed; ++i) {
+        uint64_t len = checkpoint_get_u64(&io);
+        if (len > (1u << 30)) {
+            io.failed = 1;
+        } else if (len > 0) {
+            restored->functions[i] = malloc(len);
+            checkpoint_get(&io, restored->functions[i], len);
+            restored->functions[i][len - 1] = '\0';
+        }
+    }
+    uint64_t depth = checkpoint_get_u64(&io);
+    struct instruction_pointer** ips = NULL;
+    if (!io.failed && depth <= SIZE_MAX / sizeof(*ips)) {
+        ips = calloc(depth ? depth : 1, sizeof(*ips));
+    }
+    if (!ips) {
+        io.failed = 1;
+        depth = 0;
+    }
+    for (uint64_t i = 0; i < depth; ++i) {
+        int function = (int) (int64_t) checkpoint_get_u64(&io);
+        int offset = (int) (int64_t) checkpoint_get_u64(&io);
+        if (function < -2 || function > 9 || offset < 0) {
+            io.failed = 1;
+        }
+        ips[i] = instruction_pointer_from_function(function, offset);
+    }
+    struct callstack* out = callstack_new_empty();
+    for (uint64_t i = depth; i > 0; --i) {
+        callstack_push(out, ips[i - 1]);
+    }
+    free(ips);
+    naz_state_use(prev);
+    if (io.failed) {
+        *error = "broken checkpoint";
+        callstack_destroy(out);
+        naz_state_destroy(restored);
+        return NULL;
+    }
+
+    /* Swap the restored contents into the current state */
+    variable_cleanup();
+    function_cleanup();
+    for (int i = 0; i < 10; ++i) {
+        state->variables[i] = restored->variables[i];
+        state->variable_writes[i] = restored->variable_writes[i];
+        state->functions[i] = restored->functions[i];
+    }
+    state->accumulator = restored->accumulator;
+    state->limbs += restored->limbs;
+    state->io = restored->io;
+    state->input_read = restored->input_read;
+    free(restored);
+    return out;
+}
+
+unsigned long long checkpoint_input_read() {
+    return state->input_read;
 }
 
 
-struct in_state {
-    int data[10];
-    int start;
-    int end;
-    int size;
-} io = {.start = 0, .end = 0, .size = 0, .data[5] = 1};
 
 #define ARRAYSZ(X) (sizeof(X) / sizeof(X[0]))
 
 static void normalize_io_ptr(int* ptr) {
-    int sz = ARRAYSZ(io.data);
+    int sz = ARRAYSZ(state->io.data);
     while (*ptr >= sz) {
         *ptr -= sz;
     }
@@ -714,111 +1388,162 @@ static void normalize_io_ptr(int* ptr) {
 }
 
 static void push_in(int read) {
-    if (io.size > 9 || io.size < 0) {
+    if (state->io.size > 9 || state->io.size < 0) {
         die("Pushing IO with wrong sizes");
     }
-    io.data[io.end++] = read;
-    io.size++;
-    normalize_io_ptr(&io.end);
+    state->io.data[state->io.end++] = read;
+    state->io.size++;
+    normalize_io_ptr(&state->io.end);
 }
 
 static int pop_in() {
-    if (io.size < 1) {
+    if (state->io.size < 1) {
         die("Popping empty IO");
     }
-    io.size--;
-    int ret = io.data[io.start++];
-    normalize_io_ptr(&io.start);
+    state->io.size--;
+    int ret = state->io.data[state->io.start++];
+    normalize_io_ptr(&state->io.start);
     return ret;
 }
 
 static int in_get_and_remove(int position) {
-    int access = io.start + position;
+    int access = state->io.start + position;
     normalize_io_ptr(&access);
-    int ret = io.data[access];
-    if (position < 1.0 * io.size / 2) {
+    int ret = state->io.data[access];
+    if (position < 1.0 * state->io.size / 2) {
         // In the first half, i.e. easiest to move right
-        if (access >= io.start) {
-            for(;access > io.start;access--) {
-                io.data[access] = io.data[access - 1];
+        if (access >= state->io.start) {
+            for(;access > state->io.start;access--) {
+                state->io.data[access] = state->io.data[access - 1];
             }
             pop_in();
             return ret;
         } else {
             for (; access > 0; access--) {
-                io.data[access] = io.data[access - 1];
+                state->io.data[access] = state->io.data[access - 1];
             }
-            /* io.start can be the last item, but who cares */
-            io.data[0] = io.data[ARRAYSZ(io.data)-1];
-            for(access = ARRAYSZ(io.data)-1; access > io.start; access--) {
-                io.data[access] = io.data[access-1];
+            /* state->io.start can be the last item, but who cares */
+            state->io.data[0] = state->io.data[ARRAYSZ(state->io.data)-1];
+            for(access = ARRAYSZ(state->io.data)-1; access > state->io.start; access--) {
+                state->io.data[access] = state->io.data[access-1];
             }
-            io.start++;
-            normalize_io_ptr(&io.start);
-            io.size--;
+            state->io.start++;
+            normalize_io_ptr(&state->io.start);
+            state->io.size--;
             return ret;
         }
     } else {
         // In the second half, i.e. easiest to move left
-        if (access < io.end) {
-            for(;access < io.end - 1;access++) {
-                io.data[access] = io.data[access + 1];
+        if (access < state->io.end) {
+            for(;access < state->io.end - 1;access++) {
+                state->io.data[access] = state->io.data[access + 1];
             }
-            io.end--;
+            state->io.end--;
         } else {
 
-            for(;access < ARRAYSZ(io.data) - 1; access++) {
-                io.data[access] = io.data[access + 1];
+            for(;access < ARRAYSZ(state->io.data) - 1; access++) {
+                state->io.data[access] = state->io.data[access + 1];
             }
-            if (0 < io.end) {
-                io.data[ARRAYSZ(io.data) - 1] = io.data[0];
+            if (0 < state->io.end) {
+                state->io.data[ARRAYSZ(state->io.data) - 1] = state->io.data[0];
             }
-            for(access = 0; access < io.end - 1; access++) {
-                io.data[access] = io.data[access + 1];
+            for(access = 0; access < state->io.end - 1; access++) {
+                state->io.data[access] = state->io.data[access + 1];
             }
-            io.end--;
-            if (io.end < 0) {
-                io.end += ARRAYSZ(io.data);
+            state->io.end--;
+            if (state->io.end < 0) {
+                state->io.end += ARRAYSZ(state->io.data);
             }
         }
-        io.size--;
+        state->io.size--;
         return ret;
     }
 }
 
+#include <errno.h>
+#include <unistd.h>
+
+/* Refills the empty read ahead buffer with the bytes one read(2) or callback gets, which are only those
+ * already available, and returns how many. The end of the input stays the end, even on a terminal.
+ */
+static size_t input_fill() {
+    state->ahead_start = state->ahead_len = 0;
+    if (state->input_ended) {
+        return 0;
+    }
+    size_t len = sizeof(state->ahead) - 1;
+    if (state->input) {
+        len = state->input(state->input_user, state->ahead, len);
+    } else {
+        ssize_t got;
+        while ((got = read(STDIN_FILENO, state->ahead, len)) == -1 && errno == EINTR) {
+        }
+        len = got > 0 ? got : 0;
+    }
+    state->ahead_len = len;
+    state->ahead[len] = '\0';
+    state->input_ended = len == 0;
+    return len;
+}
+
+static int input_next() {
+    if (state->ahead_start == state->ahead_len && !input_fill()) {
+        return EOF;
+    }
+    state->input_read++;
+    return (unsigned char) state->ahead[state->ahead_start++];
+}
+
 int read_by_offset(int position) {
     if (position < 1) {
         die("0r is not a valid command");
     }
-    if (position <= io.size) {
+    if (position <= state->io.size) {
         // We already did read this byte from stdin
         // We just have to report it correctly
         return in_get_and_remove(position - 1);
     }
-    position -= io.size;
+    position -= state->io.size;
     for(;position > 1; position--) {
-        push_in(getchar());
+        push_in(input_next());
     }
     if (position != 1)
       die("R for anything else than 1st should not reach here");
-    int res = getchar();
+    int res = input_next();
     return res;
 }
 
+size_t input_copy(const char* stop, int* last) {
+    if (state->io.size || (state->ahead_start == state->ahead_len && !input_fill())) {
+        return 0;
+    }
+    /* Always ends at the 0 after the buffered bytes, if not before */
+    const char* from = state->ahead + state->ahead_start;
+    size_t run = strcspn(from, stop);
+    if (run) {
+        fwrite(from, 1, run, output_stream());
+        *last = (unsigned char) from[run - 1];
+        state->ahead_start += run;
+        state->input_read += run;
+        state->output_written += run;
+    }
+    return run;
+}
+
 void debug_io_state() {
     const char* sep = "{";
 
     for(int i=0; i < 10; ++i) {
-        printf("%s.data[%d] = %d", sep, i, io.data[i]);
+        printf("%s.data[%d] = %d", sep, i, state->io.data[i]);
         sep = ", ";
     }
-    printf(", .start = %d, .end = %d, .size = %d \n", io.start, io.end, io.size);
+    printf(", .start = %d, .end = %d, .size = %d \n", state->io.start, state->io.end, state->io.size);
     printf("Interpreted: \n");
     sep = "";
-    for(int i=0; i < io.size; ++i) {
-        int acc = io.start + i;
+    for(int i=0; i < state->io.size; ++i) {
+        int acc = state->io.start + i;
         normalize_io_ptr(&acc);
-        printf("%s[%d] = %d", sep, i, io.data[acc]);
+        printf("%s[%d] = %d", sep, i, state->io.data[acc]);
         sep = ", ";
     }
     printf("\n");
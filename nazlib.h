@@ -16,6 +16,8 @@
 
 */
 
+#include <stdio.h>
+#include <stdint.h>
 
 /** INSTRUCTION POINTER */
 struct instruction_pointer;
@@ -26,6 +28,9 @@ struct instruction_pointer* instruction_pointer_with_offset(struct instruction_p
 int instruction_pointer_is_in_function(struct instruction_pointer*);
 int instruction_pointer_function_number(struct instruction_pointer*);
 int instruction_pointer_offset(struct instruction_pointer*);
+/* Markers are not executed, they only tell whoever pushed them that a call returned */
+struct instruction_pointer* instruction_pointer_marker();
+int instruction_pointer_is_marker(struct instruction_pointer*);
 
 void instruction_pointer_delete(struct instruction_pointer*);
 
@@ -40,14 +45,38 @@ struct instruction_pointer* callstack_pop(struct callstack*);
 /* Takes ownership of struct instruction_pointer */
 void callstack_push(struct callstack*, struct instruction_pointer*);
 void callstack_iterate(struct callstack*, void(*callback)(struct instruction_pointer*));
+struct callstack* callstack_copy(struct callstack*);
+int callstack_depth(struct callstack*);
+/* Up to n positions from the top down, still owned by the callstack. Returns how many there were */
+int callstack_top(struct callstack*, struct instruction_pointer** out, int n);
 
 void callstack_destroy(struct callstack*);
 
 /** NUMBERS */
-struct number;
+/* Out in the open only for number_fingerprint(), everything else goes through the functions below.
+ * A -u number always has a limb to read, an undefined one points at a shared zero limb with len 0
+ */
+struct lnumber {
+    long long val;
+};
+struct unumber {
+    size_t len;
+    size_t cap;
+    unsigned int* data;
+    int negative;
+};
+
+struct number {
+    union {
+        struct lnumber* lptr;
+        struct unumber* uptr;
+    };
+};
 struct number* number_copy(struct number*);
 struct number* number_invalid();
 struct number* number_from(int i);
+/* -u only: len limbs of 32 bits, least significant first */
+struct number* number_from_limbs(const unsigned* limbs, size_t len, int negative);
 
 void number_add(struct number*, int);
 void number_divide(struct number*, int);
@@ -58,6 +87,18 @@ void number_print(struct number*);
 void number_print_dbg(struct number*);
 
 int number_compare(struct number*, struct number*);
+/* Unlike number_compare(), 0 and -0 or leading zeros are told apart, as printing does */
+int number_identical(struct number*, struct number*);
+/* Consistent with number_identical() */
+unsigned long number_hash(struct number*);
+/* Bytes of memory in use by the number */
+size_t number_size(struct number*);
+/* Exact lhs - rhs as a new number without leading zeros, no range checks even in limited mode */
+struct number* number_difference(struct number* lhs, struct number* rhs);
+/* Returns 0 if the number does not fit into an int */
+int number_to_int(struct number*, int* out);
+/* Defined and without leading zeros */
+int number_is_trimmed(struct number*);
 
 
 void number_destroy(struct number*);
@@ -67,28 +108,510 @@ void number_destroy(struct number*);
 /* returns a copy of the number stored under a given variable */
 struct number* variable_get(int number);
 struct number* accumulator_get();
+/* Limited mode only: the values without copying them */
+long long variable_value(int number);
+long long accumulator_value();
+/* Size of the accumulator or a variable, 1 in limited mode */
+size_t accumulator_limbs();
+size_t variable_limbs(int number);
+/* The accumulator itself if it fits into an int, its lowest limb with its sign otherwise */
+int accumulator_fingerprint();
+/* Where the state in use keeps its accumulator, for the cores to take number_fingerprint() of it every instruction */
+struct number* const* accumulator_slot();
+static inline int number_fingerprint(const struct number* n, int unlimited) {
+    if (!unlimited) {
+        return n->lptr->val;
+    }
+    const struct unumber* u = n->uptr;
+    int low = (int) u->data[0] & -(int) (u->len != 0);
+    int negative = -(int) (u->negative != 0);
+    return (low ^ negative) - negative;
+}
 /* Takes ownership of the struct number* */
 void variable_set(int number, struct number*);
 void accumulator_set(struct number*);
+/* Counts the variable_set() calls for a variable, to find out what got written in between */
+unsigned long variable_changes(int number);
 
 void variable_init();
 void variable_cleanup();
 
 
+/* For interpreter cores specialised to one mode, these work on the stored values instead of copies */
+/* Limited mode only, variable_set_value() counts as a variable_set() */
+void accumulator_set_value(long long);
+void variable_set_value(int number, long long);
+/* Both modes */
+void accumulator_print();
+/* -u only, the same as number_*() on accumulator_get() followed by accumulator_set() */
+void accumulator_add(int);
+void accumulator_multiply(int);
+void accumulator_divide(int);
+void accumulator_remainder(int);
+void accumulator_load(int number);  /* Nv */
+void variable_store(int number);    /* 2xNv */
+void variable_negate(int number);   /* Nn */
+int accumulator_compare(int number); /* 3xNv */
+
+
 /** FUNCTIONS */
 const char* function_get(int number);
-/* Does NOT take ownership of the string */
-void function_set(int number, const char*);
+/* Does NOT take ownership of the string.
+ * Returns -1 without changing anything if the function is already defined, the caller has to abort then.
+ */
+int function_set(int number, const char*);
+/* Returns the body function_set() would store for a definition starting at the given string.
+ * The result is in the ownership of the caller
+ */
+char* function_body(const char*);
 
 void function_cleanup();
 
 _Noreturn void die(const char msg[]);
+/* What Nh dies with, die() tells it apart from real failures by its address */
+extern const char naz_halt_message[];
+/* The same for -u numbers growing past naz_set_memory_limit() */
+extern const char naz_memory_budget_message[];
+/* Instruction and time budgets */
+_Noreturn void die_over_budget(const char msg[]);
+/* The two ways a program ends without the dump of die() */
+_Noreturn void die_redefined(int function);
+/* 0d and 0p in limited mode */
+_Noreturn void die_divided_by_zero();
 
 /** -u */
 /* Has to be called before variable_init() */
 void naz_set_unlimited(int);
 
+/** STATES */
+/* Variables, accumulator, functions, input buffer and streams of one program.
+ * Every function above works on the state the calling thread picked with naz_state_use(),
+ * threads that never did share a default one.
+ */
+struct naz_state;
+/* Variables are initialised already */
+struct naz_state* naz_state_new(int unlimited);
+/* NULL switches back to the default state. Returns the one used before */
+struct naz_state* naz_state_use(struct naz_state*);
+/* Back to how naz_state_new() created it, streams are kept */
+void naz_state_reset(struct naz_state*);
+void naz_state_destroy(struct naz_state*);
+
+/** DECODED PROGRAMS */
+/* A program decoded once, in exactly the way execute() would walk over it.
+ * Function bodies are taken from the 1xNf definitions on the toplevel.
+ */
+enum naz_opcode {
+    NAZ_OP_ADD,       /* Na and Ns, arg is negative for Ns */
+    NAZ_OP_MULTIPLY,  /* Nm */
+    NAZ_OP_DIVIDE,    /* Nd */
+    NAZ_OP_REMAINDER, /* Np */
+    NAZ_OP_CALL,      /* Nf */
+    NAZ_OP_READ,      /* Nr */
+    NAZ_OP_OUTPUT,    /* No */
+    NAZ_OP_LOAD,      /* Nv */
+    NAZ_OP_NEGATE,    /* Nn */
+    NAZ_OP_STORE,     /* 2xNv */
+    NAZ_OP_DEFINE,    /* 1xNf */
+    NAZ_OP_BRANCH,    /* 3xNvM[leg] */
+    NAZ_OP_DIE,       /* Nh and everything else execute() would die on */
+};
+
+struct naz_op {
+    enum naz_opcode code;
+    int offset;       /* position of the opcode inside its block */
+    int next;         /* position execute() continues at, used for return addresses */
+    int arg;          /* digit, variable or function number */
+    int target;       /* BRANCH: function to jump to */
+    char cond;        /* BRANCH: 'l', 'e' or 'g' */
+    int tail;         /* CALL: no return address is pushed */
+    const char* msg;  /* DIE: message for die() */
+    int pushed;       /* DIE: the current position is on the callstack when dying */
+};
+
+struct naz_block {
+    const char* code;
+    struct naz_op* ops;
+    int len;
+};
+
+struct naz_program {
+    struct naz_block toplevel;
+    /* code is NULL for functions that are never defined on the toplevel */
+    struct naz_block functions[10];
+    /* A 1xNf can be executed inside of a function, so bodies are only known at runtime */
+    int dynamic;
+};
+
+/* Does NOT take ownership of the string, but it has to outlive the result */
+struct naz_program* program_decode(const char*);
+void program_destroy(struct naz_program*);
+/* Collects the functions a call can reach (including itself) as well as the variables they read and write,
+ * each as a bitmask. Returns 0 if any of them reads input, prints or defines functions,
+ * or if calling it would die because a function is never defined.
+ */
+int program_function_effects(struct naz_program*, int function, int* reachable, int* reads, int* writes);
+
+/* Properties proven for every run of a program */
+enum naz_verified {
+    NAZ_VERIFIED_SYNTAX = 1,    /* only Nh dies, everything else is well-formed */
+    NAZ_VERIFIED_CALLS = 2,     /* every function is defined once and before it can be called */
+    NAZ_VERIFIED_VARIABLES = 4, /* no variable is read before it got assigned */
+};
+/* Returns the proven properties as a bitmask, 0 for programs defining functions inside of functions */
+int program_verify(struct naz_program*);
+
+/** JIT */
+/* Compiles limited mode programs to x86-64 machine code.
+ * Returns NULL if the program or the machine is not supported, the caller has to interpret it then.
+ */
+struct naz_jit;
+struct naz_jit* jit_compile(struct naz_program*);
+void jit_run(struct naz_jit*);
+/* Makes jit_run() return at once if it is running, and does nothing otherwise */
+void jit_leave(struct naz_jit*);
+/* Back to the state right after compiling, for running the program again */
+void jit_reset(struct naz_jit*);
+/* Writes the state of the compiled code back to variables, accumulator and callstack, for die() */
+void jit_sync(struct naz_jit*, struct callstack*);
+void jit_destroy(struct naz_jit*);
+
+/** C EMITTER */
+/* Writes a standalone C translation of the program, which has to be linked with nazlib.c.
+ * Returns -1 if the program cannot be translated.
+ */
+int program_emit_c(struct naz_program*, FILE*, int unlimited);
+
+/** Output */
+/* Stream number_print() writes to, NULL for stdout */
+void naz_set_output(FILE*);
+/* Writes bytes to that stream as if they got printed one by one */
+void output_write(const char* bytes, size_t len);
+/* Fills buf with at most len bytes of input and returns how many, 0 at the end of the input */
+typedef size_t (*naz_read_fn)(void* user, char* buf, size_t len);
+/* Where read_by_offset() gets its input from, in as few calls as possible, NULL for read(2) on stdin */
+void naz_set_input(naz_read_fn, void* user);
+/* Bytes the limbs of all -u numbers may take together, 0 for no limit */
+void naz_set_memory_limit(size_t);
+size_t naz_memory_used();
+/* The most naz_memory_used() got since the state was created or reset */
+size_t naz_memory_peak();
+/* Bytes taken from the input and printed so far */
+unsigned long long naz_bytes_read();
+unsigned long long naz_bytes_written();
+
+/** SNAPSHOTS */
+/* Variables, accumulator, functions, callstack and the output produced so far.
+ * Snapshots are taken before the first input is read, so the input state is not part of them.
+ */
+struct snapshot;
+/* Takes ownership of the output buffer, but not of the callstack */
+struct snapshot* snapshot_take(struct callstack*, char* output, size_t output_len);
+/* Replaces the current state by the one in the snapshot and writes its output in one go.
+ * Returns the callstack to continue with, in the ownership of the caller
+ */
+struct callstack* snapshot_restore(struct snapshot*);
+void snapshot_destroy(struct snapshot*);
+
+/** CHECKPOINTS */
+/* The whole state and a callstack in a binary file, -u numbers as their raw limbs.
+ * Only readable by the same build on the same kind of machine, for the same program and mode.
+ */
+/* Returns -1 if writing failed */
+int checkpoint_write(FILE*, struct callstack*, const char* code);
+/* Replaces the current state by the checkpointed one and returns its callstack, in the ownership of the caller.
+ * Returns NULL and sets error without changing anything if the file does not fit.
+ */
+struct callstack* checkpoint_read(FILE*, const char* code, const char** error);
+/* Bytes the current state took from its input so far */
+unsigned long long checkpoint_input_read();
+
+/** FUNCTION SUMMARIES */
+/* Limited mode only: functions that neither read nor print and only depend on
+ * the accumulator and at most one variable are replaced by a lookup table.
+ */
+struct summaries;
+struct summaries* summaries_new(struct naz_program*);
+/* Applies the effect of calling the function to the current state.
+ * Returns 0 if the call has to be interpreted instead, e.g. because it would die.
+ */
+int summaries_apply(struct summaries*, int function);
+void summaries_destroy(struct summaries*);
+
+/** COUNTING LOOPS */
+/* Functions that count the accumulator towards a variable and jump back to their own start */
+struct loops;
+struct loops* loops_new(struct naz_program*, int unlimited);
+/* Has to be called when the jump back at offset in the function is taken.
+ * Advances the accumulator so that only the last two iterations are left, if it is one of those loops.
+ */
+void loops_skip(struct loops*, int function, int offset);
+void loops_destroy(struct loops*);
+
+/** OUTPUT FOLDING */
+/* Stretches of ops starting at a No that only print and compute values known ahead of time,
+ * like 9a9a5a1o3a2o, become one string. Stops before anything that would die.
+ */
+struct folds;
+struct folds* folds_new(struct naz_program*, int unlimited);
+/* Has to be called at the No that is op in the function, -1 for the toplevel.
+ * Prints the stretch starting there and leaves accumulator and variables as it would.
+ * Returns the op to continue with, op itself if nothing got folded there.
+ */
+int folds_apply(struct folds*, int function, int op);
+void folds_destroy(struct folds*);
+
+/** MEMOIZATION */
+/* Caches the effect of calls to functions that neither read nor print,
+ * keyed on the accumulator and the variables they read.
+ */
+struct memo;
+/* Least recently used entries are dropped once the cache uses more than max_bytes */
+struct memo* memo_new(struct naz_program*, size_t max_bytes);
+enum memo_result {
+    MEMO_NONE,   /* not cacheable, just call it */
+    MEMO_HIT,    /* the effect of the call was applied to the current state */
+    MEMO_RECORD, /* push instruction_pointer_marker() right below the function and call memo_finish() once it is popped */
+};
+/* Tail calls do not grow the callstack and should not record either, pass record = 0 for them */
+enum memo_result memo_enter(struct memo*, int function, int record);
+void memo_finish(struct memo*);
+/* Drops all entries and pending calls, e.g. after a callstack got thrown away */
+void memo_clear(struct memo*);
+void memo_print_stats(struct memo*, FILE*);
+void memo_destroy(struct memo*);
+
+/** PROFILER */
+/* Counts for -p: opcodes, calls and self time per call path, and how often every call and branch ran */
+struct profile;
+enum profile_op {
+    PROFILE_ADD,        /* Na */
+    PROFILE_SUBTRACT,   /* Ns */
+    PROFILE_MULTIPLY,   /* Nm */
+    PROFILE_DIVIDE,     /* Nd */
+    PROFILE_REMAINDER,  /* Np */
+    PROFILE_CALL,       /* Nf */
+    PROFILE_READ,       /* Nr */
+    PROFILE_HALT,       /* Nh */
+    PROFILE_OUTPUT,     /* No */
+    PROFILE_LOAD,       /* Nv */
+    PROFILE_NEGATE,     /* Nn */
+    PROFILE_END,        /* 0x */
+    PROFILE_DEFINE,     /* 1xNf */
+    PROFILE_STORE,      /* 2xNv */
+    PROFILE_BRANCH,     /* 3xNvM[leg] */
+    PROFILE_OPS,
+};
+enum profile_event {
+    PROFILE_CALLED,
+    PROFILE_TAKEN,
+    PROFILE_NOT_TAKEN,
+};
+struct profile* profile_new();
+/* Also reads cycles, instructions, branch and cache misses at every switch between functions,
+ * as far as perf_event_open() allows it for the thread running the program. The report says what was missing.
+ */
+void profile_counters(struct profile*);
+/* limbs is the size of the -u accumulator for arithmetic, 0 otherwise */
+void profile_count(struct profile*, enum profile_op, size_t limbs);
+/* A function got entered and is now the frame at depth, called from the frame at depth parent (-1 for none) */
+void profile_enter(struct profile*, int function, int parent, int depth);
+/* The frame at depth continues after a call returned */
+void profile_resume(struct profile*, int depth);
+/* The run ended, charges the time up to now */
+void profile_stop(struct profile*);
+/* function is -1 for the toplevel, offset the position of the opcode in the code of the function */
+void profile_site(struct profile*, int function, int offset, enum profile_event);
+/* Sorted tables of everything counted */
+void profile_report(struct profile*, FILE*);
+void profile_write_json(struct profile*, FILE*);
+/* One line per call path with its self time in microseconds, for flamegraph tools */
+void profile_write_folded(struct profile*, FILE*);
+void profile_destroy(struct profile*);
+
 /** Read */
 int read_by_offset(int);
+/* Passes input bytes on to the output, as 1r followed by 1o would for each of them.
+ * Takes only the bytes already read ahead, or those a single read gets if there are none, and stops before
+ * the first byte in the string stop or a 0, those are left to be read as usual. Returns how many bytes got
+ * copied and the last of them in *last, nothing while Nr left bytes buffered.
+ */
+size_t input_copy(const char* stop, int* last);
 void debug_io_state();
 
+/** VIRTUAL MACHINES */
+/* Everything needed to run a program: its state, the decoded program and all caches.
+ * Machines are independent of each other, different threads can run different ones at the same time.
+ */
+struct naz_vm;
+struct naz_vm_options {
+    int unlimited;          /* -u */
+    int jit;                /* -j */
+    int tables;             /* -T */
+    int loops;              /* -L */
+    int folds;              /* -s */
+    long long prefix_limit; /* -P, -1 to not precompute anything */
+    size_t memo_bytes;      /* -M, 0 to not cache anything */
+    const char* checkpoint; /* --checkpoint, file vm_request_checkpoint() writes to, turns off -j and -M */
+    /* Budgets, 0 for none. Instructions and time turn off -j, they are looked at between calls and jumps */
+    long long max_steps;    /* --max-steps */
+    size_t max_memory;      /* --max-memory, bytes of all -u numbers together */
+    double max_seconds;     /* --max-time, wall clock */
+    /* --no-cycle-check, otherwise limited programs entering a function in the same state twice without
+     * input, output or definitions in between die with NAZ_VM_LOOPING */
+    int no_cycle_check;
+    int profile;            /* -p, counts everything that runs into vm_profile(), turns off -j */
+    int profile_counters;   /* --profile-counters, hardware counters per function for -p */
+    /* Live statistics, written between calls and jumps like the budgets are looked at */
+    int stats;              /* answers vm_request_stats(), not with -j */
+    const char* stats_file; /* --stats, appended to by vm_request_stats(), NULL for stderr */
+    const char* metrics;    /* --metrics, rewritten in the Prometheus text format, turns off -j */
+    double metrics_every;   /* --metrics-every, seconds between two rewrites */
+    struct trace* trace;    /* -t, gets every instruction that runs, turns off -j */
+};
+enum naz_vm_status {
+    NAZ_VM_OK = 0,
+    NAZ_VM_DIED,            /* die(), vm_perror() prints what it always printed */
+    NAZ_VM_REDEFINED,       /* a function got defined twice, vm_error() says which */
+    NAZ_VM_DIVIDED_BY_ZERO, /* 0d or 0p in limited mode, which used to raise SIGFPE */
+    NAZ_VM_HALTED,          /* Nh, otherwise the same as NAZ_VM_DIED */
+    NAZ_VM_OVER_BUDGET,     /* one of the budgets ran out, vm_error() says which */
+    NAZ_VM_LOOPING,         /* would never stop, vm_error() has the functions of one round */
+};
+/* What the interpreter exits with for NAZ_VM_OVER_BUDGET and NAZ_VM_LOOPING */
+#define NAZ_EXIT_OVER_BUDGET 3
+#define NAZ_EXIT_LOOPING 4
+/* Returns how many of the bytes were written, like fwrite() */
+typedef size_t (*naz_write_fn)(void* user, const char* buf, size_t len);
+
+/* NULL options are the plain interpreter in limited mode */
+struct naz_vm* vm_new(const struct naz_vm_options*);
+/* Takes a copy of the program, blanks out its comments and decodes it */
+enum naz_vm_status vm_load(struct naz_vm*, const char* code);
+/* Runs the loaded program from the start, NULL callbacks read stdin and write stdout directly.
+ * Everything written to the write callback is passed on before returning.
+ * The state of the run stays until the next one, -T, -M and -P results are kept across runs.
+ */
+enum naz_vm_status vm_run(struct naz_vm*, naz_read_fn, naz_write_fn, void* user);
+/* A new machine with its own state and caches for the program loaded into vm.
+ * The decoded program is shared read-only, so vm has to outlive the clone.
+ */
+struct naz_vm* vm_clone(struct naz_vm* vm);
+/* Evaluates -P ahead of the first run, so machines forked afterwards share the result */
+void vm_warm(struct naz_vm*);
+/* Prints what the interpreter prints for a run ending with status and returns its exit status.
+ * NAZ_VM_DIVIDED_BY_ZERO raises SIGFPE instead.
+ */
+int vm_report(struct naz_vm*, enum naz_vm_status);
+/* Safe to call from a signal handler. The running program writes a checkpoint at its next call or jump,
+ * from a forked process so it can carry on right away.
+ */
+void vm_request_checkpoint(struct naz_vm*);
+/* Safe to call from a signal handler. The running program writes a snapshot of how far it got
+ * to the stats file at its next call or jump, if the machine got created with stats.
+ */
+void vm_request_stats(struct naz_vm*);
+/* The next run continues from the checkpoint instead of the start, returns -1 and sets vm_error() if it does not fit.
+ * Running on stdin, it is moved past the input the checkpointed run had read if it can seek,
+ * any other input has to continue there on its own.
+ */
+int vm_restore(struct naz_vm*, const char* path);
+/* Message of the last failure */
+const char* vm_error(struct naz_vm*);
+/* The output of the old die(): perror() with the errno of back then, followed by vm_dump() */
+void vm_perror(struct naz_vm*);
+/* Functions, variables, input buffer, accumulator and callstack to stdout, followed by vm_dump_flight() to stderr */
+void vm_dump(struct naz_vm*);
+/* Safe to call from a signal handler. Writes the last instructions the program executed to fd,
+ * with what the accumulator was before each of them. -j does not record anything.
+ */
+void vm_dump_flight(struct naz_vm*, int fd);
+/* --memo-stats */
+void vm_print_stats(struct naz_vm*, FILE*);
+/* What -p counted over all runs so far, NULL without it */
+struct profile* vm_profile(struct naz_vm*);
+void vm_destroy(struct naz_vm*);
+
+/* Blanks out comments in place and calls unexpected for every char that is not part of a tupel, if not NULL.
+ * Returns the offset of the first digit not followed by an opcode, -1 if there is none.
+ */
+int program_prepare(char* code, void (*unexpected)(char));
+
+/** THREAD POOLS */
+/* Every worker owns a deque of tasks and steals from the others once its own is empty */
+struct pool;
+/* worker is the index of the thread running the task, in 0..threads-1 */
+typedef void (*pool_fn)(void* arg, int worker);
+struct pool* pool_new(int threads);
+/* Tasks submitted by a worker go to its own deque */
+void pool_submit(struct pool*, pool_fn, void* arg);
+/* Blocks until every submitted task finished */
+void pool_wait(struct pool*);
+int pool_threads(struct pool*);
+/* Waits for all tasks first */
+void pool_destroy(struct pool*);
+
+/** BATCHES */
+/* Runs the program on every regular file in the inputs directory, on a pool of threads.
+ * The output for inputs/name goes to outputs/name, one line of status per input to report.
+ * Returns the number of inputs that did not run to the end.
+ */
+int batch_run(struct naz_vm*, const char* inputs, const char* outputs, int threads, FILE* report);
+
+/** MAPS */
+/* Runs the program once per newline-terminated record of in, on a pool of threads.
+ * The outputs go to out in the order of the records, at most window records are in flight at once.
+ * Records ending in Nh count as done, every other failure gets a line in report.
+ * Returns the number of records that failed.
+ */
+int map_run(struct naz_vm*, FILE* in, FILE* out, int threads, size_t window, FILE* report);
+
+/** SERVERS */
+/* Listens on the UNIX socket at path and runs the program once per connection, until SIGINT or SIGTERM.
+ * Every connection gets a forked process sharing the loaded program copy-on-write, with the socket as stdin and stdout.
+ * prefork processes wait for connections ahead of time, at most limit run at once.
+ * One line per connection and the latencies at the end go to report. Returns -1 if the socket cannot be set up.
+ */
+int serve_run(struct naz_vm*, const char* path, int prefork, int limit, FILE* report);
+
+/** RECORDINGS */
+/* The input exactly as the program got it: every chunk read(2) returned, how long the program ran
+ * before asking for it and how long it waited for it. Pass recording_read() and the recording to vm_run().
+ */
+struct recording;
+/* Logs everything read from fd to the file at path, returns NULL and sets errno if it cannot be created */
+struct recording* record_open(const char* path, int fd);
+/* Feeds a log back in the same chunks, as fast as the program asks or with real_time not before they arrived back then.
+ * Returns NULL and sets error if the file cannot be read or is no recording.
+ */
+struct recording* replay_open(const char* path, int real_time, const char** error);
+/* A naz_read_fn, user is the recording */
+size_t recording_read(void* user, char* buf, size_t len);
+/* Returns -1 if writing the log failed */
+int recording_close(struct recording*);
+
+/** TRACES */
+/* -t: after the magic line, one entry per instruction in the order they ran, for tools/tracedump */
+#define NAZ_TRACE_MAGIC "naz trace 1\n"
+struct naz_trace_entry {
+    uint32_t skipped;  /* instructions left out by the filter since the previous entry, UINT32_MAX for at least that many */
+    int32_t offset;
+    int32_t acc;       /* before the instruction, the lowest limb with its sign for -u */
+    int8_t function;   /* -1 for the toplevel */
+    char digit;
+    char opcode;
+    uint8_t depth;     /* of the callstack, at most 255 */
+};
+/* Instructions have to pass all of them */
+struct trace_filter {
+    unsigned functions; /* bit 0 for the toplevel, bit N+1 for function N, 0 for all */
+    int from;           /* offsets, to is -1 for no end */
+    int to;
+    const char* ops;    /* opcode letters, NULL for all */
+};
+struct trace;
+/* Returns NULL and sets errno if the file cannot be created */
+struct trace* trace_open(const char* path, const struct trace_filter*);
+void trace_record(struct trace*, int function, int offset, const char* op, int acc, int depth);
+/* Returns -1 if writing failed */
+int trace_close(struct trace*);
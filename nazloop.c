@@ -0,0 +1,287 @@
+/*
+    Copyright (C) 2022 Tobias Heineken
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdlib.h>
+#include "nazlib.h"
+
+/* How a loop ends, seen in the direction the accumulator moves */
+enum loop_kind {
+    LOOP_NONE = 0,
+    /* 3xVvFl counting up or 3xVvFg counting down: stops once the accumulator reaches V */
+    LOOP_BEFORE,
+    /* 3xVvGg Ff counting up or 3xVvGl Ff counting down: stops once it passes V */
+    LOOP_PAST,
+    /* 3xVvGe Ff: stops exactly at V, runs forever if it steps over it */
+    LOOP_AT,
+    /* 1r, stores, at most one 3xVvG[leg], loads of what got stored, 1o and Ff: passes the input on byte by byte */
+    LOOP_ECHO,
+};
+
+struct loop {
+    enum loop_kind kind;
+    /* of the 3x or Nf jumping back to the start */
+    int offset;
+    int var;
+    /* net change of the accumulator per iteration */
+    int step;
+    /* LOOP_ECHO: variables the byte gets stored in as a bitmask, the branch leaving the loop if any */
+    int stores;
+    char cond;
+    /* LOOP_ECHO: the bytes echo_skip() does not copy, for the variable holding limit, as a string for strcspn() */
+    struct number* limit;
+    char stop[256];
+};
+
+struct loops {
+    int unlimited;
+    struct loop functions[10];
+};
+
+/* Everything up to the jump back may only count the accumulator in one direction and store it.
+ * Returns the index of the first other op.
+ */
+static int loop_body(struct naz_block* block, int* step) {
+    int up = 0, down = 0;
+    *step = 0;
+    int i;
+    for (i = 0; i < block->len; ++i) {
+        struct naz_op* op = &block->ops[i];
+        if (op->code == NAZ_OP_ADD) {
+            up |= op->arg > 0;
+            down |= op->arg < 0;
+            *step += op->arg;
+        } else if (op->code != NAZ_OP_STORE) {
+            break;
+        }
+    }
+    if (up && down) {
+        *step = 0;
+    }
+    return i;
+}
+
+static int echo_recognise(struct naz_block* block, int function, struct loop* loop) {
+    if (block->len < 3 || block->ops[0].code != NAZ_OP_READ || block->ops[0].arg != 1) {
+        return 0;
+    }
+    struct naz_op* back = &block->ops[block->len - 1];
+    if (back->code != NAZ_OP_CALL || back->arg != function || !back->tail) {
+        return 0;
+    }
+    int stores = 0, outputs = 0, branch = -1;
+    for (int i = 1; i < block->len - 1; ++i) {
+        struct naz_op* op = &block->ops[i];
+        if (op->code == NAZ_OP_STORE) {
+            stores |= 1 << op->arg;
+        } else if (op->code == NAZ_OP_LOAD && (stores & (1 << op->arg))) {
+            /* Loads the byte again */
+        } else if (op->code == NAZ_OP_OUTPUT && op->arg == 1) {
+            outputs++;
+        } else if (op->code == NAZ_OP_BRANCH && branch == -1 && op->target != function) {
+            branch = i;
+        } else {
+            return 0;
+        }
+    }
+    if (outputs != 1 || (branch != -1 && (stores & (1 << block->ops[branch].arg)))) {
+        return 0;
+    }
+    loop->kind = LOOP_ECHO;
+    loop->offset = back->offset;
+    loop->stores = stores;
+    loop->var = branch != -1 ? block->ops[branch].arg : -1;
+    loop->cond = branch != -1 ? block->ops[branch].cond : 0;
+    return 1;
+}
+
+static void loop_recognise(struct naz_program* prog, int function, struct loop* loop) {
+    struct naz_block* block = &prog->functions[function];
+    if (!block->code || echo_recognise(block, function, loop)) {
+        return;
+    }
+    int step;
+    int i = loop_body(block, &step);
+    if (step == 0 || i == block->len || block->ops[i].code != NAZ_OP_BRANCH) {
+        return;
+    }
+    struct naz_op* branch = &block->ops[i];
+    for (int j = 0; j < i; ++j) {
+        if (block->ops[j].code == NAZ_OP_STORE && block->ops[j].arg == branch->arg) {
+            /* The limit has to stay the same */
+            return;
+        }
+    }
+
+    if (branch->target == function) {
+        if ((branch->cond == 'l' && step > 0) || (branch->cond == 'g' && step < 0)) {
+            loop->kind = LOOP_BEFORE;
+            loop->offset = branch->offset;
+        }
+    } else if (i + 1 < block->len && block->ops[i + 1].code == NAZ_OP_CALL
+            && block->ops[i + 1].arg == function && block->ops[i + 1].tail) {
+        if (branch->cond == 'e') {
+            loop->kind = LOOP_AT;
+        } else if ((branch->cond == 'g' && step > 0) || (branch->cond == 'l' && step < 0)) {
+            loop->kind = LOOP_PAST;
+        }
+        loop->offset = block->ops[i + 1].offset;
+    }
+    loop->var = branch->arg;
+    loop->step = step;
+}
+
+struct loops* loops_new(struct naz_program* prog, int unlimited) {
+    struct loops* out = calloc(1, sizeof(*out));
+    out->unlimited = unlimited;
+    if (prog->dynamic) {
+        /* Function bodies are not known ahead of time */
+        return out;
+    }
+    for (int i = 0; i < 10; ++i) {
+        loop_recognise(prog, i, &out->functions[i]);
+    }
+    return out;
+}
+
+/* Where the accumulator ends up after all iterations, relative to the limit in the direction it moves.
+ * distance is how far it is still away from the limit, returns 0 if fewer than 3 iterations are left.
+ */
+static int loop_overshoot(struct loop* loop, struct number* distance, int* out) {
+    int step = abs(loop->step);
+    struct number* threshold = number_from(2 * step);
+    int cmp = number_compare(distance, threshold);
+    number_destroy(threshold);
+    struct number* rem = number_copy(distance);
+    number_remainder(rem, step);
+    int r;
+    int fits = number_to_int(rem, &r);
+    number_destroy(rem);
+    if (!fits) {
+        return 0;
+    }
+    switch (loop->kind) {
+        case LOOP_BEFORE:
+            *out = (step - r) % step;
+            return cmp > 0;
+        case LOOP_PAST:
+            *out = step - r;
+            return cmp >= 0;
+        case LOOP_AT:
+            *out = 0;
+            return r == 0 && cmp > 0;
+        default:
+            return 0;
+    }
+}
+
+/* Bytes print as themselves and do not take the branch, the interpreter does all others.
+ * 0 is one of those and ends the string
+ */
+static void echo_stop(struct loop* loop, struct number* limit) {
+    int len = 0;
+    for (int c = 1; c < 256; ++c) {
+        int plain = c == 10 || (c >= 32 && c <= 126);
+        if (plain && limit) {
+            struct number* byte = number_from(c);
+            int cmp = number_compare(byte, limit);
+            number_destroy(byte);
+            plain = !((cmp == 0 && loop->cond == 'e') || (cmp < 0 && loop->cond == 'l') || (cmp > 0 && loop->cond == 'g'));
+        }
+        if (!plain) {
+            loop->stop[len++] = c;
+        }
+    }
+    loop->stop[len] = '\0';
+}
+
+static void echo_skip(struct loop* loop) {
+    if (loop->var >= 0) {
+        struct number* limit = variable_get(loop->var);
+        if (loop->limit && number_compare(limit, loop->limit) == 0) {
+            number_destroy(limit);
+        } else {
+            if (loop->limit) {
+                number_destroy(loop->limit);
+            }
+            loop->limit = limit;
+            echo_stop(loop, limit);
+        }
+    } else if (!loop->stop[0]) {
+        echo_stop(loop, NULL);
+    }
+    int last;
+    if (input_copy(loop->stop, &last) == 0) {
+        return;
+    }
+    /* Where the last of the iterations left everything */
+    accumulator_set(number_from(last));
+    for (int var = 0; var < 10; ++var) {
+        if (loop->stores & (1 << var)) {
+            variable_set(var, number_from(last));
+        }
+    }
+}
+
+void loops_skip(struct loops* loops, int function, int offset) {
+    struct loop* loop = &loops->functions[function];
+    if (loop->kind == LOOP_NONE || loop->offset != offset) {
+        return;
+    }
+    if (loop->kind == LOOP_ECHO) {
+        echo_skip(loop);
+        return;
+    }
+    struct number* acc = accumulator_get();
+    struct number* limit = variable_get(loop->var);
+    if (!number_is_trimmed(acc) || !number_is_trimmed(limit)) {
+        /* Leading zeros survive counting away from zero, only the interpreter gets those right */
+        number_destroy(acc);
+        number_destroy(limit);
+        return;
+    }
+    struct number* distance = loop->step > 0 ? number_difference(limit, acc) : number_difference(acc, limit);
+    int overshoot;
+    if (loop_overshoot(loop, distance, &overshoot)) {
+        /* Skip everything but the last two iterations, which the interpreter runs as usual.
+         * Stores in between get overwritten by them, and the first one normalises the accumulator.
+         */
+        int back = overshoot - 2 * abs(loop->step);
+        struct number* offset_n = number_from(loop->step > 0 ? -back : back);
+        struct number* skipped = number_difference(limit, offset_n);
+        number_destroy(offset_n);
+        int val;
+        if (loops->unlimited || (number_to_int(skipped, &val) && val >= -127 && val <= 127)) {
+            accumulator_set(skipped);
+        } else {
+            /* Counting there would die on the way */
+            number_destroy(skipped);
+        }
+    }
+    number_destroy(distance);
+    number_destroy(acc);
+    number_destroy(limit);
+}
+
+void loops_destroy(struct loops* loops) {
+    for (int i = 0; i < 10; ++i) {
+        if (loops->functions[i].limit) {
+            number_destroy(loops->functions[i].limit);
+        }
+    }
+    free(loops);
+}
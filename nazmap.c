@@ -0,0 +1,168 @@
+/*
+    Copyright (C) 2022 Tobias Heineken
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include "nazlib.h"
+
+struct map;
+
+/* One slot of the reorder buffer, its buffers are reused by every record passing through it */
+struct record {
+    struct map* map;
+    size_t number;
+    char* in;
+    size_t in_cap;
+    size_t in_len;
+    size_t in_pos;
+    char* out;
+    size_t out_cap;
+    size_t out_len;
+    enum naz_vm_status status;
+    char message[256];
+    int done;
+};
+
+struct map {
+    /* One per worker, all sharing the decoded program */
+    struct naz_vm** vms;
+    struct record* slots;
+    size_t window;
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+};
+
+static size_t record_read(void* user, char* buf, size_t len) {
+    struct record* r = user;
+    size_t n = r->in_len - r->in_pos;
+    if (n > len) {
+        n = len;
+    }
+    memcpy(buf, r->in + r->in_pos, n);
+    r->in_pos += n;
+    return n;
+}
+
+static size_t record_write(void* user, const char* buf, size_t len) {
+    struct record* r = user;
+    if (r->out_len + len > r->out_cap) {
+        r->out_cap = r->out_cap * 2 > r->out_len + len ? r->out_cap * 2 : r->out_len + len;
+        r->out = realloc(r->out, r->out_cap);
+    }
+    memcpy(r->out + r->out_len, buf, len);
+    r->out_len += len;
+    return len;
+}
+
+static void map_job(void* arg, int worker) {
+    struct record* r = arg;
+    struct map* map = r->map;
+    struct naz_vm* vm = map->vms[worker];
+    r->status = vm_run(vm, record_read, record_write, r);
+    if (r->status != NAZ_VM_OK) {
+        snprintf(r->message, sizeof(r->message), "%s", vm_error(vm));
+    }
+    pthread_mutex_lock(&map->lock);
+    r->done = 1;
+    pthread_cond_signal(&map->finished);
+    pthread_mutex_unlock(&map->lock);
+}
+
+/* Halting is a normal way to finish a record, everything else counts as failed */
+static int record_finish(struct record* r, FILE* out, FILE* report) {
+    fwrite(r->out, 1, r->out_len, out);
+    switch (r->status) {
+        case NAZ_VM_OK:
+        case NAZ_VM_HALTED:
+            return 0;
+        case NAZ_VM_DIVIDED_BY_ZERO:
+            fprintf(report, "record %zu: exit %d: %s\n", r->number, 128 + SIGFPE, r->message);
+            return 1;
+        case NAZ_VM_OVER_BUDGET:
+            fprintf(report, "record %zu: exit %d: %s\n", r->number, NAZ_EXIT_OVER_BUDGET, r->message);
+            return 1;
+        case NAZ_VM_LOOPING:
+            fprintf(report, "record %zu: exit %d: %s\n", r->number, NAZ_EXIT_LOOPING, r->message);
+            return 1;
+        default:
+            fprintf(report, "record %zu: exit %d: %s\n", r->number, EXIT_FAILURE, r->message);
+            return 1;
+    }
+}
+
+int map_run(struct naz_vm* vm, FILE* in, FILE* out, int threads, size_t window, FILE* report) {
+    struct map map = {calloc(threads, sizeof(*map.vms)), calloc(window, sizeof(*map.slots)), window};
+    pthread_mutex_init(&map.lock, NULL);
+    pthread_cond_init(&map.finished, NULL);
+    for (int i = 0; i < threads; ++i) {
+        map.vms[i] = vm_clone(vm);
+    }
+    struct pool* pool = pool_new(threads);
+
+    /* Records next_out..next_in-1 are in flight, at most window of them */
+    size_t next_in = 0, next_out = 0;
+    int more = 1, failed = 0;
+    for (;;) {
+        pthread_mutex_lock(&map.lock);
+        /* Only wait for the oldest record if there is nothing else to do */
+        while (next_out < next_in && !map.slots[next_out % window].done && (!more || next_in - next_out == window)) {
+            pthread_cond_wait(&map.finished, &map.lock);
+        }
+        int ready = next_out < next_in && map.slots[next_out % window].done;
+        pthread_mutex_unlock(&map.lock);
+
+        if (ready) {
+            failed += record_finish(&map.slots[next_out++ % window], out, report);
+            continue;
+        }
+        if (!more) {
+            break;
+        }
+        struct record* r = &map.slots[next_in % window];
+        ssize_t len = getline(&r->in, &r->in_cap, in);
+        if (len == -1) {
+            more = 0;
+            continue;
+        }
+        r->map = &map;
+        r->number = ++next_in;
+        r->in_len = len;
+        r->in_pos = 0;
+        r->out_len = 0;
+        r->done = 0;
+        pool_submit(pool, map_job, r);
+    }
+    fflush(out);
+
+    pool_destroy(pool);
+    for (int i = 0; i < threads; ++i) {
+        vm_destroy(map.vms[i]);
+    }
+    for (size_t i = 0; i < window; ++i) {
+        free(map.slots[i].in);
+        free(map.slots[i].out);
+    }
+    pthread_mutex_destroy(&map.lock);
+    pthread_cond_destroy(&map.finished);
+    free(map.vms);
+    free(map.slots);
+    return failed;
+}
@@ -0,0 +1,291 @@
+/*
+    Copyright (C) 2022 Tobias Heineken
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdlib.h>
+#include "nazlib.h"
+
+#define INITIAL_BUCKETS 1024
+
+/* The accumulator followed by every variable the function reads */
+struct key {
+    int function;
+    unsigned long hash;
+    int len;
+    struct number* inputs[11];
+};
+
+struct entry {
+    struct key key;
+    struct number* acc;
+    /* Only variables that actually got written are part of the effect */
+    int written;
+    struct number* vars[10];
+    size_t size;
+
+    struct entry* bucket_next;
+    struct entry* lru_prev;
+    struct entry* lru_next;
+};
+
+struct pending {
+    struct key key;
+    unsigned long changes[10];
+};
+
+struct memo {
+    int usable[10];
+    int reads[10][10];
+    int reads_len[10];
+
+    struct entry** buckets;
+    size_t bucket_count;
+    size_t entry_count;
+    /* lru_head is the most recently used one */
+    struct entry* lru_head;
+    struct entry* lru_tail;
+    size_t bytes;
+    size_t max_bytes;
+
+    struct pending* pending;
+    int pending_len;
+    int pending_cap;
+
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+};
+
+struct memo* memo_new(struct naz_program* prog, size_t max_bytes) {
+    struct memo* out = calloc(1, sizeof(*out));
+    out->max_bytes = max_bytes;
+    out->bucket_count = INITIAL_BUCKETS;
+    out->buckets = calloc(out->bucket_count, sizeof(*out->buckets));
+    if (prog->dynamic) {
+        /* Function bodies are not known ahead of time */
+        return out;
+    }
+    for (int i = 0; i < 10; ++i) {
+        int reachable, reads, writes;
+        if (!program_function_effects(prog, i, &reachable, &reads, &writes)) {
+            continue;
+        }
+        out->usable[i] = 1;
+        for (int var = 0; var < 10; ++var) {
+            if (reads & (1 << var)) {
+                out->reads[i][out->reads_len[i]++] = var;
+            }
+        }
+    }
+    return out;
+}
+
+static void key_init(struct memo* memo, struct key* key, int function) {
+    key->function = function;
+    key->len = 0;
+    key->inputs[key->len++] = accumulator_get();
+    for (int i = 0; i < memo->reads_len[function]; ++i) {
+        key->inputs[key->len++] = variable_get(memo->reads[function][i]);
+    }
+    key->hash = function;
+    for (int i = 0; i < key->len; ++i) {
+        key->hash = key->hash * 31 + number_hash(key->inputs[i]);
+    }
+}
+
+static int key_equal(struct key* lhs, struct key* rhs) {
+    if (lhs->function != rhs->function || lhs->hash != rhs->hash || lhs->len != rhs->len) {
+        return 0;
+    }
+    for (int i = 0; i < lhs->len; ++i) {
+        if (!number_identical(lhs->inputs[i], rhs->inputs[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void key_cleanup(struct key* key) {
+    for (int i = 0; i < key->len; ++i) {
+        number_destroy(key->inputs[i]);
+    }
+}
+
+static void lru_unlink(struct memo* memo, struct entry* e) {
+    if (e->lru_prev) {
+        e->lru_prev->lru_next = e->lru_next;
+    } else {
+        memo->lru_head = e->lru_next;
+    }
+    if (e->lru_next) {
+        e->lru_next->lru_prev = e->lru_prev;
+    } else {
+        memo->lru_tail = e->lru_prev;
+    }
+}
+
+static void lru_push_front(struct memo* memo, struct entry* e) {
+    e->lru_prev = NULL;
+    e->lru_next = memo->lru_head;
+    if (memo->lru_head) {
+        memo->lru_head->lru_prev = e;
+    } else {
+        memo->lru_tail = e;
+    }
+    memo->lru_head = e;
+}
+
+static void entry_destroy(struct entry* e) {
+    key_cleanup(&e->key);
+    number_destroy(e->acc);
+    for (int i = 0; i < 10; ++i) {
+        if (e->written & (1 << i)) {
+            number_destroy(e->vars[i]);
+        }
+    }
+    free(e);
+}
+
+static void entry_remove(struct memo* memo, struct entry* e) {
+    struct entry** slot = &memo->buckets[e->key.hash & (memo->bucket_count - 1)];
+    while (*slot != e) {
+        slot = &(*slot)->bucket_next;
+    }
+    *slot = e->bucket_next;
+    lru_unlink(memo, e);
+    memo->bytes -= e->size;
+    memo->entry_count--;
+    entry_destroy(e);
+}
+
+static void buckets_grow(struct memo* memo) {
+    size_t count = memo->bucket_count * 2;
+    struct entry** buckets = calloc(count, sizeof(*buckets));
+    for (size_t i = 0; i < memo->bucket_count; ++i) {
+        struct entry* e = memo->buckets[i];
+        while (e) {
+            struct entry* next = e->bucket_next;
+            e->bucket_next = buckets[e->key.hash & (count - 1)];
+            buckets[e->key.hash & (count - 1)] = e;
+            e = next;
+        }
+    }
+    free(memo->buckets);
+    memo->buckets = buckets;
+    memo->bucket_count = count;
+}
+
+enum memo_result memo_enter(struct memo* memo, int function, int record) {
+    if (function < 0 || function > 9 || !memo->usable[function]) {
+        return MEMO_NONE;
+    }
+    struct key key;
+    key_init(memo, &key, function);
+    for (struct entry* e = memo->buckets[key.hash & (memo->bucket_count - 1)]; e; e = e->bucket_next) {
+        if (!key_equal(&key, &e->key)) {
+            continue;
+        }
+        /* Every function the call executed was defined back then, and definitions stay */
+        key_cleanup(&key);
+        accumulator_set(number_copy(e->acc));
+        for (int i = 0; i < 10; ++i) {
+            if (e->written & (1 << i)) {
+                variable_set(i, number_copy(e->vars[i]));
+            }
+        }
+        lru_unlink(memo, e);
+        lru_push_front(memo, e);
+        memo->hits++;
+        return MEMO_HIT;
+    }
+    memo->misses++;
+    if (!record) {
+        key_cleanup(&key);
+        return MEMO_NONE;
+    }
+
+    if (memo->pending_len == memo->pending_cap) {
+        memo->pending_cap = memo->pending_cap ? memo->pending_cap * 2 : 16;
+        memo->pending = realloc(memo->pending, sizeof(*memo->pending) * memo->pending_cap);
+    }
+    struct pending* p = &memo->pending[memo->pending_len++];
+    p->key = key;
+    for (int i = 0; i < 10; ++i) {
+        p->changes[i] = variable_changes(i);
+    }
+    return MEMO_RECORD;
+}
+
+void memo_finish(struct memo* memo) {
+    if (memo->pending_len == 0) {
+        return;
+    }
+    struct pending* p = &memo->pending[--memo->pending_len];
+    struct entry* e = calloc(1, sizeof(*e));
+    e->key = p->key;
+    e->acc = accumulator_get();
+    e->size = sizeof(*e) + number_size(e->acc);
+    for (int i = 0; i < e->key.len; ++i) {
+        e->size += number_size(e->key.inputs[i]);
+    }
+    for (int i = 0; i < 10; ++i) {
+        if (variable_changes(i) != p->changes[i]) {
+            e->written |= 1 << i;
+            e->vars[i] = variable_get(i);
+            e->size += number_size(e->vars[i]);
+        }
+    }
+    if (e->size > memo->max_bytes) {
+        entry_destroy(e);
+        return;
+    }
+
+    while (memo->bytes + e->size > memo->max_bytes) {
+        entry_remove(memo, memo->lru_tail);
+        memo->evictions++;
+    }
+    if (memo->entry_count >= memo->bucket_count * 2) {
+        buckets_grow(memo);
+    }
+    struct entry** slot = &memo->buckets[e->key.hash & (memo->bucket_count - 1)];
+    e->bucket_next = *slot;
+    *slot = e;
+    lru_push_front(memo, e);
+    memo->bytes += e->size;
+    memo->entry_count++;
+}
+
+void memo_clear(struct memo* memo) {
+    while (memo->lru_tail) {
+        entry_remove(memo, memo->lru_tail);
+    }
+    while (memo->pending_len > 0) {
+        key_cleanup(&memo->pending[--memo->pending_len].key);
+    }
+}
+
+void memo_print_stats(struct memo* memo, FILE* out) {
+    fprintf(out, "memo: %lu hits, %lu misses, %lu evictions, %zu entries using %zu bytes\n",
+            memo->hits, memo->misses, memo->evictions, memo->entry_count, memo->bytes);
+}
+
+void memo_destroy(struct memo* memo) {
+    memo_clear(memo);
+    free(memo->pending);
+    free(memo->buckets);
+    free(memo);
+}
@@ -0,0 +1,195 @@
+/*
+    Copyright (C) 2022 Tobias Heineken
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdlib.h>
+#include <pthread.h>
+#include "nazlib.h"
+
+struct task {
+    pool_fn fn;
+    void* arg;
+};
+
+/* The owner takes from the tail, everybody else steals from the head */
+struct deque {
+    pthread_mutex_t lock;
+    struct task* tasks;
+    size_t head;
+    size_t tail;
+    size_t cap;
+};
+
+struct pool {
+    int threads;
+    pthread_t* ids;
+    struct deque* deques;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t idle;
+    /* Tasks in some deque that no worker claimed yet */
+    size_t queued;
+    /* Submitted but not finished */
+    size_t pending;
+    /* Deque of the next task submitted from outside */
+    int next;
+    int stop;
+};
+
+struct worker {
+    struct pool* pool;
+    int index;
+};
+
+/* Pool of the calling thread and its index in there, if it is a worker */
+static __thread struct pool* worker_pool;
+static __thread int worker_index;
+
+static void deque_push(struct deque* d, struct task task) {
+    pthread_mutex_lock(&d->lock);
+    if (d->tail - d->head == d->cap) {
+        size_t cap = d->cap ? d->cap * 2 : 64;
+        struct task* tasks = malloc(sizeof(*tasks) * cap);
+        for (size_t i = d->head; i < d->tail; ++i) {
+            tasks[i - d->head] = d->tasks[i % d->cap];
+        }
+        free(d->tasks);
+        d->tasks = tasks;
+        d->tail -= d->head;
+        d->head = 0;
+        d->cap = cap;
+    }
+    d->tasks[d->tail++ % d->cap] = task;
+    pthread_mutex_unlock(&d->lock);
+}
+
+static int deque_take(struct deque* d, struct task* out, int steal) {
+    pthread_mutex_lock(&d->lock);
+    int found = d->head != d->tail;
+    if (found) {
+        *out = steal ? d->tasks[d->head++ % d->cap] : d->tasks[--d->tail % d->cap];
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+static void* worker_main(void* arg) {
+    struct worker* self = arg;
+    struct pool* pool = self->pool;
+    worker_pool = pool;
+    worker_index = self->index;
+    free(self);
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->queued == 0 && !pool->stop) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (pool->queued == 0) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        /* One of the queued tasks is ours now, it just has to be found */
+        pool->queued--;
+        pthread_mutex_unlock(&pool->lock);
+
+        struct task task;
+        int victim = worker_index;
+        while (!deque_take(&pool->deques[victim], &task, victim != worker_index)) {
+            victim = (victim + 1) % pool->threads;
+        }
+        task.fn(task.arg, worker_index);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0) {
+            pthread_cond_broadcast(&pool->idle);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+struct pool* pool_new(int threads) {
+    struct pool* out = calloc(1, sizeof(*out));
+    out->threads = threads;
+    out->ids = calloc(threads, sizeof(*out->ids));
+    out->deques = calloc(threads, sizeof(*out->deques));
+    pthread_mutex_init(&out->lock, NULL);
+    pthread_cond_init(&out->work, NULL);
+    pthread_cond_init(&out->idle, NULL);
+    for (int i = 0; i < threads; ++i) {
+        pthread_mutex_init(&out->deques[i].lock, NULL);
+    }
+    for (int i = 0; i < threads; ++i) {
+        struct worker* w = malloc(sizeof(*w));
+        w->pool = out;
+        w->index = i;
+        pthread_create(&out->ids[i], NULL, worker_main, w);
+    }
+    return out;
+}
+
+void pool_submit(struct pool* pool, pool_fn fn, void* arg) {
+    int target = worker_pool == pool ? worker_index : -1;
+    pthread_mutex_lock(&pool->lock);
+    if (target < 0) {
+        /* Spread out, the workers steal from each other anyway */
+        target = pool->next;
+        pool->next = (pool->next + 1) % pool->threads;
+    }
+    pool->pending++;
+    pthread_mutex_unlock(&pool->lock);
+
+    deque_push(&pool->deques[target], (struct task) {fn, arg});
+
+    pthread_mutex_lock(&pool->lock);
+    pool->queued++;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_wait(struct pool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0) {
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+int pool_threads(struct pool* pool) {
+    return pool->threads;
+}
+
+void pool_destroy(struct pool* pool) {
+    pool_wait(pool);
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->threads; ++i) {
+        pthread_join(pool->ids[i], NULL);
+    }
+    for (int i = 0; i < pool->threads; ++i) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].tasks);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->idle);
+    free(pool->deques);
+    free(pool->ids);
+    free(pool);
+}
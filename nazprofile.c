@@ -0,0 +1,545 @@
+/*
+    Copyright (C) 2022 Tobias Heineken
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "nazlib.h"
+
+/* Calls nested deeper than this are counted for the node at this depth */
+#define PROFILE_DEPTH 100
+/* Limb counts in buckets of powers of two */
+#define LIMB_BUCKETS 48
+#define INITIAL_SITES 64
+/* Branch sites the text report lists */
+#define REPORT_SITES 20
+
+static const char* const op_names[PROFILE_OPS] = {
+    "Na", "Ns", "Nm", "Nd", "Np", "Nf", "Nr", "Nh", "No", "Nv", "Nn", "0x", "1x", "2x", "3x",
+};
+
+/* Hardware counters of profile_counters(), IPC is the second over the first */
+#define COUNTERS 4
+static const struct {
+    unsigned long long config;
+    const char* name;
+} counter_events[COUNTERS] = {
+    {PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+    {PERF_COUNT_HW_INSTRUCTIONS, "instructions"},
+    {PERF_COUNT_HW_BRANCH_MISSES, "branch_misses"},
+    {PERF_COUNT_HW_CACHE_MISSES, "cache_misses"},
+};
+
+/* One call path, the toplevel is the root */
+struct node {
+    int function;
+    int depth;
+    struct node* parent;
+    struct node* child;
+    struct node* sibling;
+    unsigned long long self_ns;
+    unsigned long long self_counts[COUNTERS];
+};
+
+struct site {
+    int function;
+    int offset;
+    unsigned long long counts[3];
+};
+
+struct profile {
+    unsigned long long ops[PROFILE_OPS];
+    unsigned long long op_limbs[PROFILE_OPS];
+    unsigned long long limbs[LIMB_BUCKETS];
+    unsigned long long calls[10];
+
+    struct node root;
+    struct node* current;
+    /* Node of the frame at every depth of the callstack */
+    struct node** frames;
+    int frames_cap;
+    struct timespec since;
+    int running;
+
+    /* One group of counters for the thread running the program, opened on the first switch */
+    int counters;               /* profile_counters() got called */
+    int counters_tried;
+    int counters_errno;         /* why the first one that failed to open did */
+    int counter_fds[COUNTERS];  /* -1 for the ones that failed to open, the first open one leads the group */
+    int group;
+    int group_len;
+    unsigned long long counts[COUNTERS];
+    /* Nanoseconds the group was enabled and actually counting, less when the PMU is shared */
+    unsigned long long counters_enabled;
+    unsigned long long counters_running;
+
+    /* Open addressing on function and offset */
+    struct site* sites;
+    size_t sites_cap;
+    size_t sites_len;
+};
+
+struct profile* profile_new() {
+    struct profile* out = calloc(1, sizeof(*out));
+    out->root.function = -1;
+    out->current = &out->root;
+    return out;
+}
+
+static void node_destroy(struct node* node) {
+    while (node) {
+        struct node* next = node->sibling;
+        node_destroy(node->child);
+        free(node);
+        node = next;
+    }
+}
+
+void profile_counters(struct profile* prof) {
+    prof->counters = 1;
+}
+
+static void counters_open(struct profile* prof) {
+    prof->counters_tried = 1;
+    prof->group = -1;
+    for (int i = 0; i < COUNTERS; ++i) {
+        /* Only this thread in user space, which a perf_event_paranoid of 2 still allows */
+        struct perf_event_attr attr = {
+            .type = PERF_TYPE_HARDWARE,
+            .size = sizeof(attr),
+            .config = counter_events[i].config,
+            .read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING,
+            .exclude_kernel = 1,
+            .exclude_hv = 1,
+        };
+        prof->counter_fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, prof->group, 0);
+        if (prof->counter_fds[i] == -1) {
+            if (!prof->counters_errno) {
+                prof->counters_errno = errno;
+            }
+            continue;
+        }
+        if (prof->group == -1) {
+            prof->group = prof->counter_fds[i];
+        }
+        prof->group_len++;
+    }
+}
+
+/* Current values of all counters and the times of the group, returns 0 if the read failed.
+ * The ones that failed to open stay 0
+ */
+static int counters_read(struct profile* prof, unsigned long long* out, unsigned long long* enabled,
+                         unsigned long long* running) {
+    /* The number of counters, the two times, then the values */
+    unsigned long long values[COUNTERS + 3];
+    memset(out, 0, sizeof(*out) * COUNTERS);
+    if (read(prof->group, values, sizeof(values)) < (ssize_t) sizeof(*values) * (prof->group_len + 3)) {
+        return 0;
+    }
+    *enabled = values[1];
+    *running = values[2];
+    for (int i = 0, value = 3; i < COUNTERS; ++i) {
+        if (prof->counter_fds[i] != -1) {
+            out[i] = values[value++];
+        }
+    }
+    return 1;
+}
+
+void profile_destroy(struct profile* prof) {
+    if (prof->counters_tried) {
+        for (int i = 0; i < COUNTERS; ++i) {
+            if (prof->counter_fds[i] != -1) {
+                close(prof->counter_fds[i]);
+            }
+        }
+    }
+    node_destroy(prof->root.child);
+    free(prof->frames);
+    free(prof->sites);
+    free(prof);
+}
+
+void profile_count(struct profile* prof, enum profile_op op, size_t limbs) {
+    prof->ops[op]++;
+    if (limbs) {
+        prof->op_limbs[op] += limbs;
+        int bucket = 0;
+        while (bucket < LIMB_BUCKETS - 1 && (size_t) 1 << bucket < limbs) {
+            bucket++;
+        }
+        prof->limbs[bucket]++;
+    }
+}
+
+/* Charges the time and the counts since the last switch to the node running until now */
+static void profile_switch(struct profile* prof, struct node* next) {
+    if (prof->counters && !prof->counters_tried) {
+        counters_open(prof);
+    }
+    unsigned long long counts[COUNTERS], enabled, running;
+    if (prof->counters_tried && prof->group != -1 && counters_read(prof, counts, &enabled, &running)) {
+        /* Scaled up by the share of the time since the last switch the group was not counting */
+        unsigned long long ran = running - prof->counters_running;
+        double scale = ran ? (double) (enabled - prof->counters_enabled) / ran : 0;
+        for (int i = 0; prof->running && i < COUNTERS; ++i) {
+            prof->current->self_counts[i] += (counts[i] - prof->counts[i]) * scale;
+        }
+        memcpy(prof->counts, counts, sizeof(counts));
+        prof->counters_enabled = enabled;
+        prof->counters_running = running;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (prof->running) {
+        prof->current->self_ns += (now.tv_sec - prof->since.tv_sec) * 1000000000ull + now.tv_nsec - prof->since.tv_nsec;
+    }
+    prof->since = now;
+    prof->running = 1;
+    prof->current = next;
+}
+
+static struct node** profile_frame(struct profile* prof, int depth) {
+    if (depth >= prof->frames_cap) {
+        int cap = prof->frames_cap ? prof->frames_cap : 64;
+        while (cap <= depth) {
+            cap *= 2;
+        }
+        prof->frames = realloc(prof->frames, sizeof(*prof->frames) * cap);
+        memset(prof->frames + prof->frames_cap, 0, sizeof(*prof->frames) * (cap - prof->frames_cap));
+        prof->frames_cap = cap;
+    }
+    return &prof->frames[depth];
+}
+
+void profile_enter(struct profile* prof, int function, int parent, int depth) {
+    struct node* up = parent >= 0 ? *profile_frame(prof, parent) : NULL;
+    if (!up) {
+        up = &prof->root;
+    }
+    struct node* node = up;
+    if (up->depth < PROFILE_DEPTH) {
+        for (node = up->child; node && node->function != function; node = node->sibling) {
+        }
+        if (!node) {
+            node = calloc(1, sizeof(*node));
+            node->function = function;
+            node->depth = up->depth + 1;
+            node->parent = up;
+            node->sibling = up->child;
+            up->child = node;
+        }
+    }
+    prof->calls[function]++;
+    *profile_frame(prof, depth) = node;
+    profile_switch(prof, node);
+}
+
+void profile_resume(struct profile* prof, int depth) {
+    struct node* node = *profile_frame(prof, depth);
+    profile_switch(prof, node ? node : &prof->root);
+}
+
+void profile_stop(struct profile* prof) {
+    profile_switch(prof, &prof->root);
+    prof->running = 0;
+}
+
+static size_t site_slot(struct site* sites, size_t cap, int function, int offset) {
+    size_t slot = ((size_t) (function + 1) * 2654435761u + (size_t) offset * 40503u) & (cap - 1);
+    while (sites[slot].counts[0] + sites[slot].counts[1] + sites[slot].counts[2] != 0
+            && (sites[slot].function != function || sites[slot].offset != offset)) {
+        slot = (slot + 1) & (cap - 1);
+    }
+    return slot;
+}
+
+void profile_site(struct profile* prof, int function, int offset, enum profile_event event) {
+    if (2 * (prof->sites_len + 1) > prof->sites_cap) {
+        size_t cap = prof->sites_cap ? prof->sites_cap * 2 : INITIAL_SITES;
+        struct site* sites = calloc(cap, sizeof(*sites));
+        for (size_t i = 0; i < prof->sites_cap; ++i) {
+            if (prof->sites[i].counts[0] + prof->sites[i].counts[1] + prof->sites[i].counts[2] != 0) {
+                sites[site_slot(sites, cap, prof->sites[i].function, prof->sites[i].offset)] = prof->sites[i];
+            }
+        }
+        free(prof->sites);
+        prof->sites = sites;
+        prof->sites_cap = cap;
+    }
+    struct site* site = &prof->sites[site_slot(prof->sites, prof->sites_cap, function, offset)];
+    if (site->counts[0] + site->counts[1] + site->counts[2] == 0) {
+        site->function = function;
+        site->offset = offset;
+        prof->sites_len++;
+    }
+    site->counts[event]++;
+}
+
+/* Per function, summed up over all call paths */
+struct function_total {
+    int function;
+    unsigned long long calls;
+    unsigned long long self_ns;
+    unsigned long long self_counts[COUNTERS];
+};
+
+static void node_add(struct node* node, struct function_total* total) {
+    total->self_ns += node->self_ns;
+    for (int i = 0; i < COUNTERS; ++i) {
+        total->self_counts[i] += node->self_counts[i];
+    }
+}
+
+static void node_totals(struct node* node, struct function_total* totals) {
+    for (; node; node = node->sibling) {
+        node_add(node, &totals[node->function + 1]);
+        node_totals(node->child, totals);
+    }
+}
+
+static void profile_totals(struct profile* prof, struct function_total* totals) {
+    for (int i = 0; i < 11; ++i) {
+        totals[i] = (struct function_total) {i - 1, i ? prof->calls[i - 1] : 0};
+    }
+    node_add(&prof->root, &totals[0]);
+    node_totals(prof->root.child, totals);
+}
+
+/* Whether the counter got read, and the table has a column for it */
+static int counter_open(struct profile* prof, int counter) {
+    return prof->counters_tried && prof->counter_fds[counter] != -1;
+}
+
+/* Whether the counter also counted at some point, and its column has numbers */
+static int counter_counted(struct profile* prof, int counter) {
+    return counter_open(prof, counter) && prof->counters_running;
+}
+
+static int total_compare(const void* lhs, const void* rhs) {
+    const struct function_total *l = lhs, *r = rhs;
+    return l->self_ns < r->self_ns ? 1 : l->self_ns > r->self_ns ? -1 : l->function - r->function;
+}
+
+static unsigned long long site_total(const struct site* site) {
+    return site->counts[PROFILE_CALLED] + site->counts[PROFILE_TAKEN] + site->counts[PROFILE_NOT_TAKEN];
+}
+
+static int site_compare(const void* lhs, const void* rhs) {
+    const struct site *l = lhs, *r = rhs;
+    unsigned long long lt = site_total(l), rt = site_total(r);
+    if (lt != rt) {
+        return lt < rt ? 1 : -1;
+    }
+    return l->function != r->function ? l->function - r->function : l->offset - r->offset;
+}
+
+/* Used sites sorted by how often they ran, the caller frees them */
+static struct site* profile_sorted_sites(struct profile* prof) {
+    struct site* out = malloc(sizeof(*out) * (prof->sites_len + 1));
+    size_t len = 0;
+    for (size_t i = 0; i < prof->sites_cap; ++i) {
+        if (site_total(&prof->sites[i])) {
+            out[len++] = prof->sites[i];
+        }
+    }
+    qsort(out, len, sizeof(*out), site_compare);
+    return out;
+}
+
+static const char* function_name(int function, char buf[12]) {
+    if (function < 0) {
+        return "toplevel";
+    }
+    snprintf(buf, 12, "%d", function);
+    return buf;
+}
+
+static void report_counters(struct profile* prof, struct function_total* totals, FILE* out) {
+    if (!prof->counters_tried) {
+        return;
+    }
+    if (prof->group_len < COUNTERS) {
+        fprintf(out, "hardware counters: %d of %d available, perf_event_open: %s%s\n", prof->group_len, COUNTERS,
+                strerror(prof->counters_errno),
+                prof->counters_errno == EACCES || prof->counters_errno == EPERM ? " (see /proc/sys/kernel/perf_event_paranoid)" : "");
+    }
+    if (!prof->group_len) {
+        return;
+    }
+    if (!prof->counters_running) {
+        fprintf(out, "hardware counters: never got onto the PMU, other users of it might have taken it\n");
+    } else if (prof->counters_running < prof->counters_enabled) {
+        fprintf(out, "hardware counters: counting %.1f%% of the time, scaled up to estimates\n",
+                100.0 * prof->counters_running / prof->counters_enabled);
+    }
+    fprintf(out, "%16s %16s %6s %14s %14s  function\n", "cycles", "instructions", "IPC", "branch misses", "cache misses");
+    for (int i = 0; i < 11; ++i) {
+        struct function_total* total = &totals[i];
+        if (!total->calls && !total->self_ns) {
+            continue;
+        }
+        for (int counter = 0; counter < COUNTERS; ++counter) {
+            if (counter_counted(prof, counter)) {
+                fprintf(out, counter == 1 ? " %16llu" : counter ? " %14llu" : "%16llu", total->self_counts[counter]);
+            } else {
+                fprintf(out, counter == 1 ? " %16s" : counter ? " %14s" : "%16s", "-");
+            }
+            if (counter == 1) {
+                if (counter_counted(prof, 0) && counter_counted(prof, 1) && total->self_counts[0]) {
+                    fprintf(out, " %6.2f", (double) total->self_counts[1] / total->self_counts[0]);
+                } else {
+                    fprintf(out, " %6s", "-");
+                }
+            }
+        }
+        char buf[12];
+        fprintf(out, "  %s\n", function_name(total->function, buf));
+    }
+}
+
+void profile_report(struct profile* prof, FILE* out) {
+    unsigned long long instructions = 0;
+    /* Most executed first */
+    int order[PROFILE_OPS];
+    for (int i = 0; i < PROFILE_OPS; ++i) {
+        instructions += prof->ops[i];
+        int j = i;
+        for (; j > 0 && prof->ops[order[j - 1]] < prof->ops[i]; --j) {
+            order[j] = order[j - 1];
+        }
+        order[j] = i;
+    }
+    fprintf(out, "profile: %llu instructions\n", instructions);
+    fprintf(out, "%14s %7s %16s  opcode\n", "executed", "%", "limbs");
+    for (int i = 0; i < PROFILE_OPS && prof->ops[order[i]]; ++i) {
+        int op = order[i];
+        fprintf(out, "%14llu %6.2f%% %16llu  %s\n", prof->ops[op], 100.0 * prof->ops[op] / instructions, prof->op_limbs[op], op_names[op]);
+    }
+
+    struct function_total totals[11];
+    profile_totals(prof, totals);
+    unsigned long long total_ns = 0;
+    for (int i = 0; i < 11; ++i) {
+        total_ns += totals[i].self_ns;
+    }
+    qsort(totals, 11, sizeof(*totals), total_compare);
+    fprintf(out, "%14s %12s %7s  function\n", "calls", "self ms", "%");
+    for (int i = 0; i < 11; ++i) {
+        char buf[12];
+        if (totals[i].calls || totals[i].self_ns) {
+            fprintf(out, "%14llu %12.3f %6.2f%%  %s\n", totals[i].calls, totals[i].self_ns / 1e6,
+                    total_ns ? 100.0 * totals[i].self_ns / total_ns : 0, function_name(totals[i].function, buf));
+        }
+    }
+    report_counters(prof, totals, out);
+
+    struct site* sites = profile_sorted_sites(prof);
+    if (prof->sites_len) {
+        fprintf(out, "%14s %14s %14s %7s  site\n", "calls", "taken", "not taken", "taken");
+    }
+    for (size_t i = 0; i < prof->sites_len && i < REPORT_SITES; ++i) {
+        char buf[12];
+        unsigned long long branches = sites[i].counts[PROFILE_TAKEN] + sites[i].counts[PROFILE_NOT_TAKEN];
+        fprintf(out, "%14llu %14llu %14llu", sites[i].counts[PROFILE_CALLED], sites[i].counts[PROFILE_TAKEN], sites[i].counts[PROFILE_NOT_TAKEN]);
+        if (branches) {
+            fprintf(out, " %6.2f%%", 100.0 * sites[i].counts[PROFILE_TAKEN] / branches);
+        } else {
+            fprintf(out, " %7s", "");
+        }
+        fprintf(out, "  %s:%d\n", function_name(sites[i].function, buf), sites[i].offset);
+    }
+    free(sites);
+
+    for (int i = 0; i < LIMB_BUCKETS; ++i) {
+        if (prof->limbs[i]) {
+            fprintf(out, "%14llu arithmetic on numbers of at most %llu limbs\n", prof->limbs[i], 1ull << i);
+        }
+    }
+}
+
+void profile_write_json(struct profile* prof, FILE* out) {
+    fprintf(out, "{\"opcodes\": {");
+    for (int i = 0; i < PROFILE_OPS; ++i) {
+        fprintf(out, "%s\"%s\": {\"executed\": %llu, \"limbs\": %llu}", i ? ", " : "", op_names[i], prof->ops[i], prof->op_limbs[i]);
+    }
+    struct function_total totals[11];
+    profile_totals(prof, totals);
+    fprintf(out, "},\n \"functions\": [");
+    for (int i = 0; i < 11; ++i) {
+        char buf[12];
+        fprintf(out, "%s{\"function\": \"%s\", \"calls\": %llu, \"self_ns\": %llu", i ? ", " : "",
+                function_name(totals[i].function, buf), totals[i].calls, totals[i].self_ns);
+        for (int counter = 0; counter < COUNTERS; ++counter) {
+            if (counter_counted(prof, counter)) {
+                fprintf(out, ", \"%s\": %llu", counter_events[counter].name, totals[i].self_counts[counter]);
+            }
+        }
+        fprintf(out, "}");
+    }
+    fprintf(out, "],\n \"sites\": [");
+    struct site* sites = profile_sorted_sites(prof);
+    for (size_t i = 0; i < prof->sites_len; ++i) {
+        char buf[12];
+        fprintf(out, "%s{\"function\": \"%s\", \"offset\": %d, \"calls\": %llu, \"taken\": %llu, \"not_taken\": %llu}", i ? ",\n   " : "",
+                function_name(sites[i].function, buf), sites[i].offset,
+                sites[i].counts[PROFILE_CALLED], sites[i].counts[PROFILE_TAKEN], sites[i].counts[PROFILE_NOT_TAKEN]);
+    }
+    free(sites);
+    fprintf(out, "],\n \"limbs\": [");
+    int first = 1;
+    for (int i = 0; i < LIMB_BUCKETS; ++i) {
+        if (prof->limbs[i]) {
+            fprintf(out, "%s{\"at_most\": %llu, \"count\": %llu}", first ? "" : ", ", 1ull << i, prof->limbs[i]);
+            first = 0;
+        }
+    }
+    fprintf(out, "]}\n");
+}
+
+static void node_folded(struct node* node, FILE* out) {
+    for (; node; node = node->sibling) {
+        if (node->self_ns / 1000) {
+            /* Root first, so walk up into a buffer */
+            struct node* path[PROFILE_DEPTH + 1];
+            int len = 0;
+            for (struct node* up = node; up; up = up->parent) {
+                path[len++] = up;
+            }
+            for (int i = len - 1; i >= 0; --i) {
+                char buf[12];
+                fprintf(out, "%s%s", function_name(path[i]->function, buf), i ? ";" : "");
+            }
+            fprintf(out, " %llu\n", node->self_ns / 1000);
+        }
+        node_folded(node->child, out);
+    }
+}
+
+void profile_write_folded(struct profile* prof, FILE* out) {
+    if (prof->root.self_ns / 1000) {
+        fprintf(out, "toplevel %llu\n", prof->root.self_ns / 1000);
+    }
+    node_folded(prof->root.child, out);
+}
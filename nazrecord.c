@@ -0,0 +1,187 @@
+/*
+    Copyright (C) 2022 Tobias Heineken
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "nazlib.h"
+
+/* After the magic line every chunk is three LEB128 numbers followed by its bytes:
+ * nanoseconds from the previous chunk until the program asked for this one,
+ * nanoseconds read(2) blocked, and the length. A chunk of length 0 is the end of the input.
+ */
+static const char recording_magic[] = "naz recording 1\n";
+
+struct recording {
+    FILE* log;
+    int fd;          /* -1 when replaying */
+    int real_time;
+    int failed;
+    uint64_t start;
+    uint64_t last;   /* when the previous chunk got delivered, relative to start */
+    /* Replaying: the current chunk and when it is due */
+    char* chunk;
+    size_t chunk_cap;
+    size_t chunk_len;
+    size_t chunk_pos;
+    uint64_t due;
+    int ended;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void put_varint(FILE* out, uint64_t val) {
+    do {
+        unsigned char byte = val & 0x7f;
+        val >>= 7;
+        putc(byte | (val ? 0x80 : 0), out);
+    } while (val);
+}
+
+/* Returns -1 at the end of the file */
+static int get_varint(FILE* in, uint64_t* val) {
+    *val = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = getc(in);
+        if (byte == EOF) {
+            return -1;
+        }
+        *val |= (uint64_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+struct recording* record_open(const char* path, int fd) {
+    FILE* log = fopen(path, "wb");
+    if (!log) {
+        return NULL;
+    }
+    struct recording* out = calloc(1, sizeof(*out));
+    out->log = log;
+    out->fd = fd;
+    out->start = now_ns();
+    fputs(recording_magic, log);
+    return out;
+}
+
+struct recording* replay_open(const char* path, int real_time, const char** error) {
+    FILE* log = fopen(path, "rb");
+    if (!log) {
+        *error = strerror(errno);
+        return NULL;
+    }
+    char magic[sizeof(recording_magic)] = {0};
+    if (fread(magic, 1, sizeof(magic) - 1, log) != sizeof(magic) - 1 || strcmp(magic, recording_magic) != 0) {
+        fclose(log);
+        *error = "Not a recording of the input";
+        return NULL;
+    }
+    struct recording* out = calloc(1, sizeof(*out));
+    out->log = log;
+    out->fd = -1;
+    out->real_time = real_time;
+    out->start = now_ns();
+    return out;
+}
+
+/* Flushed after every chunk, so that a crash or kill keeps everything up to there */
+static size_t record_read(struct recording* r, char* buf, size_t len) {
+    uint64_t asked = now_ns() - r->start;
+    ssize_t n;
+    do {
+        n = read(r->fd, buf, len);
+    } while (n == -1 && errno == EINTR);
+    uint64_t got = now_ns() - r->start;
+    /* Read errors end the input for the program, as they would without recording */
+    if (n < 0) {
+        n = 0;
+    }
+    put_varint(r->log, asked - r->last);
+    put_varint(r->log, got - asked);
+    put_varint(r->log, n);
+    fwrite(buf, 1, n, r->log);
+    if (fflush(r->log) == EOF) {
+        r->failed = 1;
+    }
+    r->last = got;
+    return n;
+}
+
+/* Returns 0 at the end of the log, which ends the input even if the recorded run stopped reading earlier */
+static int replay_next(struct recording* r) {
+    uint64_t gap, wait, len;
+    if (get_varint(r->log, &gap) == -1 || get_varint(r->log, &wait) == -1 || get_varint(r->log, &len) == -1) {
+        return 0;
+    }
+    if (len > r->chunk_cap) {
+        r->chunk_cap = len;
+        r->chunk = realloc(r->chunk, len);
+    }
+    r->chunk_len = fread(r->chunk, 1, len, r->log);
+    r->chunk_pos = 0;
+    r->due += gap + wait;
+    return len == 0 ? 0 : r->chunk_len > 0;
+}
+
+/* The same chunks as recorded, in real time not before they arrived back then */
+static size_t replay_read(struct recording* r, char* buf, size_t len) {
+    if (r->chunk_pos == r->chunk_len) {
+        if (r->ended || !replay_next(r)) {
+            r->ended = 1;
+            return 0;
+        }
+        if (r->real_time) {
+            uint64_t due = r->start + r->due;
+            struct timespec until = {due / 1000000000, due % 1000000000};
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR);
+        }
+    }
+    size_t n = r->chunk_len - r->chunk_pos;
+    if (n > len) {
+        n = len;
+    }
+    memcpy(buf, r->chunk + r->chunk_pos, n);
+    r->chunk_pos += n;
+    return n;
+}
+
+size_t recording_read(void* user, char* buf, size_t len) {
+    struct recording* r = user;
+    return r->fd == -1 ? replay_read(r, buf, len) : record_read(r, buf, len);
+}
+
+int recording_close(struct recording* r) {
+    int failed = r->failed;
+    if (fclose(r->log) == EOF) {
+        failed = 1;
+    }
+    free(r->chunk);
+    free(r);
+    return failed ? -1 : 0;
+}
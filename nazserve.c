@@ -0,0 +1,293 @@
+/*
+    Copyright (C) 2022 Tobias Heineken
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "nazlib.h"
+
+/* Sent by workers through a pipe, pid 0 wakes the server up after a signal */
+struct event {
+    pid_t pid;
+    struct timespec accepted;
+};
+
+struct worker {
+    pid_t pid;
+    int busy;
+    struct timespec accepted;
+};
+
+/* Latencies in buckets of powers of two microseconds */
+#define LATENCY_BUCKETS 40
+
+struct latencies {
+    size_t count;
+    size_t failed;
+    double min;
+    double max;
+    double sum;
+    size_t buckets[LATENCY_BUCKETS];
+};
+
+static volatile sig_atomic_t serve_stop;
+static int serve_events = -1;
+
+static void serve_signal(int sig) {
+    int saved = errno;
+    if (sig != SIGCHLD) {
+        serve_stop = 1;
+    }
+    struct event wakeup = {0};
+    write(serve_events, &wakeup, sizeof(wakeup));
+    errno = saved;
+}
+
+static double seconds_since(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void latencies_add(struct latencies* l, double seconds) {
+    if (l->count == 0 || seconds < l->min) {
+        l->min = seconds;
+    }
+    if (seconds > l->max) {
+        l->max = seconds;
+    }
+    l->sum += seconds;
+    l->count++;
+    int bucket = 0;
+    for (double us = seconds * 1e6; us >= 1 && bucket < LATENCY_BUCKETS - 1; us /= 2) {
+        bucket++;
+    }
+    l->buckets[bucket]++;
+}
+
+/* Upper bound of the bucket the given fraction of all connections falls into, in milliseconds */
+static double latencies_percentile(const struct latencies* l, double fraction) {
+    size_t seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+        seen += l->buckets[i];
+        if (seen >= fraction * l->count) {
+            return (double) (1ull << i) / 1e3;
+        }
+    }
+    return l->max * 1e3;
+}
+
+static void latencies_print(const struct latencies* l, FILE* report) {
+    fprintf(report, "%zu connections, %zu failed", l->count, l->failed);
+    if (l->count > 0) {
+        fprintf(report, ", latency min %.3f ms, avg %.3f ms, max %.3f ms, p50 <= %.3f ms, p90 <= %.3f ms, p99 <= %.3f ms",
+                l->min * 1e3, l->sum / l->count * 1e3, l->max * 1e3,
+                latencies_percentile(l, 0.5), latencies_percentile(l, 0.9), latencies_percentile(l, 0.99));
+    }
+    fprintf(report, "\n");
+}
+
+/* Marks the workers that took a connection since the last call, returns how many */
+static int serve_drain(int events, struct worker* workers, int limit) {
+    int accepted = 0;
+    struct event event;
+    while (read(events, &event, sizeof(event)) == sizeof(event)) {
+        for (int i = 0; i < limit && event.pid; ++i) {
+            if (workers[i].pid == event.pid) {
+                workers[i].busy = 1;
+                workers[i].accepted = event.accepted;
+                accepted++;
+            }
+        }
+    }
+    return accepted;
+}
+
+/* Takes one connection and runs the program on it, like the interpreter on stdin and stdout */
+static _Noreturn void worker_main(struct naz_vm* vm, int listener, int events) {
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    /* Ctrl-C stops the server, connections in progress still finish */
+    signal(SIGINT, SIG_IGN);
+    int fd;
+    while ((fd = accept(listener, NULL, NULL)) == -1 && errno == EINTR) {
+    }
+    if (fd == -1) {
+        /* The server shut the listener down */
+        _exit(EXIT_SUCCESS);
+    }
+    struct event accepted = {getpid()};
+    clock_gettime(CLOCK_MONOTONIC, &accepted.accepted);
+    write(events, &accepted, sizeof(accepted));
+    close(events);
+    close(listener);
+
+    dup2(fd, STDIN_FILENO);
+    dup2(fd, STDOUT_FILENO);
+    close(fd);
+    /* Whatever the server ran into last is no business of the program */
+    errno = 0;
+    enum naz_vm_status status = vm_run(vm, NULL, NULL, NULL);
+    int code = vm_report(vm, status);
+    /* Closing with unread input would reset the connection, so the client sees the end of the output first */
+    fflush(stdout);
+    shutdown(STDOUT_FILENO, SHUT_WR);
+    char rest[4096];
+    while (read(STDIN_FILENO, rest, sizeof(rest)) > 0) {
+    }
+    exit(code);
+}
+
+static int serve_listen(const char* path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    /* A socket left behind by an earlier server, anything else stays */
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1 || listen(fd, SOMAXCONN) == -1) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+int serve_run(struct naz_vm* vm, const char* path, int prefork, int limit, FILE* report) {
+    int listener = serve_listen(path);
+    if (listener == -1) {
+        fprintf(report, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    int events[2];
+    if (pipe(events) == -1 || fcntl(events[0], F_SETFL, O_NONBLOCK) == -1) {
+        fprintf(report, "pipe: %s\n", strerror(errno));
+        close(listener);
+        unlink(path);
+        return -1;
+    }
+    /* Everything the workers can share copy-on-write is done once, here */
+    vm_warm(vm);
+
+    serve_events = events[1];
+    serve_stop = 0;
+    struct sigaction action = {.sa_handler = serve_signal};
+    struct sigaction old_int, old_term, old_chld;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, &old_int);
+    sigaction(SIGTERM, &action, &old_term);
+    sigaction(SIGCHLD, &action, &old_chld);
+
+    struct worker* workers = calloc(limit, sizeof(*workers));
+    int running = 0, idle = 0;
+    struct latencies latencies = {0};
+    for (;;) {
+        while (!serve_stop && idle < prefork && running < limit) {
+            /* Nothing buffered may end up in the output of a worker */
+            fflush(NULL);
+            pid_t pid = fork();
+            if (pid == 0) {
+                close(events[0]);
+                worker_main(vm, listener, events[1]);
+            }
+            if (pid == -1) {
+                fprintf(report, "fork: %s\n", strerror(errno));
+                if (running == 0) {
+                    serve_stop = 1;
+                }
+                break;
+            }
+            int slot = 0;
+            while (workers[slot].pid) {
+                slot++;
+            }
+            workers[slot] = (struct worker) {pid, 0};
+            running++;
+            idle++;
+        }
+        if (serve_stop && running == 0) {
+            break;
+        }
+
+        struct pollfd ready = {events[0], POLLIN};
+        poll(&ready, 1, -1);
+        idle -= serve_drain(events[0], workers, limit);
+        if (serve_stop) {
+            /* Wakes up every worker still waiting in accept() */
+            shutdown(listener, SHUT_RDWR);
+        }
+
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            /* Whatever it sent before exiting is in the pipe by now */
+            idle -= serve_drain(events[0], workers, limit);
+            for (int i = 0; i < limit; ++i) {
+                if (workers[i].pid != pid) {
+                    continue;
+                }
+                if (workers[i].busy) {
+                    int code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+                    double seconds = seconds_since(&workers[i].accepted);
+                    latencies_add(&latencies, seconds);
+                    if (code != EXIT_SUCCESS) {
+                        latencies.failed++;
+                    }
+                    fprintf(report, "connection %zu: exit %d, %.3f ms\n", latencies.count, code, seconds * 1e3);
+                } else {
+                    idle--;
+                }
+                workers[i].pid = 0;
+                running--;
+            }
+        }
+        fflush(report);
+    }
+    latencies_print(&latencies, report);
+
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGTERM, &old_term, NULL);
+    sigaction(SIGCHLD, &old_chld, NULL);
+    serve_events = -1;
+    close(events[0]);
+    close(events[1]);
+    close(listener);
+    unlink(path);
+    free(workers);
+    return 0;
+}
@@ -0,0 +1,254 @@
+/*
+    Copyright (C) 2022 Tobias Heineken
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdlib.h>
+#include "nazlib.h"
+
+/* In limited mode every value is within -128..255:
+ * -127..127 from arithmetic, -128 for undefined variables and -1..255 from Nr.
+ */
+#define VALUE_MIN (-128)
+#define VALUE_COUNT 384
+
+/* Tables are filled lazily, so this only bounds the worst case */
+#define MAX_ENTRIES (VALUE_COUNT * VALUE_COUNT)
+
+/* Evaluations running longer than this are left to the interpreter */
+#define MAX_STEPS (1 << 20)
+#define MAX_DEPTH 4096
+
+enum entry_state {
+    ENTRY_UNKNOWN = 0,
+    ENTRY_DONE,
+    /* dies, divides by zero or takes too long: interpret it */
+    ENTRY_INTERPRET,
+};
+
+struct summary {
+    int usable;
+    /* functions that can be executed when calling this one, including itself */
+    int reachable;
+    int reads[10];
+    int reads_len;
+    int writes[10];
+    int writes_len;
+
+    size_t entries;
+    unsigned char* state;
+    /* per entry: the accumulator, then every variable in writes */
+    short* results;
+    /* per entry: which of writes actually got written */
+    unsigned short* written;
+};
+
+struct summaries {
+    struct naz_program* prog;
+    struct summary functions[10];
+};
+
+struct summaries* summaries_new(struct naz_program* prog) {
+    struct summaries* out = calloc(1, sizeof(*out));
+    out->prog = prog;
+    if (prog->dynamic) {
+        /* Function bodies are not known ahead of time */
+        return out;
+    }
+    for (int i = 0; i < 10; ++i) {
+        struct summary* sum = &out->functions[i];
+        int reads = 0, writes = 0;
+        if (!program_function_effects(prog, i, &sum->reachable, &reads, &writes)) {
+            continue;
+        }
+        size_t entries = VALUE_COUNT;
+        for (int var = 0; var < 10; ++var) {
+            if (reads & (1 << var)) {
+                sum->reads[sum->reads_len++] = var;
+                entries *= VALUE_COUNT;
+                if (entries > MAX_ENTRIES) {
+                    break;
+                }
+            }
+            if (writes & (1 << var)) {
+                sum->writes[sum->writes_len++] = var;
+            }
+        }
+        if (entries > MAX_ENTRIES) {
+            continue;
+        }
+        sum->entries = entries;
+        sum->usable = 1;
+    }
+    return out;
+}
+
+struct frame {
+    int function;
+    int op;
+};
+
+/* Runs a pure function the way the interpreter would, returns the new entry state */
+static enum entry_state evaluate(struct naz_program* prog, int function, long long* acc, long long vars[10], unsigned* written) {
+    struct frame stack[MAX_DEPTH];
+    int depth = 0;
+    struct frame cur = {function, 0};
+    for (long steps = 0; steps < MAX_STEPS; ++steps) {
+        struct naz_block* block = &prog->functions[cur.function];
+        if (cur.op == block->len) {
+            if (depth == 0) {
+                return ENTRY_DONE;
+            }
+            cur = stack[--depth];
+            continue;
+        }
+        struct naz_op* op = &block->ops[cur.op++];
+        long long res;
+        switch (op->code) {
+            case NAZ_OP_ADD:
+                res = *acc + op->arg;
+                if (res < -127 || res > 127)
+                    return ENTRY_INTERPRET;
+                *acc = res;
+                break;
+            case NAZ_OP_MULTIPLY:
+                res = *acc * op->arg;
+                if (res < -127 || res > 127)
+                    return ENTRY_INTERPRET;
+                *acc = res;
+                break;
+            case NAZ_OP_DIVIDE:
+                if (op->arg == 0)
+                    return ENTRY_INTERPRET;
+                if ((*acc < 0) == (op->arg < 0)) {
+                    *acc = *acc / op->arg;
+                } else {
+                    int rem = *acc % op->arg;
+                    *acc = *acc / op->arg - (rem != 0);
+                }
+                break;
+            case NAZ_OP_REMAINDER:
+                if (op->arg == 0)
+                    return ENTRY_INTERPRET;
+                *acc %= op->arg;
+                break;
+            case NAZ_OP_LOAD:
+                *acc = vars[op->arg];
+                break;
+            case NAZ_OP_STORE:
+                vars[op->arg] = *acc;
+                *written |= 1 << op->arg;
+                break;
+            case NAZ_OP_NEGATE:
+                res = -vars[op->arg];
+                if (res < -127 || res > 127)
+                    return ENTRY_INTERPRET;
+                vars[op->arg] = res;
+                *written |= 1 << op->arg;
+                break;
+            case NAZ_OP_CALL:
+                if (!op->tail) {
+                    if (depth == MAX_DEPTH)
+                        return ENTRY_INTERPRET;
+                    stack[depth++] = cur;
+                }
+                cur.function = op->arg;
+                cur.op = 0;
+                break;
+            case NAZ_OP_BRANCH: {
+                long long cmp = *acc - vars[op->arg];
+                if ((cmp == 0 && op->cond == 'e') || (cmp < 0 && op->cond == 'l') || (cmp > 0 && op->cond == 'g')) {
+                    /* Inside of functions, a jump replaces the current one */
+                    cur.function = op->target;
+                    cur.op = 0;
+                }
+                break;
+            }
+            default:
+                /* DIE, everything else is excluded by analyse() */
+                return ENTRY_INTERPRET;
+        }
+    }
+    return ENTRY_INTERPRET;
+}
+
+int summaries_apply(struct summaries* sums, int function) {
+    if (function < 0 || function > 9 || !sums->functions[function].usable) {
+        return 0;
+    }
+    struct summary* sum = &sums->functions[function];
+    for (int i = 0; i < 10; ++i) {
+        if ((sum->reachable & (1 << i)) && !function_get(i)) {
+            /* Calling it would die */
+            return 0;
+        }
+    }
+
+    long long acc = accumulator_value();
+    /* Variables that are not read can't influence the result */
+    long long vars[10] = {VALUE_MIN, VALUE_MIN, VALUE_MIN, VALUE_MIN, VALUE_MIN, VALUE_MIN, VALUE_MIN, VALUE_MIN, VALUE_MIN, VALUE_MIN};
+    size_t index = acc - VALUE_MIN;
+    if (acc < VALUE_MIN || index >= VALUE_COUNT) {
+        return 0;
+    }
+    for (int i = 0; i < sum->reads_len; ++i) {
+        vars[sum->reads[i]] = variable_value(sum->reads[i]);
+        size_t digit = vars[sum->reads[i]] - VALUE_MIN;
+        if (vars[sum->reads[i]] < VALUE_MIN || digit >= VALUE_COUNT) {
+            return 0;
+        }
+        index = index * VALUE_COUNT + digit;
+    }
+
+    if (!sum->state) {
+        sum->state = calloc(sum->entries, sizeof(*sum->state));
+        sum->results = malloc(sizeof(*sum->results) * sum->entries * (1 + sum->writes_len));
+        sum->written = malloc(sizeof(*sum->written) * sum->entries);
+    }
+    short* result = sum->results + index * (1 + sum->writes_len);
+    if (sum->state[index] == ENTRY_UNKNOWN) {
+        unsigned written = 0;
+        sum->state[index] = evaluate(sums->prog, function, &acc, vars, &written);
+        result[0] = acc;
+        sum->written[index] = 0;
+        for (int i = 0; i < sum->writes_len; ++i) {
+            result[1 + i] = vars[sum->writes[i]];
+            if (written & (1 << sum->writes[i])) {
+                sum->written[index] |= 1 << i;
+            }
+        }
+    }
+    if (sum->state[index] != ENTRY_DONE) {
+        return 0;
+    }
+
+    accumulator_set(number_from(result[0]));
+    for (int i = 0; i < sum->writes_len; ++i) {
+        if (sum->written[index] & (1 << i)) {
+            variable_set(sum->writes[i], number_from(result[1 + i]));
+        }
+    }
+    return 1;
+}
+
+void summaries_destroy(struct summaries* sums) {
+    for (int i = 0; i < 10; ++i) {
+        free(sums->functions[i].state);
+        free(sums->functions[i].results);
+        free(sums->functions[i].written);
+    }
+    free(sums);
+}
@@ -0,0 +1,93 @@
+/*
+    Copyright (C) 2022 Tobias Heineken
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nazlib.h"
+
+/* Entries written in one go */
+#define TRACE_BUFFER 4096
+
+struct trace {
+    FILE* out;
+    struct trace_filter filter;
+    char ops[256];
+    uint32_t skipped;
+    int failed;
+    size_t len;
+    struct naz_trace_entry entries[TRACE_BUFFER];
+};
+
+struct trace* trace_open(const char* path, const struct trace_filter* filter) {
+    FILE* out = fopen(path, "wb");
+    if (!out) {
+        return NULL;
+    }
+    struct trace* trace = calloc(1, sizeof(*trace));
+    trace->out = out;
+    trace->filter = *filter;
+    for (const char* op = filter->ops; op && *op; ++op) {
+        trace->ops[(unsigned char) *op] = 1;
+    }
+    fputs(NAZ_TRACE_MAGIC, out);
+    return trace;
+}
+
+static void trace_flush(struct trace* trace) {
+    if (fwrite(trace->entries, sizeof(trace->entries[0]), trace->len, trace->out) != trace->len) {
+        trace->failed = 1;
+    }
+    trace->len = 0;
+}
+
+void trace_record(struct trace* trace, int function, int offset, const char* op, int acc, int depth) {
+    const struct trace_filter* filter = &trace->filter;
+    if ((filter->ops && !trace->ops[(unsigned char) op[1]])
+            || (filter->functions && !(filter->functions & (1u << (function + 1))))
+            || offset < filter->from || (filter->to >= 0 && offset > filter->to)) {
+        /* Saturates instead of wrapping around, the decoder says so */
+        if (trace->skipped != UINT32_MAX) {
+            trace->skipped++;
+        }
+        return;
+    }
+    trace->entries[trace->len++] = (struct naz_trace_entry) {
+        .skipped = trace->skipped,
+        .offset = offset,
+        .acc = acc,
+        .function = function,
+        .digit = op[0],
+        .opcode = op[1],
+        .depth = depth > UINT8_MAX ? UINT8_MAX : depth,
+    };
+    trace->skipped = 0;
+    if (trace->len == TRACE_BUFFER) {
+        trace_flush(trace);
+    }
+}
+
+int trace_close(struct trace* trace) {
+    trace_flush(trace);
+    int failed = trace->failed;
+    if (fclose(trace->out) == EOF) {
+        failed = 1;
+    }
+    free(trace);
+    return failed ? -1 : 0;
+}
@@ -0,0 +1,1733 @@
+/*
+    Copyright (C) 2022 Tobias Heineken
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+/* fopencookie() */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "nazlib.h"
+
+/* Frames of execute_verified(), the one currently executed is not part of them */
+struct frame {
+    int function;   /* -1 for the toplevel, -2 for memo markers */
+    int op;         /* index of the op to continue with */
+    int offset;     /* the same position in the code, for the callstack */
+};
+
+/* Frames of a saved state the cycle detection compares, and function entries it reports */
+#define CYCLE_FRAMES 32
+#define CYCLE_PATH 32
+/* Only every so many function entries get looked at, until the first hit */
+#define CYCLE_STRIDE 16
+/* Instructions the flight recorder keeps, a power of two */
+#define FLIGHT_LEN 64
+
+/* One executed instruction, with the accumulator it found. The opcode is looked up when dumping */
+struct flight_entry {
+    int function;
+    int offset;
+    int acc;        /* number_fingerprint() */
+};
+
+/* Everything but the callstack that decides what a limited program does after entering a function,
+ * as long as it neither reads, prints nor defines anything
+ */
+struct cycle_state {
+    int function;
+    int depth;
+    long long acc;
+    long long vars[10];
+};
+
+struct naz_vm {
+    struct naz_vm_options options;
+    struct naz_state* state;
+    /* NULL for stdout */
+    FILE* output;
+
+    char* code;
+    struct naz_program* prog;
+    /* code and prog belong to the machine this one got cloned from */
+    int shared;
+    int verified;
+    struct callstack* cs;
+    /* Popped from the callstack by execute(), freed by vm_run() if it dies */
+    struct instruction_pointer* executing;
+    struct naz_jit* jit;
+    struct summaries* summaries;
+    struct memo* memo;
+    struct loops* loops;
+    struct folds* folds;
+    /* -p, NULL without it */
+    struct profile* profile;
+
+    struct frame* frames;
+    int frames_len;
+    int frames_cap;
+    int verified_running;
+
+    /* Only >= 0 while evaluating the input independent prefix, see evaluate_prefix() */
+    long long prefix_budget;
+    jmp_buf prefix_abort;
+    /* Evaluated by the first run, NULL if the program died within it */
+    int prefix_done;
+    struct snapshot* prefix;
+
+    /* Set by vm_request_checkpoint(), possibly from a signal handler */
+    volatile sig_atomic_t checkpoint_requested;
+    /* The process writing the last checkpoint, 0 if there is none */
+    pid_t checkpoint_writer;
+    /* Callstack of a restored checkpoint, the next run continues there */
+    struct callstack* resume;
+
+    /* Instructions of this run, the governor looks at the budgets once they reach next_check */
+    long long steps;
+    long long next_check;
+    struct timespec started;
+
+    /* Set by vm_request_stats(), possibly from a signal handler */
+    volatile sig_atomic_t stats_requested;
+    /* The last snapshot, for the rate since then */
+    long long stats_steps;
+    struct timespec stats_time;
+    struct timespec metrics_time;
+
+    /* Brent's cycle detection on the states at function entries, see cycle_enter() */
+    int cycle_check;
+    long long cycle_power;      /* 0 if there is no saved state */
+    long long cycle_lambda;     /* entries since it got saved */
+    int cycle_low;              /* lowest depth since then, the frames below did not change */
+    struct cycle_state cycle_saved;
+    struct frame cycle_frames[CYCLE_FRAMES];    /* topmost frames of the saved state, the topmost last */
+    unsigned long long cycle_entries;
+    int cycle_path[CYCLE_PATH];
+    long long cycle_stride;
+    long long cycle_countdown;  /* entries until the next look, LLONG_MAX without the check */
+
+    /* The last instructions of this run, for post-mortems, see flight_record() */
+    struct flight_entry flight[FLIGHT_LEN];
+    unsigned long long flight_pos;
+
+    int runs;
+    jmp_buf abort;
+    enum naz_vm_status status;
+    char error[256];
+    int error_errno;
+    naz_read_fn read;
+    naz_write_fn write;
+    void* user;
+};
+
+/* The machine die() belongs to */
+static __thread struct naz_vm* running;
+
+static void vis_ip(struct instruction_pointer* arg) {
+    if (instruction_pointer_is_marker(arg)) {
+        return;
+    }
+    if (instruction_pointer_is_in_function(arg)) {
+        printf("%d:%d\n", instruction_pointer_function_number(arg), instruction_pointer_offset(arg));
+    } else {
+        printf("Toplevel:%d\n", instruction_pointer_offset(arg));
+    }
+}
+
+static void debug(struct naz_vm* vm) {
+    for(int i=0; i < 10; ++i){
+        printf("Function %d: %s\n", i, function_get(i));
+    }
+    for(int i=0; i< 10; ++i){
+        printf("Var %d:", i);
+        struct number* tmp = variable_get(i);
+        number_print_dbg(tmp);
+        number_destroy(tmp);
+        printf("\n");
+    }
+    debug_io_state();
+
+    printf("Acc: ");
+    struct number* tmp = accumulator_get();
+    number_print_dbg(tmp);
+    number_destroy(tmp);
+    printf("\nCallstack:\n");
+    callstack_iterate(vm->cs,vis_ip);
+}
+
+static void frames_push(struct naz_vm* vm, int function, int op, int offset) {
+    if (vm->frames_len == vm->frames_cap) {
+        vm->frames_cap = vm->frames_cap ? vm->frames_cap * 2 : 64;
+        vm->frames = realloc(vm->frames, sizeof(*vm->frames) * vm->frames_cap);
+    }
+    vm->frames[vm->frames_len++] = (struct frame) {function, op, offset};
+}
+
+/* Makes the callstack look like execute() would have left it */
+static void frames_sync(struct naz_vm* vm) {
+    callstack_destroy(vm->cs);
+    vm->cs = callstack_new_empty();
+    for (int i = 0; i < vm->frames_len; ++i) {
+        if (vm->frames[i].function == -2) {
+            callstack_push(vm->cs, instruction_pointer_marker());
+        } else {
+            callstack_push(vm->cs, instruction_pointer_from_function(vm->frames[i].function, vm->frames[i].offset));
+        }
+    }
+}
+
+static _Noreturn void vm_fail(enum naz_vm_status status, const char msg[]) {
+    struct naz_vm* vm = running;
+    if (!vm) {
+        /* Only possible when using nazlib outside of vm_run() */
+        perror(msg);
+        exit(EXIT_FAILURE);
+    }
+    if (vm->prefix_budget >= 0) {
+        longjmp(vm->prefix_abort, 1);
+    }
+    if (vm->jit) {
+        jit_sync(vm->jit, vm->cs);
+    }
+    if (vm->verified_running) {
+        frames_sync(vm);
+    }
+    vm->error_errno = errno;
+    vm->status = status;
+    snprintf(vm->error, sizeof(vm->error), "%s", msg);
+    if (vm->jit) {
+        /* Back on the stack of vm_run() first, the fortified longjmp() refuses to leave the one of the code */
+        jit_leave(vm->jit);
+    }
+    longjmp(vm->abort, 1);
+}
+
+const char naz_halt_message[] = "Halt for debugging";
+
+_Noreturn void die(const char msg[]) {
+    if (msg == naz_memory_budget_message) {
+        vm_fail(NAZ_VM_OVER_BUDGET, msg);
+    }
+    vm_fail(msg == naz_halt_message ? NAZ_VM_HALTED : NAZ_VM_DIED, msg);
+}
+
+_Noreturn void die_over_budget(const char msg[]) {
+    vm_fail(NAZ_VM_OVER_BUDGET, msg);
+}
+
+/* Instructions between two looks at the clock */
+#define GOVERNOR_INTERVAL 65536
+
+/* Runs for every instruction, so it neither branches nor allocates */
+static inline void flight_record(struct naz_vm* vm, int function, int offset, int acc) {
+    vm->flight[vm->flight_pos++ % FLIGHT_LEN] = (struct flight_entry) {function, offset, acc};
+}
+
+/* Whether the governor has to look at the clock and for snapshots every now and then */
+static int governor_ticking(struct naz_vm* vm) {
+    return vm->options.max_seconds > 0 || vm->options.stats || vm->options.metrics;
+}
+
+static void governor_arm(struct naz_vm* vm) {
+    long long next = vm->options.max_steps > 0 ? vm->options.max_steps : LLONG_MAX;
+    if (governor_ticking(vm) && vm->steps + GOVERNOR_INTERVAL < next) {
+        next = vm->steps + GOVERNOR_INTERVAL;
+    }
+    vm->next_check = next;
+}
+
+static double seconds_between(const struct timespec* from, const struct timespec* to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+/* The innermost position on the callstack, function -1 for the toplevel */
+static void vm_position(struct naz_vm* vm, int* function, int* offset) {
+    *function = -1;
+    *offset = 0;
+    if (vm->verified_running) {
+        for (int i = vm->frames_len - 1; i >= 0; --i) {
+            if (vm->frames[i].function != -2) {
+                *function = vm->frames[i].function;
+                *offset = vm->frames[i].offset;
+                return;
+            }
+        }
+        return;
+    }
+    /* At most one memo marker on top of it */
+    struct instruction_pointer* top[2];
+    int n = callstack_top(vm->cs, top, 2);
+    for (int i = 0; i < n; ++i) {
+        if (!instruction_pointer_is_marker(top[i])) {
+            *function = instruction_pointer_is_in_function(top[i]) ? instruction_pointer_function_number(top[i]) : -1;
+            *offset = instruction_pointer_offset(top[i]);
+            return;
+        }
+    }
+}
+
+static int vm_depth(struct naz_vm* vm) {
+    return vm->verified_running ? vm->frames_len : callstack_depth(vm->cs);
+}
+
+static void stats_write(struct naz_vm* vm, const struct timespec* now) {
+    FILE* out = vm->options.stats_file ? fopen(vm->options.stats_file, "a") : stderr;
+    if (!out) {
+        perror(vm->options.stats_file);
+        return;
+    }
+    double total = seconds_between(&vm->started, now);
+    double recent = seconds_between(&vm->stats_time, now);
+    fprintf(out, "stats: %lld instructions in %.3fs, %.0f/s, %.0f/s since the last snapshot\n",
+            vm->steps, total, total > 0 ? vm->steps / total : 0, recent > 0 ? (vm->steps - vm->stats_steps) / recent : 0);
+    int function, offset;
+    vm_position(vm, &function, &offset);
+    if (function >= 0) {
+        fprintf(out, "stats: depth %d, at %d:%d\n", vm_depth(vm), function, offset);
+    } else {
+        fprintf(out, "stats: depth %d, at Toplevel:%d\n", vm_depth(vm), offset);
+    }
+    fprintf(out, "stats: limbs of the accumulator %zu, of the variables", accumulator_limbs());
+    for (int i = 0; i < 10; ++i) {
+        fprintf(out, " %zu", variable_limbs(i));
+    }
+    fprintf(out, "\nstats: read %llu bytes, wrote %llu bytes, -u numbers take %zu bytes, at most %zu\n",
+            naz_bytes_read(), naz_bytes_written(), naz_memory_used(), naz_memory_peak());
+    if (out != stderr) {
+        fclose(out);
+    }
+    vm->stats_steps = vm->steps;
+    vm->stats_time = *now;
+}
+
+static void metric(FILE* out, const char* name, const char* type, const char* help) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/* Written next to the file and renamed over it, so that it never gets read half way */
+static void metrics_write(struct naz_vm* vm, const struct timespec* now) {
+    vm->metrics_time = *now;
+    char tmp[strlen(vm->options.metrics) + 5];
+    sprintf(tmp, "%s.tmp", vm->options.metrics);
+    FILE* out = fopen(tmp, "w");
+    if (!out) {
+        perror(tmp);
+        return;
+    }
+    metric(out, "naz_instructions_total", "counter", "Instructions executed by the current run.");
+    fprintf(out, "naz_instructions_total %lld\n", vm->steps);
+    metric(out, "naz_run_seconds", "gauge", "Time since the current run started.");
+    fprintf(out, "naz_run_seconds %.3f\n", seconds_between(&vm->started, now));
+    metric(out, "naz_callstack_depth", "gauge", "Entries on the callstack.");
+    fprintf(out, "naz_callstack_depth %d\n", vm_depth(vm));
+    int function, offset;
+    vm_position(vm, &function, &offset);
+    metric(out, "naz_position", "gauge", "Function and offset the program is at, always 1.");
+    if (function >= 0) {
+        fprintf(out, "naz_position{function=\"%d\",offset=\"%d\"} 1\n", function, offset);
+    } else {
+        fprintf(out, "naz_position{function=\"toplevel\",offset=\"%d\"} 1\n", offset);
+    }
+    metric(out, "naz_limbs", "gauge", "Limbs of the accumulator and the variables, 1 in limited mode.");
+    fprintf(out, "naz_limbs{number=\"accumulator\"} %zu\n", accumulator_limbs());
+    for (int i = 0; i < 10; ++i) {
+        fprintf(out, "naz_limbs{number=\"%d\"} %zu\n", i, variable_limbs(i));
+    }
+    metric(out, "naz_read_bytes_total", "counter", "Bytes taken from the input.");
+    fprintf(out, "naz_read_bytes_total %llu\n", naz_bytes_read());
+    metric(out, "naz_written_bytes_total", "counter", "Bytes printed.");
+    fprintf(out, "naz_written_bytes_total %llu\n", naz_bytes_written());
+    metric(out, "naz_number_bytes", "gauge", "Memory taken by the limbs of all -u numbers.");
+    fprintf(out, "naz_number_bytes %zu\n", naz_memory_used());
+    metric(out, "naz_number_peak_bytes", "gauge", "The most naz_number_bytes got.");
+    fprintf(out, "naz_number_peak_bytes %zu\n", naz_memory_peak());
+    if (fclose(out) == EOF || rename(tmp, vm->options.metrics) == -1) {
+        perror(vm->options.metrics);
+    }
+}
+
+/* Only called at calls and jumps, once steps reached next_check */
+static void vm_govern(struct naz_vm* vm) {
+    if (vm->prefix_budget >= 0) {
+        /* The prefix has a limit of its own, the run starts counting after it */
+        vm->next_check = LLONG_MAX;
+        return;
+    }
+    if (vm->options.max_steps > 0 && vm->steps >= vm->options.max_steps) {
+        die_over_budget("Instruction budget exceeded");
+    }
+    if (governor_ticking(vm)) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (vm->options.max_seconds > 0 && seconds_between(&vm->started, &now) > vm->options.max_seconds) {
+            die_over_budget("Time budget exceeded");
+        }
+        if (vm->stats_requested) {
+            vm->stats_requested = 0;
+            stats_write(vm, &now);
+        }
+        if (vm->options.metrics && seconds_between(&vm->metrics_time, &now) >= vm->options.metrics_every) {
+            metrics_write(vm, &now);
+        }
+    }
+    governor_arm(vm);
+}
+
+/* Input, output and definitions make progress */
+static inline void cycle_reset(struct naz_vm* vm) {
+    vm->cycle_power = 0;
+}
+
+static void cycle_arm(struct naz_vm* vm) {
+    vm->cycle_stride = CYCLE_STRIDE;
+    vm->cycle_countdown = vm->cycle_check ? CYCLE_STRIDE : LLONG_MAX;
+    cycle_reset(vm);
+}
+
+static inline void cycle_popped(struct naz_vm* vm, int depth) {
+    if (depth < vm->cycle_low) {
+        vm->cycle_low = depth;
+    }
+}
+
+/* Positions of count frames starting at depth from, the topmost last */
+static void cycle_frames_get(struct naz_vm* vm, int from, int count, struct frame* out) {
+    if (vm->verified_running) {
+        memcpy(out, vm->frames + from, sizeof(*out) * count);
+        return;
+    }
+    struct instruction_pointer* top[CYCLE_FRAMES];
+    int depth = callstack_depth(vm->cs);
+    callstack_top(vm->cs, top, depth - from);
+    for (int i = 0; i < count; ++i) {
+        struct instruction_pointer* ip = top[depth - 1 - (from + i)];
+        out[i] = (struct frame) {instruction_pointer_function_number(ip), 0, instruction_pointer_offset(ip)};
+    }
+}
+
+/* Only the frames above the lowest depth since saving can differ, if there are too many of them this says no */
+static int cycle_same_frames(struct naz_vm* vm) {
+    int depth = vm->cycle_saved.depth;
+    int count = depth - vm->cycle_low;
+    if (count > CYCLE_FRAMES) {
+        return 0;
+    }
+    struct frame now[CYCLE_FRAMES];
+    cycle_frames_get(vm, vm->cycle_low, count, now);
+    struct frame* saved = vm->cycle_frames + (depth < CYCLE_FRAMES ? depth : CYCLE_FRAMES) - count;
+    for (int i = 0; i < count; ++i) {
+        if (now[i].function != saved[i].function || now[i].offset != saved[i].offset) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void cycle_save(struct naz_vm* vm, int function, int depth, long long acc, const long long* vars) {
+    vm->cycle_saved = (struct cycle_state) {function, depth, acc};
+    memcpy(vm->cycle_saved.vars, vars, sizeof(vm->cycle_saved.vars));
+    vm->cycle_low = depth;
+    int count = depth < CYCLE_FRAMES ? depth : CYCLE_FRAMES;
+    cycle_frames_get(vm, depth - count, count, vm->cycle_frames);
+    /* Saved again after 1, 2, 4, ... entries, so any cycle gets caught within twice its length */
+    vm->cycle_power = vm->cycle_power ? vm->cycle_power * 2 : 1;
+    vm->cycle_lambda = 0;
+}
+
+/* Called once the countdown of function entries ran out, returns 1 if the program entered it in the very
+ * same state before. Then it loops forever, as the state decides everything it does until the next input or output.
+ * A hit among the sampled entries is just as certain, but only looking at all of them tells the round to report.
+ */
+static int cycle_enter(struct naz_vm* vm, int function, int depth, long long acc, const long long* vars) {
+    vm->cycle_countdown = vm->cycle_stride;
+    vm->cycle_path[vm->cycle_entries++ % CYCLE_PATH] = function;
+    if (vm->cycle_power) {
+        vm->cycle_lambda++;
+        struct cycle_state* saved = &vm->cycle_saved;
+        if (function == saved->function && depth == saved->depth && acc == saved->acc
+                && memcmp(vars, saved->vars, sizeof(saved->vars)) == 0 && cycle_same_frames(vm)) {
+            if (vm->cycle_stride == 1) {
+                return 1;
+            }
+            vm->cycle_stride = vm->cycle_countdown = 1;
+            vm->cycle_entries = 0;
+            cycle_reset(vm);
+            return 0;
+        }
+        if (vm->cycle_lambda < vm->cycle_power) {
+            return 0;
+        }
+    }
+    cycle_save(vm, function, depth, acc, vars);
+    return 0;
+}
+
+/* Reports the functions entered during one round of the cycle */
+static _Noreturn void die_cycle(struct naz_vm* vm) {
+    char msg[256];
+    int len = snprintf(msg, sizeof(msg), "Endless loop without input or output, calling");
+    long long shown = vm->cycle_lambda + 1 < CYCLE_PATH ? vm->cycle_lambda + 1 : CYCLE_PATH;
+    if (shown <= vm->cycle_lambda) {
+        len += snprintf(msg + len, sizeof(msg) - len, " ... ->");
+    }
+    for (unsigned long long i = vm->cycle_entries - shown; i < vm->cycle_entries; ++i) {
+        len += snprintf(msg + len, sizeof(msg) - len, i + 1 < vm->cycle_entries ? " %d ->" : " %d", vm->cycle_path[i % CYCLE_PATH]);
+    }
+    snprintf(msg + len, sizeof(msg) - len, " over and over (%lld %s per round)", vm->cycle_lambda, vm->cycle_lambda == 1 ? "call" : "calls");
+    vm_fail(NAZ_VM_LOOPING, msg);
+}
+
+_Noreturn void die_redefined(int function) {
+    char msg[64];
+    snprintf(msg, sizeof(msg), "Redefining function %d, aborting", function);
+    vm_fail(NAZ_VM_REDEFINED, msg);
+}
+
+_Noreturn void die_divided_by_zero() {
+    vm_fail(NAZ_VM_DIVIDED_BY_ZERO, "Division by zero");
+}
+
+/* Inlined into both instances of execute_checked(), prof is NULL for the one without -p */
+static inline __attribute__((always_inline)) void opcodes(struct naz_vm* vm, const char* pos, struct profile* prof) {
+    int extra_offset;
+    switch(*pos) {
+        case '0': {
+                      extra_offset = 2;
+                      goto offset_manipulation;
+                  }
+        case '1': {
+                      if (pos[3] != 'f') {
+                          die("Using 1x without following it with Xf");
+                      }
+                      int idx = pos[2] - '0';
+
+                      if (idx < 0 || idx > 9) {
+                          die("invalid number of 1xXf");
+                      }
+                      if (function_set(idx, pos + 4) == -1) {
+                          die_redefined(idx);
+                      }
+                      cycle_reset(vm);
+                      for(extra_offset = 4; pos[extra_offset] != '\n' && pos[extra_offset] != '\0'; extra_offset += 2) {
+                          if (pos[extra_offset] == ' ') {
+                              extra_offset--;
+                              continue;
+                          }
+                          if (pos[extra_offset] == '0' && pos[extra_offset + 1] == 'x') {
+                              extra_offset += 2;
+                              break;
+                          }
+                      }
+                      goto offset_manipulation;
+                  }
+        case '2': {
+                      if (pos[3] != 'v') {
+                          die("Using 2x without following it with Xv");
+                      }
+                      int idx = pos[2] - '0';
+                      if (idx < 0 || idx > 9) {
+                          die("invalid number of 2xXv");
+                      }
+                      variable_set(idx, accumulator_get());
+                      extra_offset = 4;
+                      goto offset_manipulation;
+                  }
+        case '3': {
+                      if (pos[3] != 'v') {
+                          die("Using 3x without following it with Xv");
+                      }
+                      if (pos[5] != 'l' && pos[5] != 'e' && pos[5] != 'g') {
+                          die("Using 3x without following it with Xl, Xg or Xe after Yv");
+                      }
+                      int var = pos[2] - '0';
+                      int fun = pos[4] - '0';
+
+                      struct number* acc = accumulator_get();
+                      struct number* var_n = variable_get(var);
+
+                      int cmp = number_compare(acc, var_n);
+
+                      int jmp = 0;
+                      if (cmp == 0 && pos[5] == 'e') {
+                          jmp = 1;
+                      } else if (cmp < 0 && pos[5] == 'l') {
+                          jmp = 1;
+                      } else if (cmp > 0 && pos[5] == 'g') {
+                          jmp = 1;
+                      }
+
+                      number_destroy(acc);
+                      number_destroy(var_n);
+
+                      if (prof) {
+                          struct instruction_pointer* here;
+                          callstack_top(vm->cs, &here, 1);
+                          profile_site(prof, instruction_pointer_is_in_function(here) ? instruction_pointer_function_number(here) : -1,
+                                       instruction_pointer_offset(here), jmp ? PROFILE_TAKEN : PROFILE_NOT_TAKEN);
+                      }
+                      if (jmp) {
+                          struct instruction_pointer* cur = callstack_pop(vm->cs);
+                          int in_function = instruction_pointer_is_in_function(cur);
+                          if (!in_function) {
+                              /* Conditionals only terminate the function, not script-level thingies */
+                              /* So we need to place the old position back on the stack */
+                              callstack_push(vm->cs, instruction_pointer_with_offset(cur, instruction_pointer_offset(cur) + 6));
+                          }
+                          if (vm->loops && in_function && instruction_pointer_function_number(cur) == fun) {
+                              loops_skip(vm->loops, fun, instruction_pointer_offset(cur));
+                          }
+                          instruction_pointer_delete(cur);
+                          if (vm->summaries && summaries_apply(vm->summaries, fun)) {
+                              return;
+                          }
+                          /* Inside of functions this is a tail call */
+                          enum memo_result memoized = vm->memo ? memo_enter(vm->memo, fun, !in_function) : MEMO_NONE;
+                          if (memoized == MEMO_HIT) {
+                              return;
+                          }
+                          if (memoized == MEMO_RECORD) {
+                              callstack_push(vm->cs, instruction_pointer_marker());
+                          }
+                          callstack_push(vm->cs, instruction_pointer_from_function(fun, 0));
+                          return;
+                      }
+                      extra_offset = 6;
+                      goto offset_manipulation;
+                  }
+        default: die("unknown opcode");
+    }
+
+offset_manipulation:
+;
+    struct instruction_pointer* ip = callstack_pop(vm->cs);
+    callstack_push(vm->cs, instruction_pointer_with_offset(ip, instruction_pointer_offset(ip) + extra_offset));
+    instruction_pointer_delete(ip);
+}
+
+/* The prefix ends before reading input and before everything that would exit without die() */
+static int prefix_ends_here(struct naz_vm* vm, const char* pos) {
+    if (vm->prefix_budget-- == 0) {
+        return 1;
+    }
+    switch (pos[1]) {
+        case 'r':
+            return 1;
+        case 'd':
+        case 'p':
+            return pos[0] == '0';
+        case 'x':
+            return pos[0] == '1' && pos[2] >= '0' && pos[2] <= '9' && function_get(pos[2] - '0');
+    }
+    return 0;
+}
+
+/* Runs in a forked copy, so the machine itself never waits for the file */
+static _Noreturn void checkpoint_dump(struct naz_vm* vm) {
+    const char* path = vm->options.checkpoint;
+    char* tmp = malloc(strlen(path) + 5);
+    sprintf(tmp, "%s.tmp", path);
+    FILE* f = fopen(tmp, "w");
+    int ok = f && checkpoint_write(f, vm->cs, vm->code) == 0 && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    if (f && fclose(f) != 0) {
+        ok = 0;
+    }
+    /* The last complete checkpoint stays until the new one is complete as well */
+    if (!ok || rename(tmp, path) == -1) {
+        perror(tmp);
+        unlink(tmp);
+        _exit(EXIT_FAILURE);
+    }
+    _exit(EXIT_SUCCESS);
+}
+
+/* At most one checkpoint is written at a time, a request during that waits until it is done */
+static void vm_checkpoint(struct naz_vm* vm) {
+    if (vm->checkpoint_writer > 0) {
+        if (waitpid(vm->checkpoint_writer, NULL, WNOHANG) == 0) {
+            return;
+        }
+        vm->checkpoint_writer = 0;
+    }
+    vm->checkpoint_requested = 0;
+    /* A restored run continues after everything printed up to here */
+    fflush(vm->output ? vm->output : stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        checkpoint_dump(vm);
+    }
+    if (pid > 0) {
+        vm->checkpoint_writer = pid;
+    }
+}
+
+/* What -p counts an opcode of the source as */
+static enum profile_op profile_op_of(char digit, char code) {
+    switch (code) {
+        case 'a': return PROFILE_ADD;
+        case 's': return PROFILE_SUBTRACT;
+        case 'm': return PROFILE_MULTIPLY;
+        case 'd': return PROFILE_DIVIDE;
+        case 'p': return PROFILE_REMAINDER;
+        case 'f': return PROFILE_CALL;
+        case 'r': return PROFILE_READ;
+        case 'h': return PROFILE_HALT;
+        case 'o': return PROFILE_OUTPUT;
+        case 'v': return PROFILE_LOAD;
+        case 'n': return PROFILE_NEGATE;
+    }
+    switch (digit) {
+        case '0': return PROFILE_END;
+        case '1': return PROFILE_DEFINE;
+        case '2': return PROFILE_STORE;
+    }
+    return PROFILE_BRANCH;
+}
+
+/* Instantiated with and without -p and -t below, so the ones without have nothing of them */
+static inline __attribute__((always_inline)) void execute_checked(struct naz_vm* vm, const int profiling, const int tracing) {
+    struct profile* prof = profiling ? vm->profile : NULL;
+    struct number* const* acc = accumulator_slot();
+    const int unlimited = vm->options.unlimited;
+    struct instruction_pointer *cur;
+    cur = vm->executing = callstack_pop(vm->cs);
+    while(cur) {
+        if (instruction_pointer_is_marker(cur)) {
+            /* The memoized call returned */
+            memo_finish(vm->memo);
+            goto cleanup_forloop;
+        }
+        if (profiling) {
+            int depth = callstack_depth(vm->cs);
+            if (instruction_pointer_is_in_function(cur) && instruction_pointer_offset(cur) == 0) {
+                /* Memo markers sit between a function and its caller */
+                struct instruction_pointer* below;
+                int parent = depth - 1;
+                if (callstack_top(vm->cs, &below, 1) && instruction_pointer_is_marker(below)) {
+                    parent--;
+                }
+                profile_enter(prof, instruction_pointer_function_number(cur), parent, depth);
+            } else {
+                profile_resume(prof, depth);
+            }
+        }
+        const char* next_code;
+        int function = -1;
+        if (instruction_pointer_is_in_function(cur)) {
+            function = instruction_pointer_function_number(cur);
+            next_code = function_get(function);
+            if (!next_code) {
+                die("Using an undefined function");
+            }
+        } else {
+            next_code = vm->code;
+        }
+        for(int offset = instruction_pointer_offset(cur); next_code[offset] != '\0'; ++offset) {
+            if (next_code[offset] == '\n' || next_code[offset] == ' ') {
+                continue;
+            }
+            if (vm->prefix_budget >= 0 && prefix_ends_here(vm, next_code + offset)) {
+                callstack_push(vm->cs, instruction_pointer_with_offset(cur, offset));
+                instruction_pointer_delete(cur);
+                vm->executing = NULL;
+                return;
+            }
+            if (tracing) {
+                trace_record(vm->options.trace, function, offset, next_code + offset, number_fingerprint(*acc, unlimited),
+                             callstack_depth(vm->cs));
+            }
+            vm->steps++;
+            flight_record(vm, function, offset, number_fingerprint(*acc, unlimited));
+            if (profiling) {
+                enum profile_op op = profile_op_of(next_code[offset], next_code[offset+1]);
+                profile_count(prof, op, vm->options.unlimited && op <= PROFILE_REMAINDER ? accumulator_limbs() : 0);
+            }
+            switch(next_code[offset+1]) {
+                case 'x': {
+                              // opcodes takes an unknown number of characters and might or might not return to here at all.
+                              // In order to do that, we push our current state on callstack,
+                              // opcodes will take that from there, put the current next one on it,
+                              // and we need to pull that.
+                              callstack_push(vm->cs, instruction_pointer_with_offset(cur, offset));
+                              opcodes(vm, next_code+offset, prof);
+                              goto cleanup_forloop;
+                          }
+                case 'a': {
+                              struct number* acc = accumulator_get();
+                              number_add(acc, next_code[offset] - '0');
+                              accumulator_set(acc);
+                              break;
+                          }
+                case 's': {
+                              struct number* acc = accumulator_get();
+                              number_add(acc, -(next_code[offset] - '0'));
+                              accumulator_set(acc);
+                              break;
+                          }
+                case 'm': {
+                              struct number* acc = accumulator_get();
+                              number_multiply(acc, next_code[offset] - '0');
+                              accumulator_set(acc);
+                              break;
+                          }
+                case 'd': {
+                              if (next_code[offset] == '0' && !vm->options.unlimited) {
+                                  die_divided_by_zero();
+                              }
+                              struct number* acc = accumulator_get();
+                              number_divide(acc, next_code[offset] - '0');
+                              accumulator_set(acc);
+                              break;
+                          }
+                case 'p': {
+                              if (next_code[offset] == '0' && !vm->options.unlimited) {
+                                  die_divided_by_zero();
+                              }
+                              struct number* acc = accumulator_get();
+                              number_remainder(acc, next_code[offset] - '0');
+                              accumulator_set(acc);
+                              break;
+                          }
+                case 'f': {
+                              int functon = next_code[offset] - '0';
+                              if (profiling) {
+                                  profile_site(prof, instruction_pointer_is_in_function(cur) ? instruction_pointer_function_number(cur) : -1,
+                                               offset, PROFILE_CALLED);
+                              }
+                              if (vm->loops && next_code[offset+2] == '\0' && instruction_pointer_is_in_function(cur)
+                                      && instruction_pointer_function_number(cur) == functon) {
+                                  loops_skip(vm->loops, functon, offset);
+                              }
+                              if (vm->summaries && summaries_apply(vm->summaries, functon)) {
+                                  break;
+                              }
+                              enum memo_result memoized = vm->memo ? memo_enter(vm->memo, functon, next_code[offset+2] != '\0') : MEMO_NONE;
+                              if (memoized == MEMO_HIT) {
+                                  break;
+                              }
+                              if (next_code[offset+2] != '\0') {
+                                  struct instruction_pointer *after = instruction_pointer_with_offset(cur, offset+2);
+                                  callstack_push(vm->cs, after);
+                              }
+                              if (memoized == MEMO_RECORD) {
+                                  callstack_push(vm->cs, instruction_pointer_marker());
+                              }
+                              callstack_push(vm->cs, instruction_pointer_from_function(functon, 0));
+                              goto cleanup_forloop;
+                          }
+                case 'r': {
+                              int position = next_code[offset] - '0';
+                              int res = read_by_offset(position);
+                              struct number *acc = number_from(res);
+                              accumulator_set(acc);
+                              cycle_reset(vm);
+                              break;
+                          }
+                case 'h': {
+                              die(naz_halt_message);
+                          }
+                case 'o': {
+                              struct number *acc = accumulator_get();
+                              for (int i=next_code[offset] - '1'; i >= 0; i--) {
+                                    number_print(acc);
+                              }
+                              number_destroy(acc);
+                              cycle_reset(vm);
+                              break;
+                          }
+                case 'v': {
+                              int number = next_code[offset] - '0';
+                              struct number *var = variable_get(number);
+                              accumulator_set(var);
+                              break;
+                          }
+                case 'n': {
+                              int number = next_code[offset] - '0';
+                              struct number *var = variable_get(number);
+                              number_multiply(var, -1);
+                              variable_set(number, var);
+                              break;
+                          }
+                default: die("unknown char for interpreter loop");
+            }
+            offset++;
+        }
+cleanup_forloop:
+        instruction_pointer_delete(cur);
+        /* The callstack is all there is to the position between two calls or jumps */
+        if (vm->checkpoint_requested && vm->prefix_budget < 0) {
+            vm_checkpoint(vm);
+        }
+        if (vm->steps >= vm->next_check) {
+            vm_govern(vm);
+        }
+        cur = vm->executing = callstack_pop(vm->cs);
+        if (cur) {
+            cycle_popped(vm, callstack_depth(vm->cs));
+            if (instruction_pointer_is_in_function(cur) && instruction_pointer_offset(cur) == 0 && --vm->cycle_countdown == 0) {
+                long long vars[10];
+                for (int var = 0; var < 10; ++var) {
+                    vars[var] = variable_value(var);
+                }
+                if (cycle_enter(vm, instruction_pointer_function_number(cur), callstack_depth(vm->cs), accumulator_value(), vars)) {
+                    callstack_push(vm->cs, cur);
+                    vm->executing = NULL;
+                    die_cycle(vm);
+                }
+            }
+        }
+    }
+}
+
+static void execute(struct naz_vm* vm) {
+    execute_checked(vm, 0, 0);
+}
+
+static void execute_profiled(struct naz_vm* vm) {
+    execute_checked(vm, 1, 0);
+}
+
+static void execute_traced(struct naz_vm* vm) {
+    execute_checked(vm, 0, 1);
+}
+
+static void execute_traced_profiled(struct naz_vm* vm) {
+    execute_checked(vm, 1, 1);
+}
+
+/* Index of the first op at or after offset, as execute() skips whitespace and 0x on its own */
+static int op_at(struct naz_block* block, int offset) {
+    int lo = 0, hi = block->len;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (block->ops[mid].offset < offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* execute() on the decoded program, for programs program_verify() accepted.
+ * Syntax, function definitions and, with -u, assigned variables don't have to be checked again.
+ * Continues with whatever is on the callstack.
+ *
+ * Instantiated once per mode below, so every mode test gets folded away. The limited core keeps the
+ * accumulator and a copy of the variables in locals and writes them back before anything that looks
+ * at the state, the -u core works on the stored numbers in place.
+ */
+#define CORE_SYNC() do { if (!unlimited) accumulator_set_value(acc); } while (0)
+#define CORE_RELOAD() \
+    do { \
+        if (!unlimited) { \
+            acc = accumulator_value(); \
+            for (int var = 0; var < 10; ++var) { \
+                vars[var] = variable_value(var); \
+            } \
+        } \
+    } while (0)
+#define CORE_CHECK_RANGE(VAL) \
+    do { \
+        if ((VAL) < -127 || (VAL) > 127) { \
+            CORE_SYNC(); \
+            die("invalid result"); \
+        } \
+    } while (0)
+
+/* Tells -p that function got entered as the newest frame, the caller is the one below unless that is a memo marker */
+static void profile_frames_enter(struct naz_vm* vm, int function) {
+    int parent = vm->frames_len - 1;
+    if (parent >= 0 && vm->frames[parent].function == -2) {
+        parent--;
+    }
+    profile_enter(vm->profile, function, parent, vm->frames_len);
+}
+
+static inline __attribute__((always_inline)) void execute_verified(struct naz_vm* vm, const int unlimited, const int profiling) {
+    struct naz_program* prog = vm->prog;
+    struct profile* prof = profiling ? vm->profile : NULL;
+    vm->frames_len = 0;
+    struct callstack* reversed = callstack_new_empty();
+    struct instruction_pointer* ip;
+    while ((ip = callstack_pop(vm->cs))) {
+        callstack_push(reversed, ip);
+    }
+    while ((ip = callstack_pop(reversed))) {
+        int function = instruction_pointer_is_marker(ip) ? -2 : instruction_pointer_function_number(ip);
+        struct naz_block* block = function >= 0 ? &prog->functions[function] : &prog->toplevel;
+        int offset = instruction_pointer_offset(ip);
+        frames_push(vm, function, function == -2 ? 0 : op_at(block, offset), offset);
+        instruction_pointer_delete(ip);
+    }
+    callstack_destroy(reversed);
+    vm->verified_running = 1;
+
+    long long acc = 0;
+    long long vars[10];
+    struct number* const* acc_slot = accumulator_slot();
+    CORE_RELOAD();
+    /* Kept out of vm like acc and vars, only vm_govern() looks at them */
+    long long steps = vm->steps;
+    long long next_check = vm->next_check;
+
+    while (vm->frames_len > 0) {
+        struct frame cur = vm->frames[--vm->frames_len];
+        cycle_popped(vm, vm->frames_len);
+        if (cur.function == -2) {
+            /* The memoized call returned */
+            CORE_SYNC();
+            memo_finish(vm->memo);
+            continue;
+        }
+        if (profiling) {
+            profile_resume(prof, vm->frames_len);
+        }
+next_frame:
+        if (!unlimited && cur.op == 0 && cur.function >= 0 && --vm->cycle_countdown == 0) {
+            if (cycle_enter(vm, cur.function, vm->frames_len, acc, vars)) {
+                CORE_SYNC();
+                frames_push(vm, cur.function, cur.op, cur.offset);
+                die_cycle(vm);
+            }
+        }
+        if (steps >= next_check) {
+            CORE_SYNC();
+            vm->steps = steps;
+            /* Shows up in the dump as where the program stopped */
+            frames_push(vm, cur.function, cur.op, cur.offset);
+            vm_govern(vm);
+            vm->frames_len--;
+            next_check = vm->next_check;
+        }
+        struct naz_block* block = cur.function >= 0 ? &prog->functions[cur.function] : &prog->toplevel;
+        int first = cur.op;
+        for (int i = cur.op; i < block->len; ++i) {
+            struct naz_op* op = &block->ops[i];
+            flight_record(vm, cur.function, op->offset, unlimited ? number_fingerprint(*acc_slot, 1) : (int) acc);
+            if (profiling) {
+                enum profile_op counted = profile_op_of(block->code[op->offset], block->code[op->offset + 1]);
+                profile_count(prof, counted, unlimited && counted <= PROFILE_REMAINDER ? accumulator_limbs() : 0);
+            }
+            switch (op->code) {
+                case NAZ_OP_ADD:
+                    if (unlimited) {
+                        accumulator_add(op->arg);
+                    } else {
+                        long long res = acc + op->arg;
+                        CORE_CHECK_RANGE(res);
+                        acc = res;
+                    }
+                    break;
+                case NAZ_OP_MULTIPLY:
+                    if (unlimited) {
+                        accumulator_multiply(op->arg);
+                    } else {
+                        long long res = acc * op->arg;
+                        CORE_CHECK_RANGE(res);
+                        acc = res;
+                    }
+                    break;
+                case NAZ_OP_DIVIDE:
+                    if (unlimited) {
+                        accumulator_divide(op->arg);
+                    } else if (op->arg == 0) {
+                        CORE_SYNC();
+                        die_divided_by_zero();
+                    } else if ((acc < 0) == (op->arg < 0)) {
+                        acc = acc / op->arg;
+                    } else {
+                        /* Rounds down, like number_divide() */
+                        int rem = acc % op->arg;
+                        acc = acc / op->arg - (rem != 0);
+                    }
+                    break;
+                case NAZ_OP_REMAINDER:
+                    if (unlimited) {
+                        accumulator_remainder(op->arg);
+                    } else if (op->arg == 0) {
+                        CORE_SYNC();
+                        die_divided_by_zero();
+                    } else {
+                        acc %= op->arg;
+                    }
+                    break;
+                case NAZ_OP_CALL: {
+                    int function = op->arg;
+                    CORE_SYNC();
+                    if (profiling) {
+                        profile_site(prof, cur.function, op->offset, PROFILE_CALLED);
+                    }
+                    if (vm->loops && op->tail && function == cur.function) {
+                        loops_skip(vm->loops, function, op->offset);
+                    }
+                    if (vm->summaries && summaries_apply(vm->summaries, function)) {
+                        CORE_RELOAD();
+                        break;
+                    }
+                    enum memo_result memoized = vm->memo ? memo_enter(vm->memo, function, !op->tail) : MEMO_NONE;
+                    CORE_RELOAD();
+                    if (memoized == MEMO_HIT) {
+                        break;
+                    }
+                    if (!op->tail) {
+                        frames_push(vm, cur.function, i + 1, op->next);
+                    }
+                    if (memoized == MEMO_RECORD) {
+                        frames_push(vm, -2, 0, 0);
+                    }
+                    steps += i + 1 - first;
+                    if (profiling) {
+                        profile_frames_enter(vm, function);
+                    }
+                    cur = (struct frame) {function, 0, 0};
+                    goto next_frame;
+                }
+                case NAZ_OP_READ:
+                    CORE_SYNC();
+                    if (unlimited) {
+                        accumulator_set(number_from(read_by_offset(op->arg)));
+                    } else {
+                        acc = read_by_offset(op->arg);
+                    }
+                    cycle_reset(vm);
+                    break;
+                case NAZ_OP_OUTPUT:
+                    CORE_SYNC();
+                    cycle_reset(vm);
+                    if (!profiling && vm->folds) {
+                        /* Profiles count every op on their own */
+                        int end = folds_apply(vm->folds, cur.function, i);
+                        if (end != i) {
+                            CORE_RELOAD();
+                            i = end - 1;
+                            break;
+                        }
+                    }
+                    for (int n = op->arg; n > 0; n--) {
+                        accumulator_print();
+                    }
+                    break;
+                case NAZ_OP_LOAD:
+                    if (unlimited) {
+                        accumulator_load(op->arg);
+                    } else {
+                        acc = vars[op->arg];
+                    }
+                    break;
+                case NAZ_OP_NEGATE:
+                    if (unlimited) {
+                        variable_negate(op->arg);
+                    } else {
+                        CORE_CHECK_RANGE(-vars[op->arg]);
+                        vars[op->arg] = -vars[op->arg];
+                        variable_set_value(op->arg, vars[op->arg]);
+                    }
+                    break;
+                case NAZ_OP_STORE:
+                    if (unlimited) {
+                        variable_store(op->arg);
+                    } else {
+                        vars[op->arg] = acc;
+                        variable_set_value(op->arg, acc);
+                    }
+                    break;
+                case NAZ_OP_DEFINE:
+                    /* Verified programs define every function once */
+                    function_set(op->arg, block->code + op->offset + 4);
+                    cycle_reset(vm);
+                    break;
+                case NAZ_OP_BRANCH: {
+                    int cmp = unlimited ? accumulator_compare(op->arg) : acc - vars[op->arg];
+                    int taken = (cmp == 0 && op->cond == 'e') || (cmp < 0 && op->cond == 'l') || (cmp > 0 && op->cond == 'g');
+                    if (profiling) {
+                        profile_site(prof, cur.function, op->offset, taken ? PROFILE_TAKEN : PROFILE_NOT_TAKEN);
+                    }
+                    if (!taken) {
+                        break;
+                    }
+                    int function = op->target;
+                    int in_function = cur.function >= 0;
+                    steps += i + 1 - first;
+                    CORE_SYNC();
+                    if (!in_function) {
+                        /* Toplevel jumps return to the next op */
+                        frames_push(vm, cur.function, i + 1, op->next);
+                    } else if (vm->loops && function == cur.function) {
+                        loops_skip(vm->loops, function, op->offset);
+                    }
+                    if (vm->summaries && summaries_apply(vm->summaries, function)) {
+                        CORE_RELOAD();
+                        goto frame_done;
+                    }
+                    enum memo_result memoized = vm->memo ? memo_enter(vm->memo, function, !in_function) : MEMO_NONE;
+                    CORE_RELOAD();
+                    if (memoized == MEMO_HIT) {
+                        goto frame_done;
+                    }
+                    if (memoized == MEMO_RECORD) {
+                        frames_push(vm, -2, 0, 0);
+                    }
+                    if (profiling) {
+                        profile_frames_enter(vm, function);
+                    }
+                    cur = (struct frame) {function, 0, 0};
+                    goto next_frame;
+                }
+                case NAZ_OP_DIE:
+                    CORE_SYNC();
+                    if (op->pushed) {
+                        frames_push(vm, cur.function, i, op->offset);
+                    }
+                    die(op->msg);
+            }
+        }
+        steps += block->len - first;
+frame_done:
+        ;
+    }
+    CORE_SYNC();
+    vm->steps = steps;
+    vm->verified_running = 0;
+}
+
+#undef CORE_SYNC
+#undef CORE_RELOAD
+#undef CORE_CHECK_RANGE
+
+static void execute_verified_limited(struct naz_vm* vm) {
+    execute_verified(vm, 0, 0);
+}
+
+static void execute_verified_unlimited(struct naz_vm* vm) {
+    execute_verified(vm, 1, 0);
+}
+
+static void execute_verified_limited_profiled(struct naz_vm* vm) {
+    execute_verified(vm, 0, 1);
+}
+
+static void execute_verified_unlimited_profiled(struct naz_vm* vm) {
+    execute_verified(vm, 1, 1);
+}
+
+/* Runs the program up to the first instruction depending on input, recording its output.
+ * Returns NULL if the program dies before that, the state is reset to the very beginning then
+ */
+static struct snapshot* evaluate_prefix(struct naz_vm* vm) {
+    char* output;
+    size_t output_len;
+    FILE* recorder = open_memstream(&output, &output_len);
+    naz_set_output(recorder);
+    vm->prefix_budget = vm->options.prefix_limit;
+    int aborted = setjmp(vm->prefix_abort);
+    if (!aborted) {
+        execute(vm);
+    }
+    vm->prefix_budget = -1;
+    naz_set_output(vm->output);
+    fclose(recorder);
+
+    if (aborted) {
+        free(output);
+        instruction_pointer_delete(vm->executing);
+        vm->executing = NULL;
+        if (vm->memo) {
+            memo_clear(vm->memo);
+        }
+        naz_state_reset(vm->state);
+        callstack_destroy(vm->cs);
+        vm->cs = callstack_new_empty();
+        callstack_push(vm->cs, instruction_pointer_from_file(0));
+        return NULL;
+    }
+    return snapshot_take(vm->cs, output, output_len);
+}
+
+int program_prepare(char* program, void (*unexpected)(char)) {
+    int is_comment = 0;
+    for(int offset = 0; program[offset] != '\0'; ) {
+        if (is_comment && program[offset] != '\n') {
+            /* Keep the comment flag, clear the content */
+            program[offset] = ' ';
+            offset++;
+            continue;
+        } else if (is_comment) {
+            offset++;
+            is_comment = 0;
+            continue;
+        }
+        if (program[offset] == '#') {
+            is_comment = 1;
+            program[offset] = ' ';
+            offset++;
+            continue;
+        }
+        if (program[offset] >= '0' && program[offset] <= '9') {
+            switch(program[offset+1]) {
+                case 'a':
+                case 'd':
+                case 'e':
+                case 'f':
+                case 'g':
+                case 'h':
+                case 'l':
+                case 'm':
+                case 'n':
+                case 'o':
+                case 'p':
+                case 'r':
+                case 's':
+                case 'v':
+                case 'x':
+                    break;
+                default:
+                    return offset;
+            }
+            offset += 2;
+            continue;
+        }
+        if (program[offset] == '\n') {
+            offset++;
+            continue;
+        }
+        if (program[offset] == ' ') {
+            /* Do nothing */
+            offset++;
+            continue;
+        }
+        if (unexpected) {
+            unexpected(program[offset]);
+        }
+        offset++;
+    }
+    return -1;
+}
+
+struct naz_vm* vm_new(const struct naz_vm_options* options) {
+    static const struct naz_vm_options defaults = {.prefix_limit = -1};
+    struct naz_vm* out = calloc(1, sizeof(*out));
+    out->options = options ? *options : defaults;
+    if (out->options.checkpoint) {
+        /* Neither has its state on the callstack */
+        out->options.jit = 0;
+        out->options.memo_bytes = 0;
+    }
+    if (out->options.max_steps > 0 || out->options.max_seconds > 0 || out->options.metrics || out->options.trace) {
+        /* Compiled code never comes by the governor, nor traces */
+        out->options.jit = 0;
+    }
+    if (out->options.profile) {
+        /* Nor does it count anything */
+        out->options.jit = 0;
+        out->profile = profile_new();
+        if (out->options.profile_counters) {
+            profile_counters(out->profile);
+        }
+    }
+    /* Only limited numbers have finitely many states */
+    out->cycle_check = !out->options.unlimited && !out->options.no_cycle_check;
+    cycle_arm(out);
+    out->state = naz_state_new(out->options.unlimited);
+    out->cs = callstack_new_empty();
+    out->prefix_budget = -1;
+    return out;
+}
+
+/* Drops the loaded program together with everything derived from it */
+static void vm_unload(struct naz_vm* vm) {
+    if (vm->jit)
+        jit_destroy(vm->jit);
+    if (vm->summaries)
+        summaries_destroy(vm->summaries);
+    if (vm->loops)
+        loops_destroy(vm->loops);
+    if (vm->folds)
+        folds_destroy(vm->folds);
+    if (vm->memo)
+        memo_destroy(vm->memo);
+    if (vm->prefix)
+        snapshot_destroy(vm->prefix);
+    if (vm->prog && !vm->shared)
+        program_destroy(vm->prog);
+    if (!vm->shared)
+        free(vm->code);
+    vm->jit = NULL;
+    vm->summaries = NULL;
+    vm->loops = NULL;
+    vm->folds = NULL;
+    vm->memo = NULL;
+    vm->prefix = NULL;
+    vm->prefix_done = 0;
+    vm->prog = NULL;
+    vm->code = NULL;
+    vm->shared = 0;
+}
+
+/* Everything a machine derives from the decoded program for itself */
+static void vm_attach(struct naz_vm* vm) {
+    if (vm->options.jit && !vm->options.unlimited) {
+        vm->jit = jit_compile(vm->prog);
+    }
+    if (vm->jit) {
+        return;
+    }
+    if (vm->options.tables && !vm->options.unlimited) {
+        vm->summaries = summaries_new(vm->prog);
+    }
+    if (vm->options.loops) {
+        vm->loops = loops_new(vm->prog, vm->options.unlimited);
+    }
+    if (vm->options.folds) {
+        vm->folds = folds_new(vm->prog, vm->options.unlimited);
+    }
+    if (vm->options.memo_bytes > 0) {
+        vm->memo = memo_new(vm->prog, vm->options.memo_bytes);
+    }
+}
+
+enum naz_vm_status vm_load(struct naz_vm* vm, const char* code) {
+    struct naz_state* prev = naz_state_use(vm->state);
+    vm_unload(vm);
+    vm->code = strdup(code);
+    if (program_prepare(vm->code, NULL) != -1) {
+        vm->error_errno = errno;
+        vm->status = NAZ_VM_DIED;
+        snprintf(vm->error, sizeof(vm->error), "%s", "unexpected tupel");
+        naz_state_use(prev);
+        return vm->status;
+    }
+
+    vm->prog = program_decode(vm->code);
+    /* Programs that are proven well-behaved run without the checks */
+    int required = NAZ_VERIFIED_SYNTAX | NAZ_VERIFIED_CALLS | (vm->options.unlimited ? NAZ_VERIFIED_VARIABLES : 0);
+    vm->verified = (program_verify(vm->prog) & required) == required;
+    vm_attach(vm);
+    naz_state_use(prev);
+    vm->status = NAZ_VM_OK;
+    return vm->status;
+}
+
+struct naz_vm* vm_clone(struct naz_vm* vm) {
+    struct naz_vm* out = vm_new(&vm->options);
+    out->code = vm->code;
+    out->prog = vm->prog;
+    out->shared = 1;
+    out->verified = vm->verified;
+    vm_attach(out);
+    return out;
+}
+
+static ssize_t vm_cookie_write(void* cookie, const char* buf, size_t len) {
+    struct naz_vm* vm = cookie;
+    size_t written = vm->write(vm->user, buf, len);
+    return written < len ? -1 : (ssize_t) written;
+}
+
+static void vm_execute(struct naz_vm* vm) {
+    if (vm->resume) {
+        callstack_destroy(vm->cs);
+        vm->cs = vm->resume;
+        vm->resume = NULL;
+        if (!vm->read) {
+            /* Pipes have to start with the rest of the input on their own */
+            lseek(STDIN_FILENO, checkpoint_input_read(), SEEK_SET);
+        }
+    } else if (vm->jit) {
+        jit_run(vm->jit);
+        return;
+    } else {
+        callstack_push(vm->cs, instruction_pointer_from_file(0));
+        if (vm->options.prefix_limit >= 0) {
+            if (!vm->prefix_done) {
+                vm->prefix = evaluate_prefix(vm);
+                vm->prefix_done = 1;
+            }
+            if (vm->prefix) {
+                callstack_destroy(vm->cs);
+                vm->cs = snapshot_restore(vm->prefix);
+            }
+        }
+    }
+    /* The budgets start after the prefix */
+    vm->steps = 0;
+    governor_arm(vm);
+    cycle_arm(vm);
+    /* Only execute() stops where a checkpoint can be taken, and only it traces */
+    if (vm->options.trace) {
+        void (*core)(struct naz_vm*) = vm->profile ? execute_traced_profiled : execute_traced;
+        core(vm);
+    } else if (vm->verified && !vm->options.checkpoint && vm->profile) {
+        void (*core)(struct naz_vm*) = vm->options.unlimited ? execute_verified_unlimited_profiled : execute_verified_limited_profiled;
+        core(vm);
+    } else if (vm->verified && !vm->options.checkpoint) {
+        void (*core)(struct naz_vm*) = vm->options.unlimited ? execute_verified_unlimited : execute_verified_limited;
+        core(vm);
+    } else if (vm->profile) {
+        execute_profiled(vm);
+    } else {
+        execute(vm);
+    }
+}
+
+enum naz_vm_status vm_run(struct naz_vm* vm, naz_read_fn read, naz_write_fn write, void* user) {
+    struct naz_vm* prev_vm = running;
+    struct naz_state* prev = naz_state_use(vm->state);
+    running = vm;
+    if (vm->runs++ > 0 && !vm->resume) {
+        /* Caches stay, everything the last run changed goes */
+        if (vm->memo && vm->status != NAZ_VM_OK) {
+            memo_clear(vm->memo);
+        }
+        naz_state_reset(vm->state);
+        callstack_destroy(vm->cs);
+        vm->cs = callstack_new_empty();
+        if (vm->jit) {
+            jit_reset(vm->jit);
+        }
+    }
+    vm->verified_running = 0;
+    vm->read = read;
+    vm->write = write;
+    vm->user = user;
+    vm->output = write ? fopencookie(vm, "w", (cookie_io_functions_t) {.write = vm_cookie_write}) : NULL;
+    naz_set_input(read, user);
+    naz_set_output(vm->output);
+
+    vm->status = NAZ_VM_OK;
+    vm->steps = 0;
+    governor_arm(vm);
+    cycle_arm(vm);
+    clock_gettime(CLOCK_MONOTONIC, &vm->started);
+    vm->stats_steps = 0;
+    vm->stats_time = vm->started;
+    vm->flight_pos = 0;
+    /* The first look of the governor writes the metrics right away */
+    vm->metrics_time = (struct timespec) {0};
+    naz_set_memory_limit(vm->options.max_memory);
+    if (!setjmp(vm->abort)) {
+        vm_execute(vm);
+    }
+    if (vm->profile) {
+        profile_stop(vm->profile);
+    }
+    /* Dumping the state must not run out of memory again */
+    naz_set_memory_limit(0);
+    vm->prefix_budget = -1;
+    if (vm->executing) {
+        instruction_pointer_delete(vm->executing);
+        vm->executing = NULL;
+    }
+    if (vm->checkpoint_writer > 0) {
+        waitpid(vm->checkpoint_writer, NULL, 0);
+        vm->checkpoint_writer = 0;
+    }
+
+    naz_set_input(NULL, NULL);
+    naz_set_output(NULL);
+    /* Passes on everything that is still buffered */
+    if (vm->output)
+        fclose(vm->output);
+    vm->output = NULL;
+    running = prev_vm;
+    naz_state_use(prev);
+    return vm->status;
+}
+
+void vm_warm(struct naz_vm* vm) {
+    if (vm->jit || vm->options.prefix_limit < 0 || vm->prefix_done) {
+        return;
+    }
+    struct naz_vm* prev_vm = running;
+    struct naz_state* prev = naz_state_use(vm->state);
+    running = vm;
+    callstack_push(vm->cs, instruction_pointer_from_file(0));
+    vm->prefix = evaluate_prefix(vm);
+    vm->prefix_done = 1;
+    /* The first run starts from the snapshot as well */
+    naz_state_reset(vm->state);
+    callstack_destroy(vm->cs);
+    vm->cs = callstack_new_empty();
+    running = prev_vm;
+    naz_state_use(prev);
+}
+
+void vm_request_checkpoint(struct naz_vm* vm) {
+    vm->checkpoint_requested = 1;
+}
+
+void vm_request_stats(struct naz_vm* vm) {
+    vm->stats_requested = 1;
+}
+
+int vm_restore(struct naz_vm* vm, const char* path) {
+    if (vm->jit) {
+        snprintf(vm->error, sizeof(vm->error), "%s: %s", path, "compiled code cannot continue from a checkpoint");
+        return -1;
+    }
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        snprintf(vm->error, sizeof(vm->error), "%s: %s", path, strerror(errno));
+        return -1;
+    }
+    const char* error;
+    struct naz_state* prev = naz_state_use(vm->state);
+    struct callstack* cs = checkpoint_read(f, vm->code, &error);
+    naz_state_use(prev);
+    fclose(f);
+    if (!cs) {
+        snprintf(vm->error, sizeof(vm->error), "%s: %s", path, error);
+        return -1;
+    }
+    if (vm->resume) {
+        callstack_destroy(vm->resume);
+    }
+    vm->resume = cs;
+    return 0;
+}
+
+int vm_report(struct naz_vm* vm, enum naz_vm_status status) {
+    switch (status) {
+        case NAZ_VM_OK:
+            return EXIT_SUCCESS;
+        case NAZ_VM_DIED:
+        case NAZ_VM_HALTED:
+            vm_perror(vm);
+            return EXIT_FAILURE;
+        case NAZ_VM_REDEFINED:
+            fprintf(stderr, "%s\n", vm_error(vm));
+            return EXIT_FAILURE;
+        case NAZ_VM_DIVIDED_BY_ZERO:
+            /* Dies the way it always did, without flushing stdout */
+            vm_dump_flight(vm, STDERR_FILENO);
+            signal(SIGFPE, SIG_DFL);
+            raise(SIGFPE);
+            break;
+        case NAZ_VM_OVER_BUDGET:
+            fprintf(stderr, "%s\n", vm_error(vm));
+            vm_dump(vm);
+            return NAZ_EXIT_OVER_BUDGET;
+        case NAZ_VM_LOOPING:
+            fprintf(stderr, "%s\n", vm_error(vm));
+            vm_dump(vm);
+            return NAZ_EXIT_LOOPING;
+    }
+    return EXIT_FAILURE;
+}
+
+const char* vm_error(struct naz_vm* vm) {
+    return vm->error;
+}
+
+void vm_dump(struct naz_vm* vm) {
+    struct naz_state* prev = naz_state_use(vm->state);
+    debug(vm);
+    naz_state_use(prev);
+    vm_dump_flight(vm, STDERR_FILENO);
+}
+
+/* Without stdio, for signal handlers */
+static char* format_text(char* out, const char* text) {
+    while (*text) {
+        *out++ = *text++;
+    }
+    return out;
+}
+
+static char* format_int(char* out, long long n) {
+    char digits[24];
+    int len = 0;
+    unsigned long long rest = n < 0 ? -(unsigned long long) n : (unsigned long long) n;
+    do {
+        digits[len++] = '0' + rest % 10;
+        rest /= 10;
+    } while (rest);
+    if (n < 0) {
+        *out++ = '-';
+    }
+    while (len) {
+        *out++ = digits[--len];
+    }
+    return out;
+}
+
+void vm_dump_flight(struct naz_vm* vm, int fd) {
+    unsigned long long end = vm->flight_pos;
+    unsigned long long start = end > FLIGHT_LEN ? end - FLIGHT_LEN : 0;
+    if (start == end) {
+        return;
+    }
+    /* Functions cannot be redefined, so the code is still the one that ran */
+    struct naz_state* prev = naz_state_use(vm->state);
+    char line[128];
+    char* out = format_text(line, "Last ");
+    out = format_int(out, end - start);
+    out = format_text(out, " instructions, the newest last:\n");
+    int failed = write(fd, line, out - line) == -1;
+    for (unsigned long long i = start; i < end && !failed; ++i) {
+        struct flight_entry* entry = &vm->flight[i % FLIGHT_LEN];
+        const char* code = entry->function >= 0 ? function_get(entry->function) : vm->code;
+        out = entry->function >= 0 ? format_int(line, entry->function) : format_text(line, "Toplevel");
+        *out++ = ':';
+        out = format_int(out, entry->offset);
+        *out++ = ' ';
+        *out++ = code ? code[entry->offset] : '?';
+        *out++ = code ? code[entry->offset + 1] : '?';
+        out = format_text(out, " acc ");
+        out = format_int(out, entry->acc);
+        *out++ = '\n';
+        failed = write(fd, line, out - line) == -1;
+    }
+    naz_state_use(prev);
+}
+
+void vm_perror(struct naz_vm* vm) {
+    errno = vm->error_errno;
+    perror(vm->error);
+    vm_dump(vm);
+}
+
+struct profile* vm_profile(struct naz_vm* vm) {
+    return vm->profile;
+}
+
+void vm_print_stats(struct naz_vm* vm, FILE* out) {
+    if (vm->memo) {
+        memo_print_stats(vm->memo, out);
+    }
+}
+
+void vm_destroy(struct naz_vm* vm) {
+    struct naz_state* prev = naz_state_use(vm->state);
+    vm_unload(vm);
+    free(vm->frames);
+    callstack_destroy(vm->cs);
+    if (vm->resume)
+        callstack_destroy(vm->resume);
+    if (vm->profile)
+        profile_destroy(vm->profile);
+    naz_state_use(prev);
+    naz_state_destroy(vm->state);
+    free(vm);
+}
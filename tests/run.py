@@ -0,0 +1,384 @@
+#!/usr/bin/env python3
+#    Copyright (C) 2022 Tobias Heineken
+#
+#    This program is free software: you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, either version 3 of the License, or
+#    (at your option) any later version.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+"""Runs every test program plainly and under every flag that must not change what a program does,
+and translated to C by --emit-c, compiled with $CC and linked against nazlib.c.
+
+A program starts with "# check: mode=unlimited exit=1", both fields are optional and default to
+limited numbers and exit code 0, a negative exit code is the signal that ended the interpreter.
+"args=--max-steps=100,-M" adds arguments to every run and "flags=no" runs the program only plainly,
+"emit=no" leaves out the C translation, for programs --emit-c refuses or that only the interpreter stops.
+NAME.in is its standard input if it exists, its standard output must be exactly NAME.out,
+including the dump after a program died. Every mismatch is reported and the exit code is 1.
+
+Afterwards, the scenarios check what takes more than one input, process or run of the interpreter.
+"""
+
+import argparse
+import os
+import re
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+MODES = {"limited": [], "unlimited": ["-u"]}
+HEADER = re.compile(r"#\s*check:(.*)")
+FLAGS = [
+    [],
+    ["-j"],
+    ["-P"],
+    ["-T"],
+    ["-M"],
+    ["-L"],
+    # The budgeted cores
+    ["--max-steps=1000000000"],
+    # The profiled cores
+    ["-p"],
+    # The checked core
+    ["-t", os.devnull],
+    ["-s"],
+    ["-T", "-M", "-L", "-P", "-s"],
+]
+CC = os.environ.get("CC", "cc")
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+ECHO = os.path.join(ROOT, "tests", "echo.naz")
+# Reads a byte, prints it and counts to 90 cubed, 24 times, which takes a few seconds on the checked core
+SLOW = ("1x1f1a3x9v1l0x\n1x2f0m1f2v1a2x2v3x9v2l0x\n1x3f0m2x2v2f4v1a2x4v3x9v3l0x\n1x5f1r1o0m2x4v3f6v1a2x6v3x8v5l0x\n"
+        "0m9a9a9a9a9a9a9a9a9a9a2x9v0m9a9a6a2x8v0m2x6v5f0m9a1a1o\n")
+ECHO_STOP = os.path.join(ROOT, "tests", "echo_stop.naz")
+
+
+def parse_header(path):
+    """Returns the fields of the check header in the first line of path"""
+    with open(path) as f:
+        match = HEADER.match(f.readline())
+    if not match:
+        return None
+    header = {"mode": "limited", "exit": 0, "args": [], "flags": True, "emit": True}
+    for field in match.group(1).split():
+        key, _, value = field.partition("=")
+        if key not in header:
+            raise SystemExit("%s: unknown check field %s" % (path, key))
+        if key == "exit":
+            header[key] = int(value)
+        elif key == "args":
+            header[key] = value.split(",")
+        elif key == "flags":
+            header[key] = value != "no"
+        elif key == "emit":
+            header[key] = value != "no"
+        else:
+            header[key] = value
+    if header["mode"] not in MODES:
+        raise SystemExit("%s: unknown mode %s" % (path, header["mode"]))
+    return header
+
+
+def compare(command, base, code):
+    """Runs command on NAME.in, returns why its output is not NAME.out or it did not exit with code, or None"""
+    input_path = base + ".in" if os.path.exists(base + ".in") else os.devnull
+    with open(base + ".out", "rb") as f:
+        expected = f.read()
+    with open(input_path, "rb") as stdin:
+        child = subprocess.run(command, stdin=stdin, stdout=subprocess.PIPE, stderr=subprocess.DEVNULL, timeout=60)
+    if child.returncode != code:
+        return "exit %d instead of %d" % (child.returncode, code)
+    if child.stdout != expected:
+        return "output differs from %s.out" % os.path.basename(base)
+    return None
+
+
+def check(interpreter, program, header, flags):
+    """Returns why the run with flags went wrong, or None"""
+    command = [interpreter] + MODES[header["mode"]] + flags + header["args"] + [program]
+    return compare(command, program[:-len(".naz")], header["exit"])
+
+
+def check_emitted(interpreter, program, header, build):
+    """Returns why the C translation went wrong, or None. build holds nazlib.o"""
+    base = os.path.join(build, os.path.basename(program)[:-len(".naz")])
+    with open(base + ".c", "wb") as out:
+        child = subprocess.run([interpreter] + MODES[header["mode"]] + ["--emit-c", program], stdout=out,
+                               stderr=subprocess.PIPE)
+    if child.returncode != 0:
+        return "--emit-c failed: %s" % child.stderr.decode(errors="replace").strip()
+    child = subprocess.run([CC, "-std=gnu99", "-O2", "-I", ROOT, "-o", base, base + ".c",
+                            os.path.join(build, "nazlib.o")], stderr=subprocess.PIPE)
+    if child.returncode != 0:
+        return "compiling failed: %s" % child.stderr.decode(errors="replace").strip()
+    return compare([base], program[:-len(".naz")], header["exit"])
+
+
+def check_batch(interpreter):
+    """-b runs the program on every file of a directory and reports the inputs that failed"""
+    inputs = {"empty": b"", "line": b"hello world\n", "lines": b"first\nsecond ~!\n" * 500, "control": b"ab\vcd"}
+    with tempfile.TemporaryDirectory() as tmp:
+        os.mkdir(os.path.join(tmp, "in"))
+        os.mkdir(os.path.join(tmp, "out"))
+        for name, data in inputs.items():
+            with open(os.path.join(tmp, "in", name), "wb") as f:
+                f.write(data)
+        child = subprocess.run([interpreter, "-b", "--threads=3", ECHO, os.path.join(tmp, "in"),
+                                os.path.join(tmp, "out")], stdout=subprocess.PIPE, stderr=subprocess.DEVNULL,
+                               timeout=60)
+        if child.returncode != 1:
+            return "exit %d instead of 1 with one input failing" % child.returncode
+        if b"control: exit 1" not in child.stdout:
+            return "the failing input is not reported"
+        for name, data in inputs.items():
+            with open(os.path.join(tmp, "out", name), "rb") as f:
+                if name != "control" and f.read() != data:
+                    return "output for %s differs from its input" % name
+    return None
+
+
+def check_map(interpreter):
+    """-m runs the program once per line and writes the outputs in the order of the lines"""
+    lines = [b"line %d of the input\n" % i for i in range(300)]
+    lines[123] = b"ab\vcd\n"
+    child = subprocess.run([interpreter, "-m", "--threads=4", ECHO], input=b"".join(lines), stdout=subprocess.PIPE,
+                           stderr=subprocess.PIPE, timeout=60)
+    if child.returncode != 1:
+        return "exit %d instead of 1 with one line failing" % child.returncode
+    if b"record 124: exit 1" not in child.stderr:
+        return "the failing line is not reported"
+    lines[123] = b"ab"
+    if child.stdout != b"".join(lines):
+        return "output differs from the lines"
+    return None
+
+
+def start_server(command, path):
+    """Returns the server process once it listens on path, None if it did not get there"""
+    server = subprocess.Popen(command, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+    for _ in range(100):
+        if os.path.exists(path):
+            return server
+        if server.poll() is not None:
+            break
+        time.sleep(0.1)
+    server.kill()
+    server.wait()
+    return None
+
+
+def check_serve(interpreter):
+    """--serve runs the program once per connection, with several of them at the same time"""
+    with tempfile.TemporaryDirectory() as tmp:
+        path = os.path.join(tmp, "naz.sock")
+        server = start_server([interpreter, "--serve", path, "--prefork=2", ECHO], path)
+        if not server:
+            return "the server did not start listening"
+        outputs = {}
+
+        def client(number):
+            with socket.socket(socket.AF_UNIX) as s:
+                s.settimeout(30)
+                s.connect(path)
+                s.sendall(b"client %d\n" % number * 100)
+                s.shutdown(socket.SHUT_WR)
+                received = []
+                while True:
+                    data = s.recv(4096)
+                    if not data:
+                        break
+                    received.append(data)
+                outputs[number] = b"".join(received)
+
+        clients = [threading.Thread(target=client, args=(number,)) for number in range(8)]
+        for thread in clients:
+            thread.start()
+        for thread in clients:
+            thread.join()
+        server.send_signal(signal.SIGTERM)
+        _, stderr = server.communicate(timeout=30)
+    if server.returncode != 0:
+        return "exit %d instead of 0" % server.returncode
+    for number in range(8):
+        if outputs.get(number) != b"client %d\n" % number * 100:
+            return "client %d got a different output" % number
+    if b"8 connections, 0 failed" not in stderr:
+        return "the summary does not count 8 connections"
+    return None
+
+
+def check_checkpoint(interpreter):
+    """A run killed after a checkpoint and restored from it prints what a run without a break does"""
+    with tempfile.TemporaryDirectory() as tmp:
+        program = os.path.join(tmp, "slow.naz")
+        input_path = os.path.join(tmp, "input")
+        checkpoint = os.path.join(tmp, "checkpoint")
+        with open(program, "w") as f:
+            f.write(SLOW)
+        with open(input_path, "wb") as f:
+            f.write(b"abcdefghijklmnopqrstuvwx")
+        for mode, flags in MODES.items():
+            with open(input_path, "rb") as stdin:
+                plain = subprocess.run([interpreter] + flags + [program], stdin=stdin, stdout=subprocess.PIPE,
+                                       timeout=60)
+            with open(input_path, "rb") as stdin:
+                killed = subprocess.Popen([interpreter] + flags + ["--checkpoint=" + checkpoint,
+                                          "--checkpoint-every=1", program], stdin=stdin, stdout=subprocess.PIPE)
+                time.sleep(1.5)
+                killed.send_signal(signal.SIGKILL)
+                before, _ = killed.communicate()
+            if killed.returncode != -signal.SIGKILL:
+                return "%s: ended before getting killed" % mode
+            if not os.path.exists(checkpoint):
+                return "%s: no checkpoint after a second" % mode
+            with open(input_path, "rb") as stdin:
+                restored = subprocess.run([interpreter] + flags + ["--restore=" + checkpoint, program], stdin=stdin,
+                                          stdout=subprocess.PIPE, timeout=60)
+            os.remove(checkpoint)
+            if restored.returncode != plain.returncode:
+                return "%s: restored run exits %d instead of %d" % (mode, restored.returncode, plain.returncode)
+            if before + restored.stdout != plain.stdout:
+                return "%s: output before the kill and after restoring differs from a plain run" % mode
+    return None
+
+
+def check_record(interpreter):
+    """--replay of a --record log gives the recorded output, a cut off log ends the input early"""
+    data = b"".join(b"%d bottles of beer on the wall\n" % i for i in range(500))
+    with tempfile.TemporaryDirectory() as tmp:
+        log = os.path.join(tmp, "log")
+        recorded = subprocess.run([interpreter, "--record=" + log, ECHO], input=data, stdout=subprocess.PIPE,
+                                  timeout=60)
+        replayed = subprocess.run([interpreter, "--replay=" + log, ECHO], stdin=subprocess.DEVNULL,
+                                  stdout=subprocess.PIPE, timeout=60)
+        if recorded.returncode != 0 or recorded.stdout != data:
+            return "recording changed the run"
+        if replayed.returncode != 0 or replayed.stdout != data:
+            return "replaying differs from the recorded run"
+        with open(log, "rb") as f:
+            whole = f.read()
+        with open(log, "wb") as f:
+            f.write(whole[:len(whole) // 2])
+        cut = subprocess.run([interpreter, "--replay=" + log, ECHO], stdin=subprocess.DEVNULL,
+                             stdout=subprocess.PIPE, timeout=60)
+    if cut.returncode != 0:
+        return "exit %d instead of 0 on a cut off log" % cut.returncode
+    if not data.startswith(cut.stdout) or len(cut.stdout) >= len(data):
+        return "a cut off log does not give the start of the output"
+    return None
+
+
+def check_open_input(interpreter):
+    """-L copies the input that is there without waiting for more, so a program stopping at "." ends
+    while the other side keeps stdin or the connection open"""
+    child = subprocess.Popen([interpreter, "-L", ECHO_STOP], stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+    child.stdin.write(b"abc.")
+    child.stdin.flush()
+    try:
+        child.wait(timeout=10)
+    except subprocess.TimeoutExpired:
+        child.kill()
+        return "waits for more input on stdin after the ."
+    finally:
+        child.stdin.close()
+    stdout = child.stdout.read()
+    child.stdout.close()
+    if child.returncode != 0 or stdout != b"abc":
+        return "exit %d and output %r on stdin instead of 0 and b'abc'" % (child.returncode, stdout)
+    with tempfile.TemporaryDirectory() as tmp:
+        path = os.path.join(tmp, "naz.sock")
+        server = start_server([interpreter, "-L", "--serve", path, "--prefork=1", ECHO_STOP], path)
+        if not server:
+            return "the server did not start listening"
+        received = []
+        try:
+            with socket.socket(socket.AF_UNIX) as s:
+                s.settimeout(10)
+                s.connect(path)
+                s.sendall(b"abc.")
+                while True:
+                    data = s.recv(4096)
+                    if not data:
+                        break
+                    received.append(data)
+        except socket.timeout:
+            return "waits for more input on the connection after the ."
+        finally:
+            server.send_signal(signal.SIGTERM)
+            server.communicate(timeout=30)
+    if b"".join(received) != b"abc":
+        return "output %r on the connection instead of b'abc'" % b"".join(received)
+    return None
+
+
+SCENARIOS = [
+    check_batch,
+    check_map,
+    check_serve,
+    check_checkpoint,
+    check_record,
+    check_open_input,
+]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("interpreter")
+    parser.add_argument("programs", nargs="*", help="defaults to tests/*.naz")
+    args = parser.parse_args()
+
+    here = os.path.dirname(os.path.abspath(__file__))
+    programs = args.programs or sorted(os.path.join(here, name) for name in os.listdir(here) if name.endswith(".naz"))
+
+    runs, failed = 0, []
+    headers = {}
+    for program in programs:
+        header = parse_header(program)
+        if header is None:
+            print("%s: no check header, skipped" % program, file=sys.stderr)
+            continue
+        headers[program] = header
+        for flags in FLAGS if header["flags"] else [[]]:
+            runs += 1
+            why = check(args.interpreter, program, header, flags)
+            if why:
+                failed.append("%s (%s%s): %s" % (os.path.basename(program), header["mode"],
+                                                 "".join(" " + f for f in flags), why))
+
+    with tempfile.TemporaryDirectory() as build:
+        subprocess.run([CC, "-std=gnu99", "-O2", "-c", "-o", os.path.join(build, "nazlib.o"),
+                        os.path.join(ROOT, "nazlib.c")], check=True)
+        for program, header in headers.items():
+            if header["emit"]:
+                runs += 1
+                why = check_emitted(args.interpreter, program, header, build)
+                if why:
+                    failed.append("%s (%s --emit-c): %s" % (os.path.basename(program), header["mode"], why))
+
+    if not args.programs:
+        for scenario in SCENARIOS:
+            runs += 1
+            why = scenario(args.interpreter)
+            if why:
+                failed.append("%s: %s" % (scenario.__name__[len("check_"):], why))
+
+    for line in failed:
+        print(line, file=sys.stderr)
+    print("%d of %d runs passed" % (runs - len(failed), runs), file=sys.stderr)
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,89 @@
+/*
+    Copyright (C) 2022 Tobias Heineken
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+/*
+ * Prints a trace written by interpreter -t, one instruction per line in the format of the
+ * post-mortem dump, preceded by its number in the run and followed by the callstack depth.
+ * -s prints how often every opcode got traced instead.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../nazlib.h"
+
+static void usage(const char* self) {
+    fprintf(stderr, "Usage: %s [-s] <trace>\n", self);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv) {
+    int summary = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "s")) != -1) {
+        switch (opt) {
+            case 's': summary = 1; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+    }
+    FILE* in = fopen(argv[optind], "rb");
+    if (!in) {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+    char magic[sizeof(NAZ_TRACE_MAGIC)] = {0};
+    if (fread(magic, 1, sizeof(magic) - 1, in) != sizeof(magic) - 1 || strcmp(magic, NAZ_TRACE_MAGIC) != 0) {
+        fprintf(stderr, "%s: not a trace\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    unsigned long long step = 0, entries = 0, counts[256] = {0};
+    int saturated = 0;
+    struct naz_trace_entry e;
+    while (fread(&e, sizeof(e), 1, in) == 1) {
+        step += e.skipped + 1;
+        entries++;
+        saturated |= e.skipped == UINT32_MAX;
+        if (summary) {
+            counts[(unsigned char) e.opcode]++;
+            continue;
+        }
+        if (e.function >= 0) {
+            printf("%llu %d:%d %c%c acc %d depth %u\n", step, e.function, e.offset, e.digit, e.opcode, e.acc, e.depth);
+        } else {
+            printf("%llu Toplevel:%d %c%c acc %d depth %u\n", step, e.offset, e.digit, e.opcode, e.acc, e.depth);
+        }
+    }
+    if (summary) {
+        for (int op = 0; op < 256; ++op) {
+            if (counts[op]) {
+                printf("%c %llu\n", op, counts[op]);
+            }
+        }
+        printf("%llu instructions traced\n", entries);
+    }
+    if (saturated) {
+        fprintf(stderr, "More than %u instructions in a row got filtered out, the numbers are too small from there on\n", UINT32_MAX);
+    }
+    fclose(in);
+    return EXIT_SUCCESS;
+}